@@ -0,0 +1,1389 @@
+// Microbenchmarks for the core kernels. Builds like main.c, which it
+// includes with main() left out:
+//
+//   cc -O2 -pthread bench.c -lm -o bench
+//
+// Every case is calibrated to run for at least BENCH_MIN_SECONDS per
+// repetition, warmed up, then timed over a number of repetitions. The median
+// ns/op of the repetitions is reported (with GB/s for cases that have a byte
+// count) and compared against the baseline file if one is given.
+//
+// Usage: bench [--reps=N] [--warmup=N] [--filter=text] [--threshold=0.10]
+//              [--baseline=path] [--save=path] [--check]
+//
+// The baseline file has one case per line, "name ns_per_op [threshold]",
+// where threshold overrides --threshold for that case. Lines starting with #
+// are ignored. --save writes the current results in the same format. The
+// exit code is 1 if any case is slower than its baseline by more than its
+// threshold.
+//
+// --check runs the conformance checks instead, which compare the fast paths
+// against their reference implementations. --filter applies to them too and
+// the exit code is 1 if any check fails.
+
+#define IMGTHING_NO_MAIN
+#include "main.c"
+
+#define BENCH_MAX_CASES 64
+#define BENCH_MAX_REPS 100
+#define BENCH_MIN_SECONDS 0.02
+#define BENCH_NAME 48
+
+// Each case runs iters ops on ctx
+typedef void (*bench_func)(void* ctx, uint64 iters);
+
+typedef struct {
+  char name[BENCH_NAME];
+  bench_func func;
+  void* ctx;
+  // Bytes processed per op, 0 for cases where GB/s means nothing
+  uint64 bytes;
+  // Where the case leaves the size of what it wrote, NULL if that means
+  // nothing
+  const uint64* outBytes;
+
+  double nsPerOp;
+  double minNsPerOp;
+} bench_case;
+
+typedef struct {
+  bench_case cases[BENCH_MAX_CASES];
+  uint32 count;
+} bench_suite;
+
+// Results land here so the compiler can't drop the work
+static volatile uint64 benchSink = 0;
+
+static bench_case* bench_add(bench_suite* suite, const char* name, bench_func func, void* ctx, uint64 bytes) {
+  if (suite->count >= BENCH_MAX_CASES) {
+    return NULL;
+  }
+
+  bench_case* c = &suite->cases[suite->count++];
+  memset(c, 0, sizeof(bench_case));
+
+  snprintf(c->name, BENCH_NAME, "%s", name);
+  c->func = func;
+  c->ctx = ctx;
+  c->bytes = bytes;
+
+  return c;
+}
+
+static double bench_time(bench_case* c, uint64 iters) {
+  double start = report_clock(CLOCK_MONOTONIC);
+  c->func(c->ctx, iters);
+  return report_clock(CLOCK_MONOTONIC) - start;
+}
+
+static int bench_compare(const void* a, const void* b) {
+  double x = *(const double*) a;
+  double y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+static void bench_run(bench_case* c, uint32 warmup, uint32 reps) {
+  // Double the op count until one repetition takes long enough to time
+  uint64 iters = 1;
+  while (bench_time(c, iters) < BENCH_MIN_SECONDS && iters < (1ull << 40)) {
+    iters *= 2;
+  }
+
+  for (uint32 i = 0; i < warmup; i++) {
+    bench_time(c, iters);
+  }
+
+  double samples[BENCH_MAX_REPS];
+  for (uint32 i = 0; i < reps; i++) {
+    samples[i] = bench_time(c, iters) * 1e9 / iters;
+  }
+
+  qsort(samples, reps, sizeof(double), bench_compare);
+
+  c->nsPerOp = samples[reps / 2];
+  c->minNsPerOp = samples[0];
+}
+
+// Looks up name in the baseline file. Returns 1 and sets nsPerOp, and
+// threshold when the line has one, if the case is there.
+static uint8 bench_baseline(FILE* f, const char* name, double* nsPerOp, double* threshold) {
+  char line[256];
+  rewind(f);
+
+  while (fgets(line, sizeof(line), f)) {
+    char lineName[BENCH_NAME];
+    double ns;
+    double limit;
+
+    if (line[0] == '#') {
+      continue;
+    }
+
+    int32 fields = sscanf(line, "%47s %lf %lf", lineName, &ns, &limit);
+    if (fields < 2 || strcmp(lineName, name) != 0) {
+      continue;
+    }
+
+    *nsPerOp = ns;
+    if (fields > 2) {
+      *threshold = limit;
+    }
+
+    return 1;
+  }
+
+  return 0;
+}
+
+// Seeded inputs, so every run times and checks the same data
+static uint64 bench_random(uint64* state) {
+  return splitmix64((*state)++);
+}
+
+// Uniform in lo..hi
+static double bench_uniform(uint64* state, double lo, double hi) {
+  return lo + (bench_random(state) >> 11) * (1.0 / (1ull << 53)) * (hi - lo);
+}
+
+// Cases
+
+#define BENCH_SAMPLES 4096
+
+typedef struct {
+  int depth;
+  double xs[BENCH_SAMPLES];
+  double ys[BENCH_SAMPLES];
+} perlin_bench;
+
+static void bench_perlin2d(void* ctx, uint64 iters) {
+  perlin_bench* b = (perlin_bench*) ctx;
+  double sum = 0;
+
+  for (uint64 i = 0; i < iters; i++) {
+    uint32 s = i % BENCH_SAMPLES;
+    sum += perlin2d(b->xs[s], b->ys[s], 0.02, b->depth);
+  }
+
+  benchSink += (uint64) sum;
+}
+
+typedef struct {
+  heightmap hmap;
+} hmap_bench;
+
+static void bench_hmap_generate(void* ctx, uint64 iters) {
+  hmap_bench* b = (hmap_bench*) ctx;
+
+  for (uint64 i = 0; i < iters; i++) {
+    b->hmap->seed = i;
+    hmap_generate(b->hmap);
+  }
+
+  benchSink += (uint64) (hmap_getsample(b->hmap, 1, 1) * 1000);
+}
+
+typedef struct {
+  img image;
+  shader func;
+  // NULL times the serial applyshader
+  threadpool pool;
+} shader_bench;
+
+static void bench_applyshader(void* ctx, uint64 iters) {
+  shader_bench* b = (shader_bench*) ctx;
+
+  for (uint64 i = 0; i < iters; i++) {
+    if (b->pool) {
+      applyshader_parallel(b->pool, b->image, b->func);
+    } else {
+      applyshader(b->image, b->func);
+    }
+  }
+
+  benchSink += b->image.buf[0];
+}
+
+typedef struct {
+  color_array colors;
+  float deltas[BENCH_SAMPLES];
+} color_bench;
+
+static void bench_pickcolor(void* ctx, uint64 iters) {
+  color_bench* b = (color_bench*) ctx;
+  color24 c = BLACK;
+  uint64 sum = 0;
+
+  for (uint64 i = 0; i < iters; i++) {
+    pickcolor(&c, b->colors, b->deltas[i % BENCH_SAMPLES]);
+    sum += c.r;
+  }
+
+  benchSink += sum;
+}
+
+static void bench_lerpcolor(void* ctx, uint64 iters) {
+  color_bench* b = (color_bench*) ctx;
+  color24 c = BLACK;
+  uint64 sum = 0;
+
+  for (uint64 i = 0; i < iters; i++) {
+    lerpcolor(&c, b->colors, b->deltas[i % BENCH_SAMPLES]);
+    sum += c.r;
+  }
+
+  benchSink += sum;
+}
+
+typedef struct {
+  const float* heights;
+  uint8* out;
+  int32 count;
+  heightcolor_kernel exact;
+  palette_lut lut;
+  lutcolor_kernel lutColor;
+  lutindex_kernel lutIndex;
+} height_bench;
+
+static void bench_heightcolor(void* ctx, uint64 iters) {
+  height_bench* b = (height_bench*) ctx;
+
+  for (uint64 i = 0; i < iters; i++) {
+    b->exact(b->out, b->heights, b->count, terrainColors, seaColors, SEALEVEL);
+  }
+
+  benchSink += b->out[0];
+}
+
+static void bench_lutcolor(void* ctx, uint64 iters) {
+  height_bench* b = (height_bench*) ctx;
+
+  for (uint64 i = 0; i < iters; i++) {
+    b->lutColor(b->lut, b->out, b->heights, b->count);
+  }
+
+  benchSink += b->out[0];
+}
+
+static void bench_lutindex(void* ctx, uint64 iters) {
+  height_bench* b = (height_bench*) ctx;
+
+  for (uint64 i = 0; i < iters; i++) {
+    b->lutIndex(b->lut, b->out, b->heights, b->count);
+  }
+
+  benchSink += b->out[0];
+}
+
+typedef struct {
+  landmask land;
+  landmask coast;
+} mask_bench;
+
+static void bench_landmask_build(void* ctx, uint64 iters) {
+  mask_bench* b = (mask_bench*) ctx;
+
+  for (uint64 i = 0; i < iters; i++) {
+    landmask_build(NULL, b->land, terrainHeightMap, SEALEVEL);
+  }
+
+  benchSink += b->land->bits[0];
+}
+
+static void bench_landmask_coast(void* ctx, uint64 iters) {
+  mask_bench* b = (mask_bench*) ctx;
+
+  for (uint64 i = 0; i < iters; i++) {
+    landmask_coast(NULL, b->land, b->coast);
+  }
+
+  benchSink += b->coast->bits[0];
+}
+
+static void bench_hydro_fill(void* ctx, uint64 iters) {
+  hydrology hy = (hydrology) ctx;
+
+  for (uint64 i = 0; i < iters; i++) {
+    hydro_fill(hy, terrainHeightMap, SEALEVEL);
+  }
+
+  benchSink += hy->filled[0];
+}
+
+static void bench_hydro_flow(void* ctx, uint64 iters) {
+  hydrology hy = (hydrology) ctx;
+
+  for (uint64 i = 0; i < iters; i++) {
+    hydro_directions(NULL, hy);
+    hydro_accumulate(NULL, hy);
+  }
+
+  benchSink += hy->accum[0];
+}
+
+typedef struct {
+  heightmap hmap;
+  erosion_params params;
+} erosion_bench;
+
+// Erodes a fresh copy of the terrain each time, the copy is part of the cost
+static void bench_erosion(void* ctx, uint64 iters) {
+  erosion_bench* b = (erosion_bench*) ctx;
+  uint64 bytes = (uint64) mapWidth * mapHeight * sizeof(float);
+
+  for (uint64 i = 0; i < iters; i++) {
+    memcpy(b->hmap->heightData, terrainHeightMap->heightData, bytes);
+    erosion_run(NULL, b->hmap, &b->params);
+  }
+
+  benchSink += b->hmap->heightData[0];
+}
+
+typedef struct {
+  float* heights;
+  thermal_params params;
+  // Runs that stopped before params.iterations
+  uint32 shortRuns;
+} thermal_bench;
+
+// Weathers a fresh copy of the terrain each time, the copy is part of the
+// cost
+static void bench_thermal(void* ctx, uint64 iters) {
+  thermal_bench* b = (thermal_bench*) ctx;
+
+  for (uint64 i = 0; i < iters; i++) {
+    memcpy(b->heights, terrainHeightMap->heightData, (uint64) mapWidth * mapHeight * sizeof(float));
+    uint32 ran = 0;
+    thermal_run(NULL, b->heights, mapWidth, mapHeight, &b->params, &ran);
+    b->shortRuns += ran != b->params.iterations;
+  }
+
+  benchSink += b->heights[0];
+}
+
+#define BENCH_LINES 1024
+
+typedef struct {
+  img image;
+  raster_line* lines;
+} raster_bench;
+
+static void bench_raster(void* ctx, uint64 iters) {
+  raster_bench* b = (raster_bench*) ctx;
+
+  for (uint64 i = 0; i < iters; i++) {
+    raster_lines(NULL, b->image, b->lines, BENCH_LINES);
+  }
+
+  benchSink += b->image.buf[0];
+}
+
+#define BENCH_VIEW 512
+#define BENCH_VIEW_STEP 64
+
+typedef struct {
+  world w;
+  float* view;
+  int64 x;
+} world_bench;
+
+// Pans a viewport across the world, so the cache sees the hits and misses a
+// scrolling map would
+static void bench_world_region(void* ctx, uint64 iters) {
+  world_bench* b = (world_bench*) ctx;
+
+  for (uint64 i = 0; i < iters; i++) {
+    world_region(NULL, b->w, b->x, -BENCH_VIEW / 2, BENCH_VIEW, BENCH_VIEW, b->view, BENCH_VIEW);
+    b->x += BENCH_VIEW_STEP;
+  }
+
+  benchSink += (uint64) (b->view[0] * 1000);
+}
+
+typedef struct {
+  img image;
+  int quality;
+  // Size of the last output
+  uint64 outBytes;
+} compress_bench;
+
+static void bench_zlib_compress(void* ctx, uint64 iters) {
+  compress_bench* b = (compress_bench*) ctx;
+
+  for (uint64 i = 0; i < iters; i++) {
+    int len = 0;
+    uint8* out = stbi_zlib_compress(b->image.buf, b->image.w * b->image.h * CHANNELS, &len, b->quality);
+    b->outBytes = len;
+    benchSink += len;
+    STBIW_FREE(out);
+  }
+}
+
+static void bench_write_png(void* ctx, uint64 iters) {
+  compress_bench* b = (compress_bench*) ctx;
+
+  for (uint64 i = 0; i < iters; i++) {
+    int len = 0;
+    uint8* out = stbi_write_png_to_mem(b->image.buf, b->image.w * CHANNELS, b->image.w, b->image.h, CHANNELS, &len);
+    b->outBytes = len;
+    benchSink += len;
+    STBIW_FREE(out);
+  }
+}
+
+#define BENCH_IMAGE 512
+
+// Checks
+
+#define CHECK_DETAIL 256
+
+// Fills detail with what was compared and returns 1 if it matched
+typedef uint8 (*check_func)(char* detail);
+
+typedef struct {
+  const char* name;
+  check_func func;
+} check_case;
+
+// Not a multiple of any vector width, so the kernels' scalar tails run too
+#define CHECK_PERLIN_POINTS 1021
+
+// The AVX2 and AVX-512 kernels use FMA, which rounds differently from
+// perlin2d. Results are in 0..1.
+#define CHECK_PERLIN_TOLERANCE 1e-12
+
+// Forces every perlin2d_batch kernel the CPU has and compares it against
+// perlin2d, over negative and positive coordinates and several depths
+static uint8 check_perlin_batch(char* detail) {
+  struct {
+    const char* name;
+    uint32 mask;
+    double tolerance;
+  } kernels[] = {
+    { "scalar", 0, 0 },
+    { "sse2", CPU_SSE2, 0 },
+    { "avx2", CPU_SSE2 | CPU_AVX2 | CPU_FMA, CHECK_PERLIN_TOLERANCE },
+    { "avx512", CPU_SSE2 | CPU_AVX2 | CPU_FMA | CPU_AVX512F, CHECK_PERLIN_TOLERANCE }
+  };
+
+  double* xs = (double*) malloc(CHECK_PERLIN_POINTS * sizeof(double));
+  double* ys = (double*) malloc(CHECK_PERLIN_POINTS * sizeof(double));
+  double* out = (double*) malloc(CHECK_PERLIN_POINTS * sizeof(double));
+
+  if (!xs || !ys || !out) {
+    free(xs);
+    free(ys);
+    free(out);
+    snprintf(detail, CHECK_DETAIL, "out of memory");
+    return 0;
+  }
+
+  uint64 state = 4;
+  for (uint32 i = 0; i < CHECK_PERLIN_POINTS; i++) {
+    xs[i] = bench_uniform(&state, -5000, 5000);
+    ys[i] = bench_uniform(&state, -5000, 5000);
+  }
+
+  uint32 available = cpu_features();
+  uint8 ok = 1;
+  int used = snprintf(detail, CHECK_DETAIL, "tolerance %g:", CHECK_PERLIN_TOLERANCE);
+
+  for (uint32 k = 0; k < 4; k++) {
+    if ((available & kernels[k].mask) != kernels[k].mask) {
+      used += snprintf(detail + used, CHECK_DETAIL - used, " %s=n/a", kernels[k].name);
+      continue;
+    }
+
+    cpu_restrict(kernels[k].mask);
+    perlin_batch_kernel kernel = perlin_select();
+    cpu_restrict(~0u);
+
+    double worst = 0;
+
+    for (int depth = 1; depth <= 8; depth++) {
+      double freq = depth % 2 ? 0.02 : 0.37;
+      kernel(xs, ys, freq, depth, out, CHECK_PERLIN_POINTS);
+
+      for (uint32 i = 0; i < CHECK_PERLIN_POINTS; i++) {
+        double diff = fabs(out[i] - perlin2d(xs[i], ys[i], freq, depth));
+        worst = diff > worst ? diff : worst;
+      }
+    }
+
+    uint8 match = worst <= kernels[k].tolerance;
+    ok = ok && match;
+    used += snprintf(detail + used, CHECK_DETAIL - used, " %s=%.2g%s", kernels[k].name, worst, match ? "" : " FAIL");
+  }
+
+  free(xs);
+  free(ys);
+  free(out);
+  return ok;
+}
+
+// A power of two frequency, where seed offsets that are whole noise periods
+// would give every seed the same world
+#define CHECK_WORLD_FREQ 1.0
+#define CHECK_WORLD_DEPTH 4
+
+// Reads a region straddling the origin and compares every sample against
+// perlin2d at the world's offset, then reads overlapping regions through a
+// cache too small to hold them, so tiles are evicted and regenerated, and
+// compares those against the first read. Another seed must give another
+// world.
+static uint8 check_world_region(char* detail) {
+  const int64 x = -300;
+  const int64 y = -200;
+  const uint32 w = 700;
+  const uint32 h = 500;
+
+  world big = world_alloc(7, CHECK_WORLD_FREQ, CHECK_WORLD_DEPTH, 64);
+  world small = world_alloc(7, CHECK_WORLD_FREQ, CHECK_WORLD_DEPTH, 2);
+  world other = world_alloc(8, CHECK_WORLD_FREQ, CHECK_WORLD_DEPTH, 64);
+  float* expect = (float*) malloc((uint64) w * h * sizeof(float));
+  float* got = (float*) malloc((uint64) w * h * sizeof(float));
+
+  uint8 ok = big && small && other && expect && got && world_region(NULL, big, x, y, w, h, expect, w);
+
+  // The batch kernel may round the last bits differently from perlin2d
+  double worst = 0;
+  for (uint32 j = 0; j < h && ok; j++) {
+    for (uint32 i = 0; i < w; i++) {
+      double sample = perlin2d((double) (x + i) + big->offsetx, (double) (y + j) + big->offsety, CHECK_WORLD_FREQ, CHECK_WORLD_DEPTH);
+      double diff = fabs(expect[(uint64) j * w + i] - sample);
+      worst = diff > worst ? diff : worst;
+    }
+  }
+
+  // Quarters in an order that keeps evicting the tiles the next one needs
+  int64 qx[] = { 0, w / 2, 0, w / 2, 0 };
+  int64 qy[] = { 0, h / 2, h / 2, 0, 0 };
+  uint32 mismatched = 0;
+
+  for (uint32 q = 0; q < 5 && ok; q++) {
+    uint32 qw = qx[q] ? w - qx[q] : w / 2;
+    uint32 qh = qy[q] ? h - qy[q] : h / 2;
+    float* dst = got + qy[q] * w + qx[q];
+
+    ok = world_region(NULL, small, x + qx[q], y + qy[q], qw, qh, dst, w);
+    ok = ok && small->count <= small->capacity;
+
+    for (uint32 j = 0; j < qh && ok; j++) {
+      mismatched += memcmp(dst + (uint64) j * w, expect + (uint64) (qy[q] + j) * w + qx[q], qw * sizeof(float)) != 0;
+    }
+  }
+
+  uint32 same = 0;
+  if (ok && world_region(NULL, other, x, y, w, h, got, w)) {
+    for (uint64 i = 0; i < (uint64) w * h; i++) {
+      same += got[i] == expect[i];
+    }
+  }
+
+  snprintf(detail, CHECK_DETAIL, "max diff %.2g, %u evicting rows differ, misses %llu, %u samples equal across seeds",
+    worst, mismatched, small ? small->misses : 0, same);
+
+  ok = ok && worst <= 1e-6 && mismatched == 0 && small->misses > small->capacity && same < w * h / 100;
+
+  world_free(big);
+  world_free(small);
+  world_free(other);
+  free(expect);
+  free(got);
+  return ok;
+}
+
+#define CHECK_HMAP_WIDTH 300
+#define CHECK_HMAP_HEIGHT 200
+
+// Whether two heightmaps have the same size, seed, range and samples
+static uint8 check_hmap_equal(heightmap a, heightmap b) {
+  return a && b && a->width == b->width && a->height == b->height && a->seed == b->seed &&
+    a->smallestValue == b->smallestValue && a->greatestValue == b->greatestValue &&
+    memcmp(a->heightData, b->heightData, (uint64) a->width * a->height * sizeof(float)) == 0;
+}
+
+// Saves a generated map and maps it back read-only, where hmap_sync must
+// refuse to write, then generates the same map straight into a file made by
+// hmap_create_mapped and reads that back too. Both must match the map in
+// memory, range included.
+static uint8 check_hmap_file(char* detail) {
+  char saved[64];
+  char created[64];
+  snprintf(saved, sizeof(saved), "/tmp/imgthing-check-%d-saved.hmap", (int) getpid());
+  snprintf(created, sizeof(created), "/tmp/imgthing-check-%d-created.hmap", (int) getpid());
+
+  hmap_params params = {
+    .generator = HMAP_GEN_DIAMONDSQUARE
+  };
+
+  heightmap ref = hmap_alloc(CHECK_HMAP_WIDTH, CHECK_HMAP_HEIGHT);
+  if (!ref) {
+    snprintf(detail, CHECK_DETAIL, "out of memory");
+    return 0;
+  }
+
+  ref->seed = 9;
+  hmap_generate(ref);
+
+  heightmap saveBack = hmap_save(ref, saved, &params) ? hmap_map(saved, 0) : NULL;
+  uint8 savedOk = check_hmap_equal(ref, saveBack);
+  uint8 refused = saveBack && !hmap_sync(saveBack);
+
+  heightmap made = hmap_create_mapped(created, CHECK_HMAP_WIDTH, CHECK_HMAP_HEIGHT, &params);
+  uint8 synced = 0;
+
+  if (made) {
+    made->seed = 9;
+    hmap_generate(made);
+    synced = hmap_sync(made);
+  }
+
+  heightmap madeBack = synced ? hmap_map(created, 0) : NULL;
+  uint8 createdOk = check_hmap_equal(ref, madeBack);
+
+  snprintf(detail, CHECK_DETAIL, "range %g..%g, saved %s, created %s, read-only sync %s",
+    ref->smallestValue, ref->greatestValue, savedOk ? "matches" : "differs",
+    createdOk ? "matches" : "differs", refused ? "refused" : "allowed");
+
+  uint8 ok = savedOk && createdOk && refused && ref->smallestValue == 0.0f && ref->greatestValue == 1.0f;
+
+  hmap_free(ref);
+  hmap_free(saveBack);
+  hmap_free(made);
+  hmap_free(madeBack);
+  unlink(saved);
+  unlink(created);
+  return ok;
+}
+
+// Walks the chunks of the PNG at path and checks every CRC. Returns the
+// number of chunks if the file starts with an IHDR of size w x h and ends
+// with IEND, 0 otherwise.
+static uint32 check_png_chunks(const char* path, uint32 w, uint32 h) {
+  static const uint8 signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    return 0;
+  }
+
+  fseek(f, 0, SEEK_END);
+  uint64 size = (uint64) ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  uint8* data = (uint8*) malloc(size + 1);
+  uint8 ok = data && fread(data, 1, size, f) == size && size >= 8 && memcmp(data, signature, 8) == 0;
+  fclose(f);
+
+  uint32 chunks = 0;
+  uint8 ended = 0;
+  uint64 at = 8;
+
+  while (ok && !ended && at + 12 <= size) {
+    const uint8* c = data + at;
+    uint32 len = (uint32) c[0] << 24 | (uint32) c[1] << 16 | (uint32) c[2] << 8 | c[3];
+
+    if (at + 12 + len > size) {
+      ok = 0;
+      break;
+    }
+
+    const uint8* crc = c + 8 + len;
+    uint32 stored = (uint32) crc[0] << 24 | (uint32) crc[1] << 16 | (uint32) crc[2] << 8 | crc[3];
+    ok = stored == checksum_crc32((uint8*) c + 4, len + 4);
+
+    if (chunks == 0) {
+      const uint8* d = c + 8;
+      ok = ok && memcmp(c + 4, "IHDR", 4) == 0 && len == 13;
+      ok = ok && ((uint32) d[0] << 24 | (uint32) d[1] << 16 | (uint32) d[2] << 8 | d[3]) == w;
+      ok = ok && ((uint32) d[4] << 24 | (uint32) d[5] << 16 | (uint32) d[6] << 8 | d[7]) == h;
+    }
+
+    ended = memcmp(c + 4, "IEND", 4) == 0;
+    chunks++;
+    at += 12 + len;
+  }
+
+  free(data);
+  return ok && ended && at == size ? chunks : 0;
+}
+
+#define CHECK_PNG_WIDTH 700
+#define CHECK_PNG_HEIGHT 500
+
+// Streams a truecolor and an indexed image to files, serially and on a pool,
+// big enough to need several IDAT blocks, and checks the chunks of the
+// results. Writing to /dev/full must be reported as a failure.
+static uint8 check_png_stream(char* detail) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/imgthing-check-%d.png", (int) getpid());
+
+  img rgb = allocImage(CHECK_PNG_WIDTH, CHECK_PNG_HEIGHT);
+  indeximg indices = allocIndexImage(CHECK_PNG_WIDTH, CHECK_PNG_HEIGHT);
+  threadpool pool = pool_alloc(4);
+
+  if (!rgb.buf || !indices.buf || !pool) {
+    freeimg(rgb);
+    freeindeximg(indices);
+    pool_free(pool);
+    snprintf(detail, CHECK_DETAIL, "out of memory");
+    return 0;
+  }
+
+  // Noise, so the blocks don't compress to nothing
+  uint64 state = 10;
+  for (uint64 i = 0; i < (uint64) CHECK_PNG_WIDTH * CHECK_PNG_HEIGHT * CHANNELS; i++) {
+    rgb.buf[i] = (uint8) bench_random(&state);
+  }
+  for (uint64 i = 0; i < (uint64) CHECK_PNG_WIDTH * CHECK_PNG_HEIGHT; i++) {
+    indices.buf[i] = bench_random(&state) % indexPalette->length;
+  }
+
+  uint32 serial = png_stream_file(NULL, path, rgb.w, rgb.h, CHANNELS, rgb.buf, rgb.w * CHANNELS) ? check_png_chunks(path, rgb.w, rgb.h) : 0;
+  uint32 parallel = png_stream_file(pool, path, rgb.w, rgb.h, CHANNELS, rgb.buf, rgb.w * CHANNELS) ? check_png_chunks(path, rgb.w, rgb.h) : 0;
+  uint32 indexed = png_stream_file_indexed(pool, path, indices.w, indices.h, indexPalette->data, indexPalette->length, indices.buf, indices.w) ? check_png_chunks(path, indices.w, indices.h) : 0;
+
+  uint8 fullRgb = png_stream_file(pool, "/dev/full", rgb.w, rgb.h, CHANNELS, rgb.buf, rgb.w * CHANNELS);
+  uint8 fullIndexed = png_stream_file_indexed(NULL, "/dev/full", indices.w, indices.h, indexPalette->data, indexPalette->length, indices.buf, indices.w);
+
+  snprintf(detail, CHECK_DETAIL, "chunks serial %u, parallel %u, indexed %u, /dev/full %s",
+    serial, parallel, indexed, fullRgb || fullIndexed ? "reported success" : "failed");
+
+  freeimg(rgb);
+  freeindeximg(indices);
+  pool_free(pool);
+  unlink(path);
+
+  return serial && parallel && indexed && !fullRgb && !fullIndexed;
+}
+
+#define CHECK_LUT_HEIGHTS 4099
+
+// Runs every palette lookup kernel the CPU has over heights crowded around
+// sea level and spread over 0..1. Whether a pixel is sea must match the
+// exact < SEALEVEL test, colors must be the palette colors of the indices,
+// and only pixels near a color boundary may differ from heightcolor.
+static uint8 check_palette_lut(char* detail) {
+  float* heights = (float*) malloc(CHECK_LUT_HEIGHTS * sizeof(float));
+  uint8* exact = (uint8*) malloc(CHECK_LUT_HEIGHTS * CHANNELS);
+  uint8* colors = (uint8*) malloc(CHECK_LUT_HEIGHTS * CHANNELS);
+  uint8* indices = (uint8*) malloc(CHECK_LUT_HEIGHTS);
+
+  if (!heights || !exact || !colors || !indices) {
+    free(heights);
+    free(exact);
+    free(colors);
+    free(indices);
+    snprintf(detail, CHECK_DETAIL, "out of memory");
+    return 0;
+  }
+
+  // Every float within a few hundred ulps of sea level, then uniform heights
+  float h = nextafterf((float) SEALEVEL, 0);
+  for (uint32 i = 0; i < 256; i++) {
+    h = nextafterf(h, 0);
+  }
+
+  uint64 state = 11;
+  for (uint32 i = 0; i < CHECK_LUT_HEIGHTS; i++) {
+    if (i < 512) {
+      heights[i] = h;
+      h = nextafterf(h, 1);
+    } else {
+      heights[i] = (float) bench_uniform(&state, 0, 1);
+    }
+  }
+
+  heightcolor_scalar(exact, heights, CHECK_LUT_HEIGHTS, terrainColors, seaColors, SEALEVEL);
+
+  uint32 masks[] = { 0, CPU_SSE2, CPU_SSE2 | CPU_AVX2 };
+  const char* names[] = { "scalar", "sse2", "avx2" };
+  uint32 available = cpu_features();
+  uint8 ok = 1;
+  int used = 0;
+
+  for (uint32 k = 0; k < 3; k++) {
+    if ((available & masks[k]) != masks[k]) {
+      used += snprintf(detail + used, CHECK_DETAIL - used, "%s%s n/a", used ? "; " : "", names[k]);
+      continue;
+    }
+
+    cpu_restrict(masks[k]);
+    lutcolor_kernel colorKernel = lutcolor_select();
+    lutindex_kernel indexKernel = lutindex_select();
+    cpu_restrict(~0u);
+
+    colorKernel(terrainLut, colors, heights, CHECK_LUT_HEIGHTS);
+    indexKernel(terrainLut, indices, heights, CHECK_LUT_HEIGHTS);
+
+    uint32 wrongSide = 0;
+    uint32 wrongColor = 0;
+    uint32 quantized = 0;
+
+    for (uint32 i = 0; i < CHECK_LUT_HEIGHTS; i++) {
+      uint8 issea = heights[i] < SEALEVEL;
+      color24 c = color_array_get(indexPalette, indices[i]);
+
+      wrongSide += issea != (indices[i] >= indexSea);
+      wrongColor += memcmp(colors + i * CHANNELS, &c, CHANNELS) != 0;
+      quantized += memcmp(colors + i * CHANNELS, exact + i * CHANNELS, CHANNELS) != 0;
+    }
+
+    ok = ok && wrongSide == 0 && wrongColor == 0;
+    used += snprintf(detail + used, CHECK_DETAIL - used, "%s%s %u wrong side, %u off palette, %u quantized",
+      used ? "; " : "", names[k], wrongSide, wrongColor, quantized);
+  }
+
+  free(heights);
+  free(exact);
+  free(colors);
+  free(indices);
+  return ok;
+}
+
+// The per-pixel shaders on a pool against applyshader. outlineLand keeps the
+// colors already in the image, so both start from the same render.
+static uint8 check_applyshader(char* detail) {
+  shader shaders[] = { shaderTest, colorheightmap, outlineLand };
+  const char* names[] = { "shaderTest", "colorheightmap", "outlineLand" };
+
+  // Not a multiple of SHADER_TILE, so the edge tiles are partial
+  img serial = allocImage(mapWidth < 300 ? mapWidth : 300, mapHeight < 200 ? mapHeight : 200);
+  img parallel = allocImage(serial.w, serial.h);
+  threadpool pool = pool_alloc(4);
+  uint8 ok = serial.buf && parallel.buf && pool;
+  uint64 size = (uint64) serial.w * serial.h * CHANNELS;
+  int used = 0;
+
+  if (!ok) {
+    snprintf(detail, CHECK_DETAIL, "out of memory");
+  }
+
+  for (uint32 s = 0; ok && s < 3; s++) {
+    applyshader(serial, colorheightmap);
+    memcpy(parallel.buf, serial.buf, size);
+
+    applyshader(serial, shaders[s]);
+    applyshader_parallel(pool, parallel, shaders[s]);
+
+    uint64 differ = 0;
+    for (uint64 i = 0; i < size; i++) {
+      differ += serial.buf[i] != parallel.buf[i];
+    }
+
+    ok = differ == 0;
+    used += snprintf(detail + used, CHECK_DETAIL - used, "%s%s %llu bytes differ", s ? ", " : "", names[s], differ);
+  }
+
+  free(serial.buf);
+  free(parallel.buf);
+  pool_free(pool);
+
+  return ok;
+}
+
+// Lengths around the vector widths, the 64 byte CRC fold and the ADLER_NMAX
+// runs, up to a few megabytes
+static const uint64 checkChecksumLengths[] = {
+  0, 1, 2, 3, 15, 16, 17, 31, 32, 33, 63, 64, 65, 79, 80, 127, 128, 129, 1000,
+  ADLER_NMAX - 1, ADLER_NMAX, ADLER_NMAX + 1, 2 * ADLER_NMAX - 1, 2 * ADLER_NMAX, 2 * ADLER_NMAX + 1,
+  65536 + 7, (1 << 20) + 13, 4 << 20
+};
+
+#define CHECK_CHECKSUM_LENGTHS (sizeof(checkChecksumLengths) / sizeof(checkChecksumLengths[0]))
+#define CHECK_CHECKSUM_BYTES ((4 << 20) + 3)
+
+typedef struct {
+  const char* name;
+  uint32 mask;
+  crc32_kernel crc;
+  adler32_kernel adler;
+} checksum_kernel;
+
+// Counts lengths and offsets where kernel disagrees with the reference, done
+// in one call and chained over two calls split at split
+static uint32 check_checksum_kernel(const checksum_kernel* kernel, const checksum_kernel* ref, const uint8* data) {
+  uint32 wrong = 0;
+
+  for (uint32 l = 0; l < CHECK_CHECKSUM_LENGTHS; l++) {
+    uint64 len = checkChecksumLengths[l];
+    uint64 splits[] = { len / 3, len > ADLER_NMAX ? ADLER_NMAX - 1 : len };
+
+    // Unaligned starts
+    for (uint32 offset = 0; offset < 4; offset++) {
+      const uint8* p = data + offset;
+
+      if (kernel->crc) {
+        uint32 want = ref->crc(~0u, p, len);
+        wrong += kernel->crc(~0u, p, len) != want;
+
+        for (uint32 s = 0; s < 2; s++) {
+          wrong += kernel->crc(kernel->crc(~0u, p, splits[s]), p + splits[s], len - splits[s]) != want;
+        }
+      }
+
+      if (kernel->adler) {
+        uint32 want = ref->adler(1, p, len);
+        wrong += kernel->adler(1, p, len) != want;
+
+        for (uint32 s = 0; s < 2; s++) {
+          wrong += kernel->adler(kernel->adler(1, p, splits[s]), p + splits[s], len - splits[s]) != want;
+        }
+      }
+    }
+  }
+
+  return wrong;
+}
+
+// Runs every CRC32 and Adler-32 kernel the CPU has against slice8 and the
+// scalar Adler-32, which are first checked against known values
+static uint8 check_checksum(char* detail) {
+  checksum_select();
+
+  checksum_kernel ref = { "reference", 0, crc32_slice8, adler32_scalar };
+  checksum_kernel kernels[] = {
+#ifdef CHECKSUM_X86
+    { "pclmul", CPU_PCLMUL | CPU_SSE41, crc32_pclmul, NULL },
+    { "sse2", CPU_SSE2, NULL, adler32_sse2 },
+    { "avx2", CPU_SSE2 | CPU_AVX2, NULL, adler32_avx2 },
+#endif
+    ref
+  };
+
+  const uint8* digits = (const uint8*) "123456789";
+  const uint8* word = (const uint8*) "Wikipedia";
+
+  if (~crc32_slice8(~0u, digits, 9) != 0xCBF43926u || adler32_scalar(1, word, 9) != 0x11E60398u) {
+    snprintf(detail, CHECK_DETAIL, "reference kernels give wrong check values");
+    return 0;
+  }
+
+  uint8* data = (uint8*) malloc(CHECK_CHECKSUM_BYTES);
+  if (!data) {
+    snprintf(detail, CHECK_DETAIL, "out of memory");
+    return 0;
+  }
+
+  uint64 state = 14;
+  for (uint64 i = 0; i < CHECK_CHECKSUM_BYTES; i++) {
+    data[i] = (uint8) bench_random(&state);
+  }
+
+  // Runs of 0xFF push the Adler-32 sums as far as they go between reductions
+  memset(data + (1 << 20), 0xFF, 3 * ADLER_NMAX);
+
+  uint32 available = cpu_features();
+  uint8 ok = 1;
+  int used = snprintf(detail, CHECK_DETAIL, "%u lengths, 4 offsets:", (uint32) CHECK_CHECKSUM_LENGTHS);
+
+  for (uint32 k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    if ((available & kernels[k].mask) != kernels[k].mask) {
+      used += snprintf(detail + used, CHECK_DETAIL - used, " %s=n/a", kernels[k].name);
+      continue;
+    }
+
+    uint32 wrong = check_checksum_kernel(&kernels[k], &ref, data);
+    ok = ok && wrong == 0;
+    used += snprintf(detail + used, CHECK_DETAIL - used, " %s=%u wrong", kernels[k].name, wrong);
+  }
+
+  free(data);
+  return ok;
+}
+
+// Sizes of a filtered terrain render at the greedy (1-4), bucketed (5-8) and
+// lazy (9+) deflate presets. The newer presets should all beat the bucketed
+// ones, and the longest chains the shortest lazy ones.
+static uint8 check_zlib_presets(char* detail) {
+  int levels[] = { 1, 4, 5, 8, 9, 13 };
+  int sizes[6];
+
+  img terrain = allocImage(BENCH_IMAGE, BENCH_IMAGE);
+  if (!terrain.buf) {
+    snprintf(detail, CHECK_DETAIL, "out of memory");
+    return 0;
+  }
+
+  applyshader(terrain, colorheightmap);
+
+  int saved = stbi_write_png_compression_level;
+  int used = 0;
+
+  for (uint32 l = 0; l < 6; l++) {
+    stbi_write_png_compression_level = levels[l];
+
+    int len = 0;
+    uint8* out = stbi_write_png_to_mem(terrain.buf, terrain.w * CHANNELS, terrain.w, terrain.h, CHANNELS, &len);
+    STBIW_FREE(out);
+
+    sizes[l] = out ? len : 0;
+    used += snprintf(detail + used, CHECK_DETAIL - used, "%sq%d %d", l ? ", " : "", levels[l], sizes[l]);
+  }
+
+  stbi_write_png_compression_level = saved;
+  free(terrain.buf);
+
+  int bucketed = sizes[2] < sizes[3] ? sizes[2] : sizes[3];
+  uint8 ok = 1;
+
+  for (uint32 l = 0; l < 6; l++) {
+    ok = ok && sizes[l] > 0;
+
+    if (levels[l] < 5 || levels[l] > 8) {
+      ok = ok && sizes[l] < bucketed;
+    }
+  }
+
+  return ok && sizes[5] <= sizes[4];
+}
+
+
+static check_case checks[] = {
+  { "perlin2d_batch", check_perlin_batch },
+  { "world_region", check_world_region },
+  { "hmap_file", check_hmap_file },
+  { "png_stream", check_png_stream },
+  { "palette_lut", check_palette_lut },
+  { "applyshader", check_applyshader },
+  { "checksum", check_checksum },
+  { "zlib_presets", check_zlib_presets }
+};
+
+static int32 check_run(const char* filter) {
+  uint32 failures = 0;
+
+  for (uint32 i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+    if (filter && !strstr(checks[i].name, filter)) {
+      continue;
+    }
+
+    char detail[CHECK_DETAIL] = "";
+    uint8 ok = checks[i].func(detail);
+    failures += !ok;
+
+    printf("%-24s %-4s %s\n", checks[i].name, ok ? "ok" : "FAIL", detail);
+  }
+
+  if (failures) {
+    printf("%u check(s) failed\n", failures);
+    return 1;
+  }
+
+  return 0;
+}
+
+
+int32 main(int32 argc, char** argv) {
+  uint32 reps = 9;
+  uint32 warmup = 2;
+  double threshold = 0.10;
+  const char* filter = NULL;
+  const char* baselinePath = NULL;
+  const char* savePath = NULL;
+  uint8 checking = 0;
+
+  for (int32 i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--reps=", 7) == 0) {
+      reps = strtoul(argv[i] + 7, NULL, 10);
+    } else if (strncmp(argv[i], "--warmup=", 9) == 0) {
+      warmup = strtoul(argv[i] + 9, NULL, 10);
+    } else if (strncmp(argv[i], "--threshold=", 12) == 0) {
+      threshold = strtod(argv[i] + 12, NULL);
+    } else if (strncmp(argv[i], "--filter=", 9) == 0) {
+      filter = argv[i] + 9;
+    } else if (strncmp(argv[i], "--baseline=", 11) == 0) {
+      baselinePath = argv[i] + 11;
+    } else if (strncmp(argv[i], "--save=", 7) == 0) {
+      savePath = argv[i] + 7;
+    } else if (strcmp(argv[i], "--check") == 0) {
+      checking = 1;
+    } else {
+      printf("Unknown argument %s\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (reps < 1 || reps > BENCH_MAX_REPS) {
+    printf("--reps must be 1..%u\n", BENCH_MAX_REPS);
+    return EXIT_FAILURE;
+  }
+
+  FILE* baseline = NULL;
+  if (baselinePath && !(baseline = fopen(baselinePath, "r"))) {
+    printf("Failed to open baseline %s\n", baselinePath);
+    return EXIT_FAILURE;
+  }
+
+  // The shaders read the terrain globals from main.c
+  if (!createpalettes() || !generateheightmap(NULL, 1)) {
+    printf("Failed to set up the terrain\n");
+    return EXIT_FAILURE;
+  }
+
+  checksum_select();
+
+  if (checking) {
+    return check_run(filter);
+  }
+
+  bench_suite* suite = (bench_suite*) calloc(1, sizeof(bench_suite));
+
+  int depths[] = { 1, 4, 8 };
+  perlin_bench perlins[3];
+
+  for (uint32 d = 0; d < 3; d++) {
+    perlins[d].depth = depths[d];
+
+    for (uint32 i = 0; i < BENCH_SAMPLES; i++) {
+      perlins[d].xs[i] = i % 64;
+      perlins[d].ys[i] = i / 64;
+    }
+
+    char name[BENCH_NAME];
+    snprintf(name, BENCH_NAME, "perlin2d/depth%d", depths[d]);
+    bench_add(suite, name, bench_perlin2d, &perlins[d], 0);
+  }
+
+  uint32 sizes[] = { 129, 513, 1025 };
+  hmap_bench hmaps[3];
+
+  for (uint32 s = 0; s < 3; s++) {
+    hmaps[s].hmap = hmap_alloc(sizes[s], sizes[s]);
+
+    char name[BENCH_NAME];
+    snprintf(name, BENCH_NAME, "hmap_generate/%u", sizes[s]);
+    bench_add(suite, name, bench_hmap_generate, &hmaps[s], (uint64) sizes[s] * sizes[s] * sizeof(float));
+  }
+
+  const char* shaderNames[] = { "shaderTest", "colorheightmap", "outlineLand" };
+  shader shaders[] = { shaderTest, colorheightmap, outlineLand };
+  shader_bench shaderBenches[6];
+  threadpool shaderPool = pool_alloc(0);
+
+  for (uint32 s = 0; s < 6; s++) {
+    shaderBenches[s].image = allocImage(BENCH_IMAGE, BENCH_IMAGE);
+    shaderBenches[s].func = shaders[s % 3];
+    shaderBenches[s].pool = s < 3 ? NULL : shaderPool;
+
+    char name[BENCH_NAME];
+    snprintf(name, BENCH_NAME, "%s/%s", s < 3 ? "applyshader" : "applyshader_pool", shaderNames[s % 3]);
+    bench_add(suite, name, bench_applyshader, &shaderBenches[s], BENCH_IMAGE * BENCH_IMAGE * CHANNELS);
+  }
+
+  color_bench colors;
+  colors.colors = terrainColors;
+  for (uint32 i = 0; i < BENCH_SAMPLES; i++) {
+    colors.deltas[i] = (float) i / (BENCH_SAMPLES - 1);
+  }
+
+  bench_add(suite, "pickcolor", bench_pickcolor, &colors, 0);
+  bench_add(suite, "lerpcolor", bench_lerpcolor, &colors, 0);
+
+  // One terrain row per op, the way the span pipeline calls them
+  height_bench heights[4];
+  uint8* heightOut = (uint8*) malloc(mapWidth * CHANNELS);
+
+  for (uint32 h = 0; h < 4; h++) {
+    heights[h].heights = terrainHeightMap->heightData;
+    heights[h].out = heightOut;
+    heights[h].count = mapWidth;
+    heights[h].exact = heightcolor_scalar;
+    heights[h].lut = terrainLut;
+    heights[h].lutColor = lutcolor_select();
+    heights[h].lutIndex = lutindex_select();
+  }
+
+  heights[2].lut = palette_lut_alloc(terrainColors, seaColors, SEALEVEL, TERRAIN_LUT_BITS, LUT_SMOOTH, INDEX_LAND, indexSea);
+
+  bench_add(suite, "heightcolor", bench_heightcolor, &heights[0], mapWidth * sizeof(float));
+  bench_add(suite, "palette_lut/stepped", bench_lutcolor, &heights[1], mapWidth * sizeof(float));
+  bench_add(suite, "palette_lut/smooth", bench_lutcolor, &heights[2], mapWidth * sizeof(float));
+  bench_add(suite, "palette_lut/index", bench_lutindex, &heights[3], mapWidth * sizeof(float));
+
+  // Single threaded, on the whole terrain. main's coastMask is left unset so
+  // the outline shaders above keep timing the per-pixel path.
+  mask_bench masks = {
+    .land = landmask_alloc(mapWidth, mapHeight),
+    .coast = landmask_alloc(mapWidth, mapHeight)
+  };
+  landmask_build(NULL, masks.land, terrainHeightMap, SEALEVEL);
+
+  bench_add(suite, "landmask_build", bench_landmask_build, &masks, (uint64) mapWidth * mapHeight * sizeof(float));
+  bench_add(suite, "landmask_coast", bench_landmask_coast, &masks, (uint64) masks.land->words * mapHeight * sizeof(uint64));
+
+  hydrology hy = hydro_alloc(mapWidth, mapHeight);
+  hydro_fill(hy, terrainHeightMap, SEALEVEL);
+
+  bench_add(suite, "hydro_fill", bench_hydro_fill, hy, (uint64) mapWidth * mapHeight * sizeof(float));
+  bench_add(suite, "hydro_flow", bench_hydro_flow, hy, (uint64) mapWidth * mapHeight * sizeof(float));
+
+  erosion_bench erosion = {
+    .hmap = hmap_alloc(mapWidth, mapHeight)
+  };
+  erosion_default_params(&erosion.params, 1, 65536);
+  erosion.params.sealevel = SEALEVEL;
+
+  bench_add(suite, "erosion/64k", bench_erosion, &erosion, (uint64) mapWidth * mapHeight * sizeof(float));
+
+  // The terrain is already rescaled into 0..1, so the talus is scaled down
+  // to match. A negative tolerance never ends the run early, so every case
+  // runs all 16 iterations and only the number of iterations per pass
+  // differs. Checked after the run, a case that stops early isn't comparable.
+  uint32 blocks[] = { 1, 4, 8 };
+  thermal_bench thermals[3];
+  float* thermalHeights = (float*) malloc((uint64) mapWidth * mapHeight * sizeof(float));
+
+  for (uint32 b = 0; b < 3; b++) {
+    thermals[b].heights = thermalHeights;
+    thermal_default_params(&thermals[b].params);
+    thermals[b].params.iterations = 16;
+    thermals[b].params.block = blocks[b];
+    thermals[b].params.talus = 0.01f;
+    thermals[b].params.tolerance = -1.0f;
+    thermals[b].shortRuns = 0;
+
+    char name[BENCH_NAME];
+    snprintf(name, BENCH_NAME, "thermal/block%u", blocks[b]);
+    bench_add(suite, name, bench_thermal, &thermals[b], (uint64) mapWidth * mapHeight * sizeof(float) * 16);
+  }
+
+  // Lines run from a little outside the image to anywhere else, so clipping
+  // is part of the cost
+  raster_line* lines = (raster_line*) malloc(2 * BENCH_LINES * sizeof(raster_line));
+  raster_bench rasters[2];
+
+  uint64 state = 1;
+  for (uint32 i = 0; i < 2 * BENCH_LINES; i++) {
+    lines[i] = (raster_line) {
+      .x0 = (int32) (bench_random(&state) % (BENCH_IMAGE + 64)) - 32,
+      .y0 = (int32) (bench_random(&state) % (BENCH_IMAGE + 64)) - 32,
+      .x1 = (int32) (bench_random(&state) % (BENCH_IMAGE + 64)) - 32,
+      .y1 = (int32) (bench_random(&state) % (BENCH_IMAGE + 64)) - 32,
+      .rgb = color(0, 0, 0),
+      .smooth = i >= BENCH_LINES
+    };
+  }
+
+  for (uint32 r = 0; r < 2; r++) {
+    rasters[r].image = allocImage(BENCH_IMAGE, BENCH_IMAGE);
+    rasters[r].lines = lines + r * BENCH_LINES;
+  }
+
+  bench_add(suite, "raster_lines/hard", bench_raster, &rasters[0], BENCH_LINES * sizeof(raster_line));
+  bench_add(suite, "raster_lines/smooth", bench_raster, &rasters[1], BENCH_LINES * sizeof(raster_line));
+
+  world_bench worlds = {
+    .w = world_alloc(1, 1.0 / 128, 6, 16),
+    .view = (float*) malloc(BENCH_VIEW * BENCH_VIEW * sizeof(float))
+  };
+
+  bench_add(suite, "world_region/pan", bench_world_region, &worlds, BENCH_VIEW * BENCH_VIEW * sizeof(float));
+
+  // Compress a real render rather than noise or a flat color
+  img terrain = allocImage(BENCH_IMAGE, BENCH_IMAGE);
+  applyshader(terrain, colorheightmap);
+
+  uint64 terrainBytes = BENCH_IMAGE * BENCH_IMAGE * CHANNELS;
+  // 9 is the first of the lazy matching presets
+  int qualities[] = { 1, 5, 8, 9 };
+  compress_bench compresses[4];
+
+  for (uint32 q = 0; q < 4; q++) {
+    compresses[q].image = terrain;
+    compresses[q].quality = qualities[q];
+    compresses[q].outBytes = 0;
+
+    char name[BENCH_NAME];
+    snprintf(name, BENCH_NAME, "stbi_zlib_compress/q%d", qualities[q]);
+    bench_case* c = bench_add(suite, name, bench_zlib_compress, &compresses[q], terrainBytes);
+    if (c) {
+      c->outBytes = &compresses[q].outBytes;
+    }
+  }
+
+  compress_bench png = {
+    .image = terrain,
+    .quality = stbi_write_png_compression_level,
+    .outBytes = 0
+  };
+  bench_case* pngCase = bench_add(suite, "stbi_write_png_to_mem", bench_write_png, &png, terrainBytes);
+  if (pngCase) {
+    pngCase->outBytes = &png.outBytes;
+  }
+
+  FILE* save = NULL;
+  if (savePath && !(save = fopen(savePath, "w"))) {
+    printf("Failed to open %s\n", savePath);
+    return EXIT_FAILURE;
+  }
+
+  if (save) {
+    fprintf(save, "# name ns_per_op [threshold]\n");
+  }
+
+  printf("%-32s %12s %12s %10s %10s %10s\n", "case", "ns/op", "min ns/op", "GB/s", "vs base", "out bytes");
+
+  uint32 regressions = 0;
+
+  for (uint32 i = 0; i < suite->count; i++) {
+    bench_case* c = &suite->cases[i];
+
+    if (filter && !strstr(c->name, filter)) {
+      continue;
+    }
+
+    bench_run(c, warmup, reps);
+
+    char gbs[16] = "-";
+    if (c->bytes) {
+      snprintf(gbs, sizeof(gbs), "%.3f", c->bytes / c->nsPerOp);
+    }
+
+    char change[32] = "-";
+    double baseNs = 0;
+    double limit = threshold;
+
+    if (baseline && bench_baseline(baseline, c->name, &baseNs, &limit) && baseNs > 0) {
+      double ratio = c->nsPerOp / baseNs - 1.0;
+      uint8 regressed = ratio > limit;
+
+      snprintf(change, sizeof(change), "%+.1f%%%s", ratio * 100, regressed ? " FAIL" : "");
+      regressions += regressed;
+    }
+
+    char out[24] = "-";
+    if (c->outBytes) {
+      snprintf(out, sizeof(out), "%llu", *c->outBytes);
+    }
+
+    printf("%-32s %12.1f %12.1f %10s %10s %10s\n", c->name, c->nsPerOp, c->minNsPerOp, gbs, change, out);
+
+    if (save) {
+      fprintf(save, "%s %.1f\n", c->name, c->nsPerOp);
+    }
+  }
+
+  if (save && fclose(save) != 0) {
+    printf("Failed to write %s\n", savePath);
+  }
+  if (baseline) {
+    fclose(baseline);
+  }
+
+  uint8 shortRuns = 0;
+
+  for (uint32 b = 0; b < 3; b++) {
+    if (thermals[b].shortRuns) {
+      printf("thermal/block%u stopped before %u iterations %u time(s)\n", blocks[b], thermals[b].params.iterations, thermals[b].shortRuns);
+      shortRuns = 1;
+    }
+  }
+
+  if (regressions) {
+    printf("%u case(s) regressed past their threshold\n", regressions);
+    return 1;
+  }
+
+  return shortRuns;
+}
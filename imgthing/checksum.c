@@ -0,0 +1,316 @@
+#include "common.h"
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CHECKSUM_X86
+#endif
+
+// CRC32 (PNG chunks) and Adler-32 (zlib streams) for the image writers,
+// plugged into stbi_image_write through STBIW_CRC32 and STBIW_ADLER32. CRC32
+// is folded with carry-less multiplies when the CPU has PCLMULQDQ and uses
+// slicing-by-8 tables otherwise, Adler-32 has AVX2 and SSE2 kernels. Call
+// checksum_select before using them from more than one thread.
+
+typedef uint32 (*crc32_kernel)(uint32 crc, const uint8* data, uint64 len);
+typedef uint32 (*adler32_kernel)(uint32 adler, const uint8* data, uint64 len);
+
+// Largest n such that 255n(n+1)/2 + (n+1)(65521-1) fits in 32 bits
+#define ADLER_NMAX 5552
+#define ADLER_MOD 65521
+
+static uint32 crcTable[8][256];
+static crc32_kernel crcKernel = NULL;
+static adler32_kernel adlerKernel = NULL;
+
+static void crc32_init_tables() {
+  for (uint32 n = 0; n < 256; n++) {
+    uint32 c = n;
+    for (int k = 0; k < 8; k++) {
+      c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    }
+    crcTable[0][n] = c;
+  }
+
+  for (uint32 n = 0; n < 256; n++) {
+    for (int t = 1; t < 8; t++) {
+      uint32 prev = crcTable[t - 1][n];
+      crcTable[t][n] = (prev >> 8) ^ crcTable[0][prev & 0xFF];
+    }
+  }
+}
+
+// crc is the raw register, not inverted
+static uint32 crc32_slice8(uint32 crc, const uint8* data, uint64 len) {
+  while (len >= 8) {
+    uint32 lo = crc ^ (data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32) data[3] << 24));
+    uint32 hi = data[4] | (data[5] << 8) | (data[6] << 16) | ((uint32) data[7] << 24);
+
+    crc = crcTable[7][lo & 0xFF] ^ crcTable[6][(lo >> 8) & 0xFF] ^
+          crcTable[5][(lo >> 16) & 0xFF] ^ crcTable[4][lo >> 24] ^
+          crcTable[3][hi & 0xFF] ^ crcTable[2][(hi >> 8) & 0xFF] ^
+          crcTable[1][(hi >> 16) & 0xFF] ^ crcTable[0][hi >> 24];
+
+    data += 8;
+    len -= 8;
+  }
+
+  while (len--) {
+    crc = (crc >> 8) ^ crcTable[0][(crc ^ *data++) & 0xFF];
+  }
+
+  return crc;
+}
+
+static uint32 adler32_scalar(uint32 adler, const uint8* data, uint64 len) {
+  uint32 s1 = adler & 0xFFFF;
+  uint32 s2 = adler >> 16;
+
+  while (len > 0) {
+    uint32 n = len < ADLER_NMAX ? (uint32) len : ADLER_NMAX;
+    len -= n;
+
+    while (n--) {
+      s1 += *data++;
+      s2 += s1;
+    }
+
+    s1 %= ADLER_MOD;
+    s2 %= ADLER_MOD;
+  }
+
+  return (s2 << 16) | s1;
+}
+
+#ifdef CHECKSUM_X86
+
+// Folds 64 bytes at a time with four 128-bit accumulators, then reduces to 32
+// bits with a Barrett reduction. The constants are x^k mod P for the
+// reflected CRC32 polynomial. len must be at least 64 and a multiple of 16.
+__attribute__((target("sse4.1,pclmul")))
+static uint32 crc32_fold_pclmul(uint32 crc, const uint8* data, uint64 len) {
+  const __m128i k1k2 = _mm_set_epi64x(0x01C6E41596LL, 0x0154442BD4LL);
+  const __m128i k3k4 = _mm_set_epi64x(0x00CCAA009ELL, 0x01751997D0LL);
+  const __m128i k5 = _mm_set_epi64x(0, 0x0163CD6124LL);
+  const __m128i poly = _mm_set_epi64x(0x01F7011641LL, 0x01DB710641LL);
+  const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+  __m128i x1 = _mm_loadu_si128((const __m128i*) (data + 0x00));
+  __m128i x2 = _mm_loadu_si128((const __m128i*) (data + 0x10));
+  __m128i x3 = _mm_loadu_si128((const __m128i*) (data + 0x20));
+  __m128i x4 = _mm_loadu_si128((const __m128i*) (data + 0x30));
+
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) crc));
+  data += 64;
+  len -= 64;
+
+  while (len >= 64) {
+    __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+    x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*) (data + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*) (data + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*) (data + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*) (data + 0x30)));
+
+    data += 64;
+    len -= 64;
+  }
+
+  // Four accumulators into one
+  __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x4), x5);
+
+  while (len >= 16) {
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_loadu_si128((const __m128i*) data)), x5);
+
+    data += 16;
+    len -= 16;
+  }
+
+  // 128 bits to 64
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, mask32);
+  x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5, 0x00), x2);
+
+  // Barrett reduction to 32
+  x2 = _mm_and_si128(x1, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+  x2 = _mm_and_si128(x2, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  return (uint32) _mm_extract_epi32(x1, 1);
+}
+
+static uint32 crc32_pclmul(uint32 crc, const uint8* data, uint64 len) {
+  if (len >= 64) {
+    uint64 folded = len & ~(uint64) 15;
+    crc = crc32_fold_pclmul(crc, data, folded);
+    data += folded;
+    len -= folded;
+  }
+
+  return crc32_slice8(crc, data, len);
+}
+
+// Per block of B bytes, s2 gains B * s1 plus the bytes weighted B..1 and s1
+// gains their sum. The running s1 before each block is summed separately and
+// scaled by B once per ADLER_NMAX run.
+__attribute__((target("sse2")))
+static uint32 adler32_sse2(uint32 adler, const uint8* data, uint64 len) {
+  uint32 s1 = adler & 0xFFFF;
+  uint32 s2 = adler >> 16;
+
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i weightsHi = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+  const __m128i weightsLo = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+
+  while (len >= 16) {
+    uint32 n = len < ADLER_NMAX ? (uint32) len : ADLER_NMAX;
+    uint32 blocks = n / 16;
+    n = blocks * 16;
+    len -= n;
+
+    s2 += s1 * n;
+
+    __m128i vs1 = zero;
+    __m128i vps = zero;
+    __m128i vs2 = zero;
+
+    for (uint32 b = 0; b < blocks; b++) {
+      __m128i v = _mm_loadu_si128((const __m128i*) data);
+
+      vps = _mm_add_epi32(vps, vs1);
+      vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(v, zero));
+      vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), weightsHi));
+      vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), weightsLo));
+
+      data += 16;
+    }
+
+    uint32 lanes[4];
+
+    _mm_storeu_si128((__m128i*) lanes, vs1);
+    uint32 sum = lanes[0] + lanes[2];
+
+    _mm_storeu_si128((__m128i*) lanes, _mm_add_epi32(_mm_slli_epi32(vps, 4), vs2));
+    s2 += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    s1 += sum;
+
+    s1 %= ADLER_MOD;
+    s2 %= ADLER_MOD;
+  }
+
+  return adler32_scalar((s2 << 16) | s1, data, len);
+}
+
+__attribute__((target("avx2")))
+static uint32 adler32_avx2(uint32 adler, const uint8* data, uint64 len) {
+  uint32 s1 = adler & 0xFFFF;
+  uint32 s2 = adler >> 16;
+
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+  const __m256i weights = _mm256_setr_epi8(
+    32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+    16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1
+  );
+
+  while (len >= 32) {
+    uint32 n = len < ADLER_NMAX ? (uint32) len : ADLER_NMAX;
+    uint32 blocks = n / 32;
+    n = blocks * 32;
+    len -= n;
+
+    s2 += s1 * n;
+
+    __m256i vs1 = zero;
+    __m256i vps = zero;
+    __m256i vs2 = zero;
+
+    for (uint32 b = 0; b < blocks; b++) {
+      __m256i v = _mm256_loadu_si256((const __m256i*) data);
+
+      vps = _mm256_add_epi32(vps, vs1);
+      vs1 = _mm256_add_epi32(vs1, _mm256_sad_epu8(v, zero));
+      vs2 = _mm256_add_epi32(vs2, _mm256_madd_epi16(_mm256_maddubs_epi16(v, weights), ones));
+
+      data += 32;
+    }
+
+    uint32 lanes[8];
+
+    _mm256_storeu_si256((__m256i*) lanes, vs1);
+    uint32 sum = lanes[0] + lanes[2] + lanes[4] + lanes[6];
+
+    _mm256_storeu_si256((__m256i*) lanes, _mm256_add_epi32(_mm256_slli_epi32(vps, 5), vs2));
+    for (int l = 0; l < 8; l++) {
+      s2 += lanes[l];
+    }
+    s1 += sum;
+
+    s1 %= ADLER_MOD;
+    s2 %= ADLER_MOD;
+  }
+
+  return adler32_sse2((s2 << 16) | s1, data, len);
+}
+
+#endif // CHECKSUM_X86
+
+// Builds the tables and picks the fastest kernels the CPU supports
+void checksum_select() {
+  if (crcKernel) {
+    return;
+  }
+
+  crc32_init_tables();
+
+  crc32_kernel crc = crc32_slice8;
+  adler32_kernel adler = adler32_scalar;
+
+#ifdef CHECKSUM_X86
+  uint32 features = cpu_features();
+
+  if ((features & CPU_PCLMUL) && (features & CPU_SSE41)) {
+    crc = crc32_pclmul;
+  }
+
+  if (features & CPU_AVX2) {
+    adler = adler32_avx2;
+  } else if (features & CPU_SSE2) {
+    adler = adler32_sse2;
+  }
+#endif
+
+  adlerKernel = adler;
+  crcKernel = crc;
+}
+
+// CRC32 of buffer as stored in PNG chunks
+unsigned int checksum_crc32(unsigned char* buffer, int len) {
+  checksum_select();
+  return ~crcKernel(~0u, buffer, (uint64) len);
+}
+
+// Running Adler-32, start with adler = 1
+unsigned int checksum_adler32(unsigned int adler, const unsigned char* data, int len) {
+  checksum_select();
+  return adlerKernel(adler, data, (uint64) len);
+}
@@ -49,12 +49,30 @@ void setc(color24* out, uint8 v) {
   out->b = v;
 }
 
+// Index of the color pickcolor would use, returns 0 if delta is out of range
+uint8 pickindex(uint32* out, color_array arr, float delta) {
+  if (delta < 0.0f || delta > 1.0f || !arr || !out) {
+    return 0;
+  }
+
+  // delta == 1.0 would land one past the end, keep it on the last color so
+  // every in-range delta writes to out
+  uint32 idx = delta * arr->length;
+  if (idx >= arr->length) {
+    idx = arr->length - 1;
+  }
+
+  *out = idx;
+  return 1;
+}
+
 void pickcolor(color24* out, color_array arr, float delta) {
-  if (delta < 0.0f || delta >= 1.0f || !arr || !out) {
+  uint32 idx;
+
+  if (!out || !pickindex(&idx, arr, delta)) {
     return;
   }
 
-  uint32 idx = delta * arr->length;
   color24 c = color_array_get(arr, idx);
 
   *out = c;
@@ -0,0 +1,60 @@
+#include "common.h"
+
+#define CPU_SSE2     (1u << 0)
+#define CPU_SSE41    (1u << 1)
+#define CPU_AVX2     (1u << 2)
+#define CPU_FMA      (1u << 3)
+#define CPU_AVX512F  (1u << 4)
+#define CPU_PCLMUL   (1u << 5)
+
+static uint32 cpuMask = ~0u;
+
+static uint32 cpu_detect() {
+  uint32 features = 0;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("sse2")) {
+    features |= CPU_SSE2;
+  }
+  if (__builtin_cpu_supports("sse4.1")) {
+    features |= CPU_SSE41;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    features |= CPU_AVX2;
+  }
+  if (__builtin_cpu_supports("fma")) {
+    features |= CPU_FMA;
+  }
+  if (__builtin_cpu_supports("avx512f")) {
+    features |= CPU_AVX512F;
+  }
+  if (__builtin_cpu_supports("pclmul")) {
+    features |= CPU_PCLMUL;
+  }
+#endif
+
+  return features;
+}
+
+// Returns the CPU_* instruction set extensions usable on this machine, used
+// to pick between SIMD and scalar kernels at runtime
+uint32 cpu_features() {
+  static uint32 features = 0;
+  static uint8 detected = 0;
+
+  if (!detected) {
+    features = cpu_detect();
+    detected = 1;
+  }
+
+  return features & cpuMask;
+}
+
+// Hides every feature not in mask from cpu_features, so the scalar or older
+// SIMD paths can be forced for comparisons. Kernels are picked when selected,
+// so call this before selecting them.
+void cpu_restrict(uint32 mask) {
+  cpuMask = mask;
+}
@@ -2,37 +2,57 @@
 #include "common.h"
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define TO_HMAP_PTR(x, y, hmap) (hmap->heightData + ((x + (y * hmap->width)) * sizeof(float)))
 
 typedef struct {
   uint32 width;
   uint32 height;
+  uint64 seed;
   float greatestValue;
   float smallestValue;
+  // Thermal weathering run on the raw heights before they're rescaled, or
+  // NULL for none (see thermal.c)
+  const thermal_params* thermal;
   float* heightData;
+  // Set when heightData lives inside a file mapping (see hmapfile.c)
+  void* mapping;
+  uint64 mappingSize;
+  uint8 mappingWritable;
 } heightmap_t;
 
 typedef heightmap_t* heightmap;
 
 heightmap hmap_alloc(uint32 w, uint32 h) {
-  uint64 memlen = w * h * sizeof(float);
+  uint64 memlen = (uint64) w * h * sizeof(float);
   float* data = (float*) malloc(memlen);
   heightmap hmap = (heightmap) malloc(sizeof(heightmap_t));
 
   if (!data || !hmap) {
+    free(data);
+    free(hmap);
     return NULL;
   }
 
-  for (uint32 idx = 0; idx < w * h; idx++) {
+  for (uint64 idx = 0; idx < (uint64) w * h; idx++) {
     data[idx] = 0.333f;
   }
 
   hmap->width = w;
   hmap->height = h;
+  hmap->seed = 0;
   hmap->greatestValue = 0.0f;
   hmap->smallestValue = 0.0f;
+  hmap->thermal = NULL;
   hmap->heightData = data;
+  hmap->mapping = NULL;
+  hmap->mappingSize = 0;
+  hmap->mappingWritable = 0;
 
   return hmap;
 }
@@ -42,156 +62,410 @@ void hmap_free(heightmap hmap)  {
     return;
   }
 
-  free(hmap->heightData);
+  if (hmap->mapping) {
+    munmap(hmap->mapping, hmap->mappingSize);
+  } else {
+    free(hmap->heightData);
+  }
+
   free(hmap);
 }
 
 float hmap_getsample(heightmap hmap, uint32 x, uint32 y) {
-  if (!hmap || x < 0 || y < 0 || x > hmap->width || y >= hmap->height) {
+  if (!hmap || x >= hmap->width || y >= hmap->height) {
     return 0.0f;
   }
 
-  return hmap->heightData[x + (y * hmap->width)];
+  return hmap->heightData[x + (uint64) y * hmap->width];
 }
 
 void hmap_setsample(heightmap hmap, uint32 x, uint32 y, float val) {
-  if (!hmap || x < 0 || y < 0 || x > hmap->width || y >= hmap->height) {
+  if (!hmap || x >= hmap->width || y >= hmap->height) {
     return;
   }
 
-  hmap->heightData[x + (y * hmap->width)] = val;
+  hmap->heightData[x + (uint64) y * hmap->width] = val;
+}
+
+static uint64 splitmix64(uint64 z) {
+  z += 0x9E3779B97F4A7C15ull;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+// Counter based random offset in -reach..reach. The value only depends on the
+// seed and the sample being generated, so samples can be generated in any
+// order, on any thread, and the same seed always gives the same map.
+static float hmap_random(heightmap hmap, uint32 x, uint32 y, int32 reach) {
+  uint64 key = splitmix64(hmap->seed ^ ((uint64) reach << 48));
+  key = splitmix64(key ^ (((uint64) y << 32) | x));
+
+  float r = (float) (key >> 40) / (float) (1 << 24);
+  return r * 2 * reach - reach;
+}
+
+#define HMAP_BAND_ROWS 64
+
+typedef struct {
+  heightmap hmap;
+  uint32 bands;
+  float* greatest;
+  float* smallest;
+  float offset;
+  float range;
+} hmap_band_job;
+
+static void hmap_band_range(hmap_band_job* job, uint32 band, uint64* first, uint64* last) {
+  heightmap hmap = job->hmap;
+  uint32 y0 = band * HMAP_BAND_ROWS;
+  uint32 y1 = y0 + HMAP_BAND_ROWS < hmap->height ? y0 + HMAP_BAND_ROWS : hmap->height;
+
+  *first = (uint64) y0 * hmap->width;
+  *last = (uint64) y1 * hmap->width;
+}
+
+static void hmap_minmax_band(void* ctx, uint32 task, uint32 worker) {
+  hmap_band_job* job = (hmap_band_job*) ctx;
+  const float* data = job->hmap->heightData;
+
+  uint64 idx = 0;
+  uint64 last = 0;
+  hmap_band_range(job, task, &idx, &last);
+
+  float greatest = data[idx];
+  float smallest = data[idx];
+
+#ifdef __SSE2__
+  if (last - idx >= 4) {
+    __m128 vmax = _mm_loadu_ps(data + idx);
+    __m128 vmin = vmax;
+
+    for (idx += 4; idx + 4 <= last; idx += 4) {
+      __m128 v = _mm_loadu_ps(data + idx);
+      vmax = _mm_max_ps(vmax, v);
+      vmin = _mm_min_ps(vmin, v);
+    }
 
-  //printf("set sample at %i %i to %f\n", x, y, val);
+    float lanes[8];
+    _mm_storeu_ps(lanes, vmax);
+    _mm_storeu_ps(lanes + 4, vmin);
 
-  if (val > hmap->greatestValue) {
-    hmap->greatestValue = val;
+    for (uint32 l = 0; l < 4; l++) {
+      greatest = lanes[l] > greatest ? lanes[l] : greatest;
+      smallest = lanes[l + 4] < smallest ? lanes[l + 4] : smallest;
+    }
   }
-  if (val < hmap->smallestValue) {
-    hmap->smallestValue = val;
+#endif
+
+  for (; idx < last; idx++) {
+    greatest = data[idx] > greatest ? data[idx] : greatest;
+    smallest = data[idx] < smallest ? data[idx] : smallest;
   }
-}
 
-static float random(int32 reach) {
-  float r = (float)rand() / RAND_MAX;
-  return r * 2 * reach - reach;
+  job->greatest[task] = greatest;
+  job->smallest[task] = smallest;
 }
 
-static void squareStep(heightmap hmap, uint32 x, uint32 y, int32 reach) {
-  uint32 count = 0;
-  float avg = 0.0f;
+static void hmap_rescale_band(void* ctx, uint32 task, uint32 worker) {
+  hmap_band_job* job = (hmap_band_job*) ctx;
+  float* data = job->hmap->heightData;
+
+  uint64 idx = 0;
+  uint64 last = 0;
+  hmap_band_range(job, task, &idx, &last);
 
-  if (x - reach >= 0 && y - reach >= 0) {
-    avg += hmap_getsample(hmap, x - reach, y - reach);
-    count++;
+#ifdef __SSE2__
+  __m128 offset = _mm_set1_ps(job->offset);
+  __m128 range = _mm_set1_ps(job->range);
+
+  for (; idx + 4 <= last; idx += 4) {
+    __m128 v = _mm_loadu_ps(data + idx);
+    _mm_storeu_ps(data + idx, _mm_div_ps(_mm_sub_ps(v, offset), range));
   }
-  if (x - reach >= 0 && y + reach < hmap->height) {
-    avg += hmap_getsample(hmap, x - reach, y + reach);
-    count++;
+#endif
+
+  for (; idx < last; idx++) {
+    data[idx] = (data[idx] - job->offset) / job->range;
   }
-  if (x + reach < hmap->width && y - reach >= 0) {
-    avg += hmap_getsample(hmap, x + reach, y - reach);
-    count++;
+}
+
+// Finds the smallest and greatest sample with a parallel reduction over row bands
+uint8 hmap_minmax(threadpool pool, heightmap hmap, float* smallest, float* greatest) {
+  if (!hmap || hmap->width == 0 || hmap->height == 0) {
+    return 0;
   }
-  if (x + reach < hmap->width && y + reach < hmap->height) {
-    avg += hmap_getsample(hmap, x + reach, y + reach);
-    count++;
+
+  uint32 bands = (hmap->height + HMAP_BAND_ROWS - 1) / HMAP_BAND_ROWS;
+  float* results = (float*) malloc(sizeof(float) * bands * 2);
+  if (!results) {
+    return 0;
   }
 
-  avg += random(reach);
-  avg /= count;
+  hmap_band_job job = {
+    .hmap = hmap,
+    .bands = bands,
+    .greatest = results,
+    .smallest = results + bands
+  };
 
-  hmap_setsample(hmap, x, y, avg);
-}
+  pool_run(pool, bands, hmap_minmax_band, &job);
 
-static void diamondStep(heightmap hmap, uint32 x, uint32 y, int32 reach) {
-  uint32 count = 0;
-  float avg = 0.0f;
+  *greatest = job.greatest[0];
+  *smallest = job.smallest[0];
 
-  if (x - reach >= 0) {
-    avg += hmap_getsample(hmap, x - reach, y);
-    count++;
-  }
-  if (x + reach < hmap->width) {
-    avg += hmap_getsample(hmap, x + reach, y);
-    count++;
-  }
-  if (y - reach >= 0) {
-    avg += hmap_getsample(hmap, x, y - reach);
-    count++;
+  for (uint32 i = 1; i < bands; i++) {
+    *greatest = job.greatest[i] > *greatest ? job.greatest[i] : *greatest;
+    *smallest = job.smallest[i] < *smallest ? job.smallest[i] : *smallest;
   }
-  if (y + reach < hmap->height) {
-    avg += hmap_getsample(hmap, x, y + reach);
-    count++;
+
+  free(results);
+  return 1;
+}
+
+// Maps smallest..greatest onto 0..1, in parallel over row bands
+static void hmap_rescale(threadpool pool, heightmap hmap, float smallest, float greatest) {
+  hmap_band_job job = {
+    .hmap = hmap,
+    .bands = (hmap->height + HMAP_BAND_ROWS - 1) / HMAP_BAND_ROWS,
+    .offset = smallest,
+    .range = greatest > smallest ? greatest - smallest : 1.0f
+  };
+
+  pool_run(pool, job.bands, hmap_rescale_band, &job);
+
+  hmap->smallestValue = 0.0f;
+  hmap->greatestValue = greatest > smallest ? 1.0f : 0.0f;
+}
+
+// Rescales the heightmap into 0..1 using its actual range
+void hmap_normalize(threadpool pool, heightmap hmap) {
+  float smallest = 0.0f;
+  float greatest = 0.0f;
+
+  if (hmap_minmax(pool, hmap, &smallest, &greatest)) {
+    hmap_rescale(pool, hmap, smallest, greatest);
   }
+}
 
-  avg += random(reach);
-  avg /= count;
+// Points per task below which a level is not worth handing to the pool
+#define HMAP_TASK_POINTS 8192
 
-  hmap_setsample(hmap, x, y, avg);
+// Diamond-square over any size. The lattice is refined coarse to fine and
+// each level only holds the samples the map needs: level s has the samples
+// at multiples of s from 0 up to the first multiple at or past the last
+// column and row, so at most one sample past the map edge per row and
+// column. The finest level is heightData itself and the coarser ones are
+// each a quarter of the one below, so the scratch space is about a third of
+// the map rather than a 2^n + 1 square around it.
+typedef struct {
+  float* data;
+  uint32 cols;
+  uint32 rows;
+  uint32 spacing;
+} hmap_level;
+
+static void hmap_level_init(hmap_level* level, heightmap hmap, uint32 spacing, float* data) {
+  level->data = data;
+  level->spacing = spacing;
+  level->cols = (hmap->width - 1 + spacing - 1) / spacing + 1;
+  level->rows = (hmap->height - 1 + spacing - 1) / spacing + 1;
 }
 
-static void hmap_generate_step(heightmap hmap, uint32 size) {
-  uint32 half = size / 2;
-  if (half < 1) {
-    return;
+typedef struct {
+  heightmap hmap;
+  const hmap_level* coarse;
+  const hmap_level* fine;
+  uint8 diamond;
+  uint32 rowsPerTask;
+} hmap_refine;
+
+// Fills rows of the fine level from the coarse one, which has every other
+// sample of it. The first pass copies the coarse samples over and puts a
+// square step in the middle of each coarse cell, the second fills the edge
+// midpoints with diamond steps from the samples around them. Edge midpoints
+// on the border of the level only have three of those.
+static void hmap_refine_rows(void* ctx, uint32 task, uint32 worker) {
+  hmap_refine* job = (hmap_refine*) ctx;
+  heightmap hmap = job->hmap;
+  const hmap_level* coarse = job->coarse;
+  const hmap_level* fine = job->fine;
+  uint32 cols = fine->cols;
+  uint32 reach = fine->spacing;
+
+  uint32 first = task * job->rowsPerTask;
+  uint32 last = first + job->rowsPerTask < fine->rows ? first + job->rowsPerTask : fine->rows;
+
+  for (uint32 j = first; j < last; j++) {
+    float* line = fine->data + (uint64) j * cols;
+    uint32 y = j * reach;
+
+    if (!job->diamond) {
+      if (j % 2 == 0) {
+        const float* src = coarse->data + (uint64) (j / 2) * coarse->cols;
+
+        for (uint32 i = 0; i < cols; i += 2) {
+          line[i] = src[i / 2];
+        }
+        continue;
+      }
+
+      const float* above = coarse->data + (uint64) (j / 2) * coarse->cols;
+      const float* below = above + coarse->cols;
+
+      for (uint32 i = 1; i < cols; i += 2) {
+        float sum = above[i / 2] + above[i / 2 + 1] + below[i / 2] + below[i / 2 + 1];
+        line[i] = (sum + hmap_random(hmap, i * reach, y, reach)) / 4;
+      }
+      continue;
+    }
+
+    const float* above = j > 0 ? line - cols : NULL;
+    const float* below = j + 1 < fine->rows ? line + cols : NULL;
+
+    for (uint32 i = (j + 1) % 2; i < cols; i += 2) {
+      float sum = 0.0f;
+      uint32 count = 0;
+
+      if (i > 0) {
+        sum += line[i - 1];
+        count++;
+      }
+      if (i + 1 < cols) {
+        sum += line[i + 1];
+        count++;
+      }
+      if (above) {
+        sum += above[i];
+        count++;
+      }
+      if (below) {
+        sum += below[i];
+        count++;
+      }
+
+      line[i] = (sum + hmap_random(hmap, i * reach, y, reach)) / count;
+    }
   }
+}
+
+static void hmap_refine_level(threadpool pool, heightmap hmap, const hmap_level* coarse, const hmap_level* fine) {
+  hmap_refine job = {
+    .hmap = hmap,
+    .coarse = coarse,
+    .fine = fine,
+    .rowsPerTask = HMAP_TASK_POINTS / (fine->cols + 1) + 1
+  };
+
+  uint32 tasks = (fine->rows + job.rowsPerTask - 1) / job.rowsPerTask;
 
+  job.diamond = 0;
+  pool_run(pool, tasks, hmap_refine_rows, &job);
+
+  job.diamond = 1;
+  pool_run(pool, tasks, hmap_refine_rows, &job);
+}
+
+// Runs every level into heightData. The coarsest level is a flat lattice
+// about half the map's longer side apart, and the first random offsets go in
+// a quarter of the way across, like the original recursive version. Starting
+// from a single random cell around the whole map instead lets its corners,
+// up to twice the map away, outweigh every finer level and tilt the map into
+// a plane. Returns 0 if the scratch levels can't be allocated.
+static uint8 hmap_generate_levels(threadpool pool, heightmap hmap) {
   uint32 w = hmap->width;
   uint32 h = hmap->height;
 
-  for (uint32 y = half; y < h; y += size) {
-    for (uint32 x = half; x < w; x += size) {
-      squareStep(hmap, x % w, y % h, half);
-    }
+  if (w == 0 || h == 0) {
+    return 0;
+  }
+
+  uint32 extent = w > h ? w - 1 : h - 1;
+  uint32 top = 2;
+  while (top * 4 <= extent) {
+    top *= 2;
   }
 
-  uint32 col = 0;
-  for (uint32 x = 0; x < w; x += half) {
-    col++;
+  // Levels alternate between two buffers, sized for the finest level each
+  // one holds
+  hmap_level sizes[2];
+  float* scratch[2] = { NULL, NULL };
 
-    uint32 ystart = 0;
+  for (uint32 b = 0; b < 2; b++) {
+    hmap_level_init(&sizes[b], hmap, 2 << b, NULL);
 
-    if (col % 2 == 1) {
-      ystart = half;
+    if (top >= (2u << b)) {
+      scratch[b] = (float*) malloc((uint64) sizes[b].cols * sizes[b].rows * sizeof(float));
+
+      if (!scratch[b]) {
+        free(scratch[0]);
+        return 0;
+      }
     }
+  }
+
+  hmap_level coarse;
+  hmap_level fine;
+  uint32 depth = 0;
+
+  for (uint32 s = top; s > 1; s /= 2) {
+    depth++;
+  }
 
-    for (uint32 y = ystart; y < h; y += size) {
-      diamondStep(hmap, x % w, y % h, half);
+  // Level 2^k goes to scratch[(k - 1) % 2], level 1 to heightData
+  hmap_level_init(&coarse, hmap, top, depth > 0 ? scratch[(depth - 1) % 2] : hmap->heightData);
+
+  for (uint32 j = 0; j < coarse.rows; j++) {
+    for (uint32 i = 0; i < coarse.cols; i++) {
+      coarse.data[(uint64) j * coarse.cols + i] = 0.0f;
     }
   }
 
-  hmap_generate_step(hmap, half);
-}
+  for (uint32 k = depth; k > 0; k--) {
+    hmap_level_init(&fine, hmap, 1u << (k - 1), k > 1 ? scratch[(k - 2) % 2] : hmap->heightData);
+    hmap_refine_level(pool, hmap, &coarse, &fine);
+    coarse = fine;
+  }
 
-static void hmap_relativeize(heightmap hmap) {
-  float sample = 0.0f;
+  free(scratch[0]);
+  free(scratch[1]);
 
-  float greatest = hmap->greatestValue;
-  float smallest = hmap->smallestValue;
+  return 1;
+}
 
-  float range = greatest - smallest;
+// Parallel diamond-square. Every level is split into row tasks on the pool,
+// square steps then diamond steps with pool_run as the barrier between them.
+// Samples come from hmap_random, so the result doesn't depend on the pool.
+void hmap_generate_parallel(threadpool pool, heightmap hmap) {
+  if (!hmap || !hmap_generate_levels(pool, hmap)) {
+    return;
+  }
 
-  for (uint32 x = 0; x < hmap->width; x++) {
-    for (uint32 y = 0; y < hmap->height; y++) {
-      sample = hmap_getsample(hmap, x, y);
-      sample -= smallest;
-      sample /= range;
+  // Weathering runs on the raw heights, the range is measured afterwards
+  if (hmap->thermal) {
+    thermal_run(pool, hmap->heightData, hmap->width, hmap->height, hmap->thermal, NULL);
+  }
 
-      hmap_setsample(hmap, x, y, sample);
-    }
+  float smallest = 0.0f;
+  float greatest = 0.0f;
+
+  if (!hmap_minmax(pool, hmap, &smallest, &greatest)) {
+    return;
   }
+
+  printf("greatestValue=%f\n", greatest);
+
+  hmap_rescale(pool, hmap, smallest, greatest);
 }
 
 void hmap_generate(heightmap hmap) {
-  if (!hmap) {
+  if (!hmap || !hmap_generate_levels(NULL, hmap)) {
     return;
   }
-  
-  uint32 size = hmap->width / 2;
-  hmap_generate_step(hmap, size);
 
-  printf("greatestValue=%f\n", hmap->greatestValue);
+  if (hmap->thermal) {
+    thermal_run(NULL, hmap->heightData, hmap->width, hmap->height, hmap->thermal, NULL);
+  }
 
-  // hmap_round(hmap);
-  hmap_relativeize(hmap);
+  hmap_normalize(NULL, hmap);
 }
@@ -0,0 +1,334 @@
+#include "common.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Hydraulic erosion by droplets. Each droplet starts somewhere random with a
+// little water, rolls downhill with some inertia, picks up sediment while it
+// speeds up and has capacity left and drops it again when it slows down or
+// climbs, losing water as it goes until it evaporates or runs out of steps.
+// Erosion is spread over a small brush around the droplet, deposits go to
+// the four samples around it.
+//
+// Droplets run in parallel without locks. The map is cut into
+// EROSION_TILE sized tiles and a droplet never gets further than half a tile
+// (brush included) from the tile it started in, so two tiles that aren't
+// next to each other can't touch the same samples. The tiles are run in
+// four phases by the parity of their coordinates, every tile of a phase at
+// once, and a tile runs its droplets in order. Droplet positions come from a
+// counter based hash of the seed, so the result only depends on the seed,
+// not on the thread count or the order tiles get picked up in. The tile grid
+// moves between rounds so droplets don't line up along the tile edges.
+
+#define EROSION_TILE 128
+#define EROSION_MAX_RADIUS 8
+
+typedef struct {
+  uint64 seed;
+  uint64 droplets;
+  // Droplets are split evenly over the rounds, each with its own tile grid
+  uint32 rounds;
+  uint32 lifetime;
+  // Brush radius for erosion, 1..EROSION_MAX_RADIUS
+  uint32 radius;
+  // How much of its direction a droplet keeps each step, 0..1
+  float inertia;
+  // Sediment a droplet can carry per unit of speed, water and slope
+  float capacity;
+  // Slope the capacity is worked out with at least, so droplets on flats
+  // still erode a bit
+  float minSlope;
+  // Fraction of the excess or missing sediment dropped or picked up per step
+  float deposit;
+  float erode;
+  // Fraction of the water lost per step
+  float evaporate;
+  float gravity;
+  // Droplets stop once they reach a height below this
+  float sealevel;
+} erosion_params;
+
+void erosion_default_params(erosion_params* params, uint64 seed, uint64 droplets) {
+  params->seed = seed;
+  params->droplets = droplets;
+  params->rounds = 4;
+  params->lifetime = 32;
+  params->radius = 3;
+  params->inertia = 0.1f;
+  params->capacity = 8.0f;
+  params->minSlope = 0.001f;
+  params->deposit = 0.3f;
+  params->erode = 0.3f;
+  params->evaporate = 0.02f;
+  params->gravity = 4.0f;
+  params->sealevel = 0.0f;
+}
+
+typedef struct {
+  int32 dx;
+  int32 dy;
+  // dx + dy * width
+  int64 offset;
+  float weight;
+} erosion_brush;
+
+typedef struct {
+  heightmap hmap;
+  const erosion_params* params;
+
+  const erosion_brush* brush;
+  uint32 brushSize;
+
+  // The current round's tile grid, shifted left and up by offx, offy
+  uint32 offx;
+  uint32 offy;
+  uint32 tilesx;
+  uint32 tilesy;
+  // Parity of the tiles in the current phase and how many of them per row
+  uint32 phasex;
+  uint32 phasey;
+  uint32 phaseTilesx;
+
+  uint32 round;
+  uint64 roundDroplets;
+} erosion_job;
+
+// Uniform in 0..1 from the top 24 bits of a hash
+static inline float erosion_unit(uint64 bits) {
+  return (float) (bits >> 40) / (float) (1 << 24);
+}
+
+// Part of the tile grid a tile covers, clipped to the samples a droplet can
+// stand on. Droplets need the sample to their right and below for the
+// gradient, so the last row and column are left out.
+static void erosion_tile_rect(erosion_job* job, uint32 tx, uint32 ty, int32* x0, int32* y0, int32* x1, int32* y1) {
+  int32 right = job->hmap->width - 1;
+  int32 bottom = job->hmap->height - 1;
+
+  *x0 = (int32) (tx * EROSION_TILE) - (int32) job->offx;
+  *y0 = (int32) (ty * EROSION_TILE) - (int32) job->offy;
+  *x1 = *x0 + EROSION_TILE < right ? *x0 + EROSION_TILE : right;
+  *y1 = *y0 + EROSION_TILE < bottom ? *y0 + EROSION_TILE : bottom;
+  *x0 = *x0 > 0 ? *x0 : 0;
+  *y0 = *y0 > 0 ? *y0 : 0;
+}
+
+// Height and gradient at x, y from the four samples around it
+static inline float erosion_sample(const float* heights, uint32 w, float x, float y, float* gx, float* gy) {
+  int32 nx = (int32) x;
+  int32 ny = (int32) y;
+  float u = x - nx;
+  float v = y - ny;
+
+  const float* p = heights + (uint64) ny * w + nx;
+  float nw = p[0];
+  float ne = p[1];
+  float sw = p[w];
+  float se = p[w + 1];
+
+  *gx = (ne - nw) * (1 - v) + (se - sw) * v;
+  *gy = (sw - nw) * (1 - u) + (se - ne) * u;
+
+  return nw * (1 - u) * (1 - v) + ne * u * (1 - v) + sw * (1 - u) * v + se * u * v;
+}
+
+static void erosion_droplet(erosion_job* job, float x, float y, int32 bx0, int32 by0, int32 bx1, int32 by1) {
+  const erosion_params* params = job->params;
+  uint32 w = job->hmap->width;
+  int32 h = job->hmap->height;
+  float* heights = job->hmap->heightData;
+
+  float dirx = 0;
+  float diry = 0;
+  float speed = 1;
+  float water = 1;
+  float sediment = 0;
+
+  for (uint32 step = 0; step < params->lifetime; step++) {
+    int32 nx = (int32) x;
+    int32 ny = (int32) y;
+    float u = x - nx;
+    float v = y - ny;
+
+    float gx, gy;
+    float height = erosion_sample(heights, w, x, y, &gx, &gy);
+
+    if (height < params->sealevel) {
+      break;
+    }
+
+    dirx = dirx * params->inertia - gx * (1 - params->inertia);
+    diry = diry * params->inertia - gy * (1 - params->inertia);
+
+    float len = sqrtf(dirx * dirx + diry * diry);
+    if (len == 0) {
+      break;
+    }
+
+    dirx /= len;
+    diry /= len;
+    x += dirx;
+    y += diry;
+
+    // Leaving the area the tile owns ends the droplet, whatever it carries
+    // is lost, as it is off the map edge
+    if (x < bx0 || y < by0 || x >= bx1 || y >= by1) {
+      break;
+    }
+
+    float ngx, ngy;
+    float delta = erosion_sample(heights, w, x, y, &ngx, &ngy) - height;
+    float slope = -delta > params->minSlope ? -delta : params->minSlope;
+    float capacity = slope * speed * water * params->capacity;
+
+    if (sediment > capacity || delta > 0) {
+      // Going uphill fills the pit behind up to the new height, otherwise
+      // drop part of the excess
+      float amount = delta > 0 ? (delta < sediment ? delta : sediment) : (sediment - capacity) * params->deposit;
+      float* p = heights + (uint64) ny * w + nx;
+
+      sediment -= amount;
+      p[0] += amount * (1 - u) * (1 - v);
+      p[1] += amount * u * (1 - v);
+      p[w] += amount * (1 - u) * v;
+      p[w + 1] += amount * u * v;
+    } else {
+      // Never dig deeper than the step down, that would make a pit
+      float amount = (capacity - sediment) * params->erode;
+      amount = amount < -delta ? amount : -delta;
+
+      int32 r = params->radius;
+      uint8 inside = nx >= r && ny >= r && nx + r < (int32) w && ny + r < h;
+      float* centre = heights + (uint64) ny * w + nx;
+
+      for (uint32 i = 0; i < job->brushSize; i++) {
+        int32 sx = nx + job->brush[i].dx;
+        int32 sy = ny + job->brush[i].dy;
+
+        if (!inside && (sx < 0 || sy < 0 || sx >= (int32) w || sy >= h)) {
+          continue;
+        }
+
+        float* p = centre + job->brush[i].offset;
+        float take = amount * job->brush[i].weight;
+        take = take < *p ? take : *p;
+
+        *p -= take;
+        sediment += take;
+      }
+    }
+
+    float speed2 = speed * speed - delta * params->gravity;
+    speed = speed2 > 0 ? sqrtf(speed2) : 0;
+    water *= 1 - params->evaporate;
+  }
+}
+
+static void erosion_tile(void* ctx, uint32 task, uint32 worker) {
+  erosion_job* job = (erosion_job*) ctx;
+  uint32 w = job->hmap->width - 1;
+  uint32 h = job->hmap->height - 1;
+
+  uint32 tx = job->phasex + 2 * (task % job->phaseTilesx);
+  uint32 ty = job->phasey + 2 * (task / job->phaseTilesx);
+
+  int32 x0, y0, x1, y1;
+  erosion_tile_rect(job, tx, ty, &x0, &y0, &x1, &y1);
+
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+
+  // The round's droplets are split over the tiles by area, in row major
+  // tile order, so the counts add up exactly
+  uint64 cells = (uint64) w * h;
+  uint64 before = (uint64) y0 * w + (uint64) (y1 - y0) * x0;
+  uint64 after = before + (uint64) (y1 - y0) * (x1 - x0);
+  uint64 first = job->roundDroplets * before / cells;
+  uint64 last = job->roundDroplets * after / cells;
+
+  // How far droplets may go, brush and the sample to the right included
+  int32 reach = EROSION_TILE / 2 - (int32) job->params->radius - 2;
+  int32 bx0 = x0 - reach > 0 ? x0 - reach : 0;
+  int32 by0 = y0 - reach > 0 ? y0 - reach : 0;
+  int32 bx1 = x1 + reach < (int32) w ? x1 + reach : (int32) w;
+  int32 by1 = y1 + reach < (int32) h ? y1 + reach : (int32) h;
+
+  uint64 key = splitmix64(job->params->seed ^ ((uint64) job->round << 48));
+
+  for (uint64 d = first; d < last; d++) {
+    uint64 bits = splitmix64(key ^ d);
+    float x = x0 + erosion_unit(bits) * (x1 - x0);
+    float y = y0 + erosion_unit(bits << 24) * (y1 - y0);
+
+    // Float rounding can land exactly on the far edge
+    x = x < x1 ? x : x1 - 1;
+    y = y < y1 ? y : y1 - 1;
+
+    erosion_droplet(job, x, y, bx0, by0, bx1, by1);
+  }
+}
+
+// Runs params->droplets droplets over hmap. Heights are changed in place and
+// smallestValue/greatestValue are left alone, the range only moves slightly.
+uint8 erosion_run(threadpool pool, heightmap hmap, const erosion_params* params) {
+  if (!hmap || !params || params->radius == 0 || params->radius > EROSION_MAX_RADIUS || params->rounds == 0) {
+    return 0;
+  }
+
+  // Droplets need a cell to stand in
+  if (hmap->width < 2 || hmap->height < 2) {
+    return 1;
+  }
+
+  // Brush weights fall off linearly from the centre and add up to 1
+  erosion_brush brush[(2 * EROSION_MAX_RADIUS + 1) * (2 * EROSION_MAX_RADIUS + 1)];
+  int32 radius = params->radius;
+  uint32 brushSize = 0;
+  float total = 0;
+
+  for (int32 dy = -radius; dy <= radius; dy++) {
+    for (int32 dx = -radius; dx <= radius; dx++) {
+      float weight = 1 - sqrtf(dx * dx + dy * dy) / radius;
+
+      if (weight > 0) {
+        brush[brushSize++] = (erosion_brush) { dx, dy, dx + dy * (int64) hmap->width, weight };
+        total += weight;
+      }
+    }
+  }
+
+  for (uint32 i = 0; i < brushSize; i++) {
+    brush[i].weight /= total;
+  }
+
+  erosion_job job = {
+    .hmap = hmap,
+    .params = params,
+    .brush = brush,
+    .brushSize = brushSize
+  };
+
+  for (uint32 round = 0; round < params->rounds; round++) {
+    uint64 grid = splitmix64(params->seed ^ ~(uint64) round);
+
+    job.round = round;
+    job.roundDroplets = params->droplets * (round + 1) / params->rounds - params->droplets * round / params->rounds;
+    job.offx = grid % EROSION_TILE;
+    job.offy = (grid >> 32) % EROSION_TILE;
+    job.tilesx = (hmap->width - 1 + job.offx + EROSION_TILE - 1) / EROSION_TILE;
+    job.tilesy = (hmap->height - 1 + job.offy + EROSION_TILE - 1) / EROSION_TILE;
+
+    for (uint32 phase = 0; phase < 4; phase++) {
+      job.phasex = phase & 1;
+      job.phasey = phase >> 1;
+      job.phaseTilesx = (job.tilesx - job.phasex + 1) / 2;
+
+      uint32 phaseTilesy = (job.tilesy - job.phasey + 1) / 2;
+
+      pool_run(pool, job.phaseTilesx * phaseTilesy, erosion_tile, &job);
+    }
+  }
+
+  return 1;
+}
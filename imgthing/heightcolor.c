@@ -0,0 +1,49 @@
+#include "common.h"
+#include <math.h>
+
+// Maps a row of heights to RGB with the same rules as colorheightmap: heights
+// below sealevel pick from sea by depth, the rest pick from land by height.
+// Heights outside 0..1 repeat the previous pixel of the span.
+typedef void (*heightcolor_kernel)(uint8* out, const float* heights, int32 count, color_array land, color_array sea, double sealevel);
+
+static void heightcolor_pixel(uint8* out, const float* heights, int32 i, color_array land, color_array sea, double sealevel) {
+  uint8* px = out + i * CHANNELS;
+  float noise = heights[i];
+  color24 c = BLACK;
+
+  if (i > 0) {
+    c = color(px[-3], px[-2], px[-1]);
+  }
+
+  if (!(noise < 0 || noise > 1.0f)) {
+    if (noise < sealevel) {
+      float rnoise = 1.0f - noise / sealevel;
+      pickcolor(&c, sea, rnoise);
+    } else {
+      pickcolor(&c, land, noise);
+    }
+  }
+
+  px[0] = c.r;
+  px[1] = c.g;
+  px[2] = c.b;
+}
+
+// The exact colors. main shades through the palette lookup tables instead,
+// this is the reference bench checks and measures them against.
+void heightcolor_scalar(uint8* out, const float* heights, int32 count, color_array land, color_array sea, double sealevel) {
+  for (int32 i = 0; i < count; i++) {
+    heightcolor_pixel(out, heights, i, land, sea, sealevel);
+  }
+}
+
+// Smallest float that is not below sealevel, so that comparing floats against
+// it gives the same answer as the scalar float < double comparison
+static float heightcolor_threshold(double sealevel) {
+  float t = (float) sealevel;
+  if ((double) t < sealevel) {
+    t = nextafterf(t, INFINITY);
+  }
+
+  return t;
+}
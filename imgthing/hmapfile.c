@@ -0,0 +1,231 @@
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// On-disk heightmap. The file is a HMAP_FILE_HEADER byte header followed by
+// the samples as little endian floats, row-major with no padding, exactly
+// like heightData. Since the header is page sized, the file can be mmap'ed
+// and the samples used in place as heightData: nothing is read up front and
+// the OS only pages in the rows that get touched. Rows are grouped into
+// tiles of tileRows rows, which are the unit readers should touch at once.
+
+#define HMAP_FILE_MAGIC "IMGTHMAP"
+#define HMAP_FILE_VERSION 1
+#define HMAP_FILE_HEADER 4096
+#define HMAP_FILE_TILE_ROWS 64
+
+#define HMAP_GEN_DIAMONDSQUARE 0
+#define HMAP_GEN_PERLIN 1
+
+// How the samples were generated, stored so a map can be regenerated
+typedef struct {
+  uint32 generator;
+  int32 depth;
+  double freq;
+  int64 originx;
+  int64 originy;
+} hmap_params;
+
+typedef struct {
+  char magic[8];
+  uint32 version;
+  uint32 headerSize;
+  uint32 width;
+  uint32 height;
+  uint32 tileRows;
+  uint32 generator;
+  uint64 seed;
+  float smallestValue;
+  float greatestValue;
+  int32 depth;
+  uint32 reserved;
+  double freq;
+  int64 originx;
+  int64 originy;
+  uint64 dataOffset;
+  uint64 dataSize;
+} hmap_file_header;
+
+static void hmap_fill_header(hmap_file_header* header, heightmap hmap, const hmap_params* params) {
+  memset(header, 0, sizeof(hmap_file_header));
+  memcpy(header->magic, HMAP_FILE_MAGIC, 8);
+
+  header->version = HMAP_FILE_VERSION;
+  header->headerSize = HMAP_FILE_HEADER;
+  header->width = hmap->width;
+  header->height = hmap->height;
+  header->tileRows = HMAP_FILE_TILE_ROWS;
+  header->seed = hmap->seed;
+  header->smallestValue = hmap->smallestValue;
+  header->greatestValue = hmap->greatestValue;
+  header->dataOffset = HMAP_FILE_HEADER;
+  header->dataSize = (uint64) hmap->width * hmap->height * sizeof(float);
+
+  if (params) {
+    header->generator = params->generator;
+    header->depth = params->depth;
+    header->freq = params->freq;
+    header->originx = params->originx;
+    header->originy = params->originy;
+  }
+}
+
+static uint8 hmap_check_header(const hmap_file_header* header, uint64 fileSize) {
+  if (memcmp(header->magic, HMAP_FILE_MAGIC, 8) != 0) {
+    return 0;
+  }
+  if (header->version != HMAP_FILE_VERSION || header->dataOffset < sizeof(hmap_file_header)) {
+    return 0;
+  }
+  if (header->dataOffset % sysconf(_SC_PAGESIZE) != 0) {
+    return 0;
+  }
+  if (header->dataSize != (uint64) header->width * header->height * sizeof(float)) {
+    return 0;
+  }
+
+  return header->dataOffset + header->dataSize <= fileSize;
+}
+
+// Writes hmap to path, params may be NULL
+uint8 hmap_save(heightmap hmap, const char* path, const hmap_params* params) {
+  if (!hmap || !path) {
+    return 0;
+  }
+
+  FILE* f = fopen(path, "wb");
+  if (!f) {
+    return 0;
+  }
+
+  uint8* header = (uint8*) calloc(1, HMAP_FILE_HEADER);
+  if (!header) {
+    fclose(f);
+    return 0;
+  }
+
+  hmap_fill_header((hmap_file_header*) header, hmap, params);
+
+  uint64 count = (uint64) hmap->width * hmap->height;
+  uint8 ok = fwrite(header, 1, HMAP_FILE_HEADER, f) == HMAP_FILE_HEADER;
+  ok = ok && fwrite(hmap->heightData, sizeof(float), count, f) == count;
+
+  free(header);
+
+  if (fclose(f) != 0) {
+    ok = 0;
+  }
+
+  return ok;
+}
+
+static heightmap hmap_from_mapping(uint8* base, uint64 size, const hmap_file_header* header, uint8 writable) {
+  heightmap hmap = (heightmap) calloc(1, sizeof(heightmap_t));
+  if (!hmap) {
+    munmap(base, size);
+    return NULL;
+  }
+
+  hmap->width = header->width;
+  hmap->height = header->height;
+  hmap->seed = header->seed;
+  hmap->smallestValue = header->smallestValue;
+  hmap->greatestValue = header->greatestValue;
+  hmap->heightData = (float*) (base + header->dataOffset);
+  hmap->mapping = base;
+  hmap->mappingSize = size;
+  hmap->mappingWritable = writable;
+
+  return hmap;
+}
+
+// Maps a heightmap file and returns a heightmap whose heightData points
+// straight into the mapping. Read-only maps must not be written to, use
+// writable to modify the file in place. Free with hmap_free.
+heightmap hmap_map(const char* path, uint8 writable) {
+  int fd = open(path, writable ? O_RDWR : O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (uint64) st.st_size < HMAP_FILE_HEADER) {
+    close(fd);
+    return NULL;
+  }
+
+  uint64 size = (uint64) st.st_size;
+  int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+  void* base = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (base == MAP_FAILED) {
+    return NULL;
+  }
+
+  hmap_file_header header;
+  memcpy(&header, base, sizeof(header));
+
+  if (!hmap_check_header(&header, size)) {
+    munmap(base, size);
+    return NULL;
+  }
+
+  return hmap_from_mapping((uint8*) base, size, &header, writable);
+}
+
+// Creates a w x h heightmap file and maps it writable, so a map too big for
+// RAM can be generated straight into the file. Call hmap_sync afterwards to
+// store the final range and seed in the header.
+heightmap hmap_create_mapped(const char* path, uint32 w, uint32 h, const hmap_params* params) {
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  heightmap_t shape = {
+    .width = w,
+    .height = h
+  };
+
+  hmap_file_header header;
+  hmap_fill_header(&header, &shape, params);
+
+  uint64 size = header.dataOffset + header.dataSize;
+
+  if (ftruncate(fd, (off_t) size) != 0) {
+    close(fd);
+    return NULL;
+  }
+
+  void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (base == MAP_FAILED) {
+    return NULL;
+  }
+
+  memcpy(base, &header, sizeof(header));
+
+  return hmap_from_mapping((uint8*) base, size, &header, 1);
+}
+
+// Writes the heightmap's seed and range back into the header of a writable
+// mapping and flushes it to disk. Returns 0 for maps mapped read-only.
+uint8 hmap_sync(heightmap hmap) {
+  if (!hmap || !hmap->mapping || !hmap->mappingWritable) {
+    return 0;
+  }
+
+  hmap_file_header* header = (hmap_file_header*) hmap->mapping;
+  header->seed = hmap->seed;
+  header->smallestValue = hmap->smallestValue;
+  header->greatestValue = hmap->greatestValue;
+
+  return msync(hmap->mapping, hmap->mappingSize, MS_SYNC) == 0;
+}
@@ -0,0 +1,626 @@
+#include "common.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Rivers from the terrain. hydro_fill fills every depression with a
+// priority-flood, raising pits and flats just enough that each land cell has
+// a strictly lower neighbour, so water always finds its way to the sea or
+// off the map. hydro_directions then points every cell at its steepest
+// downhill neighbour (D8), hydro_accumulate counts how many cells drain
+// through each one, and hydro_rivers marks the land cells that drain more
+// than a threshold. Every pass is linear, the fill's priority queue is a
+// bitset over the land cells radix sorted by height.
+//
+// Cells below sea level are outlets, they are never filled and flow nowhere.
+// Land cells on the map edge with no lower neighbour drain off the map.
+
+#define HYDRO_BAND_ROWS 64
+
+// D8 directions, east then clockwise with y going down
+#define FLOW_NONE 8
+
+static const int32 flowDx[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+static const int32 flowDy[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+
+typedef struct {
+  uint32 w;
+  uint32 h;
+  double sealevel;
+
+  // Heights with depressions filled, sea cells keep their height
+  float* filled;
+  // Per cell a direction 0..7 or FLOW_NONE
+  uint8* dirs;
+  // Per cell how many land cells drain through it, itself included
+  uint32* accum;
+} hydrology_t;
+
+typedef hydrology_t* hydrology;
+
+hydrology hydro_alloc(uint32 w, uint32 h) {
+  uint64 cells = (uint64) w * h;
+  hydrology hy = (hydrology) malloc(sizeof(hydrology_t));
+  float* filled = (float*) malloc(cells * sizeof(float));
+  uint8* dirs = (uint8*) malloc(cells);
+  uint32* accum = (uint32*) malloc(cells * sizeof(uint32));
+
+  if (!hy || !filled || !dirs || !accum) {
+    free(hy);
+    free(filled);
+    free(dirs);
+    free(accum);
+    return NULL;
+  }
+
+  hy->w = w;
+  hy->h = h;
+  hy->sealevel = 0;
+  hy->filled = filled;
+  hy->dirs = dirs;
+  hy->accum = accum;
+
+  return hy;
+}
+
+void hydro_free(hydrology hy) {
+  if (!hy) {
+    return;
+  }
+
+  free(hy->filled);
+  free(hy->dirs);
+  free(hy->accum);
+  free(hy);
+}
+
+static inline uint32 hydro_key(float height) {
+  uint32 key;
+  memcpy(&key, &height, sizeof(key));
+  return key;
+}
+
+static inline uint8 hydro_is_sea(hydrology hy, float height) {
+  return height < hy->sealevel;
+}
+
+// The flood's priority queue. A cell only ever enters it with its own height,
+// and only once the flood has passed a lower height, so the whole order is
+// known up front: land cells are radix sorted by height once and the queue
+// is a bitset over their ranks. A push sets a bit and a pop takes the lowest
+// set bit, which never moves backwards.
+typedef struct {
+  // Rank of each padded cell and the padded cell of each rank
+  uint32* rank;
+  uint32* cells;
+  uint64* bits;
+  uint64 cursor;
+  uint64 count;
+} hydro_queue;
+
+#define HYDRO_SORT_BITS 12
+
+// Sorts n cells by key, as key << 32 | cell pairs in cells with out as the
+// other buffer, then leaves just the cells in order in out. Land heights
+// only span a few float exponents, so the keys are sorted relative to the
+// smallest one in as few HYDRO_SORT_BITS passes as cover the rest.
+static uint8 hydro_sort(uint64* cells, uint64* out, uint64 n, uint32 low, uint32 high) {
+  uint32* counts = (uint32*) malloc((1 << HYDRO_SORT_BITS) * sizeof(uint32));
+  if (!counts) {
+    return 0;
+  }
+
+  uint32 span = high - low;
+  uint64* src = cells;
+  uint64* dst = out;
+
+  for (uint32 shift = 0; shift < 32 && (shift == 0 || span >> shift); shift += HYDRO_SORT_BITS) {
+    memset(counts, 0, (1 << HYDRO_SORT_BITS) * sizeof(uint32));
+
+    for (uint64 i = 0; i < n; i++) {
+      counts[(((uint32) (src[i] >> 32) - low) >> shift) & ((1 << HYDRO_SORT_BITS) - 1)]++;
+    }
+
+    uint32 total = 0;
+    for (uint32 b = 0; b < (1 << HYDRO_SORT_BITS); b++) {
+      uint32 c = counts[b];
+      counts[b] = total;
+      total += c;
+    }
+
+    for (uint64 i = 0; i < n; i++) {
+      dst[counts[(((uint32) (src[i] >> 32) - low) >> shift) & ((1 << HYDRO_SORT_BITS) - 1)]++] = src[i];
+    }
+
+    uint64* t = src;
+    src = dst;
+    dst = t;
+  }
+
+  uint32* order = (uint32*) out;
+  for (uint64 i = 0; i < n; i++) {
+    order[i] = (uint32) src[i];
+  }
+
+  free(counts);
+  return 1;
+}
+
+static inline void hydro_queue_push(hydro_queue* queue, uint32 cell) {
+  uint32 r = queue->rank[cell];
+  queue->bits[r / 64] |= 1ull << (r % 64);
+  queue->count++;
+}
+
+static inline uint32 hydro_queue_pop(hydro_queue* queue) {
+  while (!queue->bits[queue->cursor]) {
+    queue->cursor++;
+  }
+
+  uint64 word = queue->bits[queue->cursor];
+  uint32 r = queue->cursor * 64 + __builtin_ctzll(word);
+
+  queue->bits[queue->cursor] = word & (word - 1);
+  queue->count--;
+
+  return queue->cells[r];
+}
+
+// Fills hy->filled from hmap, which must be the same size. Serial: the flood
+// has to visit cells in height order across the whole map.
+uint8 hydro_fill(hydrology hy, heightmap hmap, double sealevel) {
+  if (!hy || !hmap || hmap->width != hy->w || hmap->height != hy->h) {
+    return 0;
+  }
+
+  uint32 w = hy->w;
+  uint32 h = hy->h;
+  uint64 cells = (uint64) w * h;
+
+  // The flood works on a copy with a closed one cell border, so neighbours
+  // never need bounds checks. Heights are kept as keys.
+  uint64 stride = (uint64) w + 2;
+  uint64 padded = stride * (h + 2);
+  int64 offsets[8];
+
+  for (uint32 d = 0; d < 8; d++) {
+    offsets[d] = flowDx[d] + flowDy[d] * (int64) stride;
+  }
+
+  uint32* keys = (uint32*) malloc(padded * sizeof(uint32));
+  uint8* closed = (uint8*) malloc(padded);
+  // Sort buffers, out ends up holding the ranked cells and pairs is reused
+  // as the pit list
+  uint64* pairs = (uint64*) malloc(cells * sizeof(uint64));
+  uint64* out = (uint64*) malloc(cells * sizeof(uint64));
+  uint32* pits = (uint32*) pairs;
+
+  // Each cell is queued at most once, in the queue or on the pit list
+  hydro_queue queue = {
+    .rank = (uint32*) malloc(padded * sizeof(uint32)),
+    .cells = (uint32*) out,
+    .bits = (uint64*) calloc(cells / 64 + 1, sizeof(uint64)),
+    .cursor = 0,
+    .count = 0
+  };
+
+  uint8 ok = keys && closed && pairs && out && queue.rank && queue.bits && padded <= 0xFFFFFFFFull;
+  uint64 land = 0;
+
+  hy->sealevel = sealevel;
+
+  if (ok) {
+    uint32 low = ~0u;
+    uint32 high = 0;
+
+    // Sea cells are outlets and never reopen
+    memset(closed, 1, padded);
+
+    for (uint32 y = 0; y < h; y++) {
+      const float* row = hmap->heightData + (uint64) y * w;
+      uint64 p = (y + 1) * stride + 1;
+
+      for (uint32 x = 0; x < w; x++) {
+        uint32 key = hydro_key(row[x]);
+
+        keys[p + x] = key;
+        closed[p + x] = hydro_is_sea(hy, row[x]);
+
+        if (!closed[p + x]) {
+          pairs[land++] = (uint64) key << 32 | (p + x);
+          low = key < low ? key : low;
+          high = key > high ? key : high;
+        }
+      }
+    }
+
+    ok = hydro_sort(pairs, out, land, low, high);
+  }
+
+  if (!ok) {
+    free(keys);
+    free(closed);
+    free(pairs);
+    free(out);
+    free(queue.rank);
+    free(queue.bits);
+    return 0;
+  }
+
+  for (uint64 r = 0; r < land; r++) {
+    queue.rank[queue.cells[r]] = r;
+  }
+
+  // Land cells next to the sea or on the edge of the map start the flood.
+  // Those are exactly the open cells with a closed neighbour, as the border
+  // is closed. Outlets close a row late so they don't count for the next row.
+  uint8* outlets = (uint8*) calloc(stride * 2, 1);
+  if (!outlets) {
+    ok = 0;
+  }
+
+  for (uint32 y = 0; y <= h && ok; y++) {
+    uint8* flags = outlets + (y & 1) * stride;
+    uint8* lagged = outlets + (~y & 1) * stride;
+    uint64 row = (y + 1) * stride + 1;
+    uint64 prev = y * stride + 1;
+
+    if (y < h) {
+      const uint8* c = closed + row;
+      uint32 x = 0;
+
+#ifdef __SSE2__
+      for (; x + 16 <= w; x += 16) {
+        __m128i any = _mm_or_si128(_mm_loadu_si128((__m128i*) (c + x - 1)), _mm_loadu_si128((__m128i*) (c + x + 1)));
+
+        for (int32 dy = -1; dy <= 1; dy += 2) {
+          const uint8* n = c + x + dy * (int64) stride;
+          any = _mm_or_si128(any, _mm_loadu_si128((__m128i*) (n - 1)));
+          any = _mm_or_si128(any, _mm_loadu_si128((__m128i*) n));
+          any = _mm_or_si128(any, _mm_loadu_si128((__m128i*) (n + 1)));
+        }
+
+        _mm_storeu_si128((__m128i*) (flags + x), _mm_andnot_si128(_mm_loadu_si128((__m128i*) (c + x)), any));
+      }
+#endif
+
+      for (; x < w; x++) {
+        uint8 any = 0;
+        for (uint32 d = 0; d < 8; d++) {
+          any |= c[x + offsets[d]];
+        }
+
+        flags[x] = any & !c[x];
+      }
+    }
+
+    if (y > 0) {
+      for (uint32 x = 0; x < w; x++) {
+        if (lagged[x]) {
+          closed[prev + x] = 1;
+          hydro_queue_push(&queue, prev + x);
+        }
+      }
+    }
+  }
+
+  free(outlets);
+
+  if (!ok) {
+    free(keys);
+    free(closed);
+    free(pairs);
+    free(out);
+    free(queue.rank);
+    free(queue.bits);
+    return 0;
+  }
+
+  uint64 pitHead = 0;
+  uint64 pitTail = 0;
+
+  while (queue.count > 0 || pitHead < pitTail) {
+    uint32 c = pitHead < pitTail ? pits[pitHead++] : hydro_queue_pop(&queue);
+
+    // Anything reached from c drains through it, so must end up above it.
+    // One past c's key is the next float up.
+    uint32 floorKey = keys[c] + 1;
+
+    for (uint32 d = 0; d < 8; d++) {
+      uint32 n = c + offsets[d];
+      if (closed[n]) {
+        continue;
+      }
+
+      closed[n] = 1;
+
+      if (keys[n] <= floorKey) {
+        keys[n] = floorKey;
+        pits[pitTail++] = n;
+      } else {
+        hydro_queue_push(&queue, n);
+      }
+    }
+  }
+
+  for (uint32 y = 0; y < h; y++) {
+    memcpy(hy->filled + (uint64) y * w, keys + (y + 1) * stride + 1, w * sizeof(float));
+  }
+
+  free(keys);
+  free(closed);
+  free(pairs);
+  free(out);
+  free(queue.rank);
+  free(queue.bits);
+
+  return 1;
+}
+
+typedef struct {
+  hydrology hy;
+  uint32* counts;
+  // Two rows of 32 bit values per worker
+  uint32* scratch;
+  uint32 threshold;
+  landmask rivers;
+} hydro_job;
+
+// The passes below go over a row once per direction rather than over the
+// directions once per cell, which keeps the inner loops free of bounds checks
+// and lets the compiler vectorize them. x0..x1 is the part of a row whose
+// neighbour in direction d is on the map.
+static inline void hydro_span(uint32 d, uint32 w, uint32* x0, uint32* x1) {
+  *x0 = flowDx[d] < 0 ? 1 : 0;
+  *x1 = flowDx[d] > 0 ? w - 1 : w;
+}
+
+static void hydro_directions_band(void* ctx, uint32 task, uint32 worker) {
+  hydro_job* job = (hydro_job*) ctx;
+  hydrology hy = job->hy;
+  uint32 w = hy->w;
+  const float* filled = hy->filled;
+  float* steepest = (float*) job->scratch + (uint64) worker * w * 2;
+  uint32* best = job->scratch + (uint64) worker * w * 2 + w;
+
+  uint32 y0 = task * HYDRO_BAND_ROWS;
+  uint32 y1 = y0 + HYDRO_BAND_ROWS < hy->h ? y0 + HYDRO_BAND_ROWS : hy->h;
+
+  for (uint32 y = y0; y < y1; y++) {
+    const float* row = filled + (uint64) y * w;
+    uint8* dirs = hy->dirs + (uint64) y * w;
+
+    memset(steepest, 0, w * sizeof(float));
+
+    for (uint32 x = 0; x < w; x++) {
+      best[x] = FLOW_NONE;
+    }
+
+    for (uint32 d = 0; d < 8; d++) {
+      int32 ny = (int32) y + flowDy[d];
+      if (ny < 0 || ny >= (int32) hy->h) {
+        continue;
+      }
+
+      const float* next = filled + (uint64) ny * w + flowDx[d];
+      // Diagonal neighbours are sqrt(2) away
+      float scale = d & 1 ? 0.70710678f : 1.0f;
+      uint32 x0, x1;
+      hydro_span(d, w, &x0, &x1);
+      uint32 x = x0;
+
+#ifdef __SSE2__
+      __m128 vscale = _mm_set1_ps(scale);
+      __m128i vdir = _mm_set1_epi32(d);
+
+      for (; x + 4 <= x1; x += 4) {
+        __m128 slope = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(row + x), _mm_loadu_ps(next + x)), vscale);
+        __m128 old = _mm_loadu_ps(steepest + x);
+        __m128i steeper = _mm_castps_si128(_mm_cmpgt_ps(slope, old));
+        __m128i dir = _mm_loadu_si128((__m128i*) (best + x));
+
+        _mm_storeu_ps(steepest + x, _mm_max_ps(slope, old));
+        _mm_storeu_si128((__m128i*) (best + x), _mm_or_si128(_mm_and_si128(steeper, vdir), _mm_andnot_si128(steeper, dir)));
+      }
+#endif
+
+      for (; x < x1; x++) {
+        float slope = (row[x] - next[x]) * scale;
+
+        if (slope > steepest[x]) {
+          steepest[x] = slope;
+          best[x] = d;
+        }
+      }
+    }
+
+    for (uint32 x = 0; x < w; x++) {
+      dirs[x] = hydro_is_sea(hy, row[x]) ? FLOW_NONE : best[x];
+    }
+  }
+}
+
+// Points every cell at its steepest downhill neighbour in hy->filled
+uint8 hydro_directions(threadpool pool, hydrology hy) {
+  hydro_job job = {
+    .hy = hy,
+    .scratch = (uint32*) malloc((uint64) pool_workers(pool) * hy->w * 2 * sizeof(uint32))
+  };
+
+  if (!job.scratch) {
+    return 0;
+  }
+
+  pool_run(pool, (hy->h + HYDRO_BAND_ROWS - 1) / HYDRO_BAND_ROWS, hydro_directions_band, &job);
+
+  free(job.scratch);
+  return 1;
+}
+
+// Counts the neighbours that flow into each cell, pulling rather than pushing
+// so bands don't write to each other's cells
+static void hydro_donors_band(void* ctx, uint32 task, uint32 worker) {
+  hydro_job* job = (hydro_job*) ctx;
+  hydrology hy = job->hy;
+  uint32 w = hy->w;
+
+  uint32 y0 = task * HYDRO_BAND_ROWS;
+  uint32 y1 = y0 + HYDRO_BAND_ROWS < hy->h ? y0 + HYDRO_BAND_ROWS : hy->h;
+
+  // At most 8 donors, so bytes are enough while counting
+  uint8* donors = (uint8*) (job->scratch + (uint64) worker * w * 2);
+
+  for (uint32 y = y0; y < y1; y++) {
+    const float* row = hy->filled + (uint64) y * w;
+    uint32* accum = hy->accum + (uint64) y * w;
+    uint32* counts = job->counts + (uint64) y * w;
+
+    memset(donors, 0, w);
+
+    for (uint32 d = 0; d < 8; d++) {
+      int32 ny = (int32) y + flowDy[d];
+      if (ny < 0 || ny >= (int32) hy->h) {
+        continue;
+      }
+
+      // The neighbour flows here if it points back the opposite way
+      const uint8* next = hy->dirs + (uint64) ny * w + flowDx[d];
+      uint8 back = (d + 4) & 7;
+      uint32 x0, x1;
+      hydro_span(d, w, &x0, &x1);
+      uint32 x = x0;
+
+#ifdef __SSE2__
+      __m128i vback = _mm_set1_epi8(back);
+
+      for (; x + 16 <= x1; x += 16) {
+        // Matches are all ones, so subtracting adds 1
+        __m128i match = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*) (next + x)), vback);
+        __m128i count = _mm_loadu_si128((__m128i*) (donors + x));
+        _mm_storeu_si128((__m128i*) (donors + x), _mm_sub_epi8(count, match));
+      }
+#endif
+
+      for (; x < x1; x++) {
+        donors[x] += next[x] == back;
+      }
+    }
+
+    for (uint32 x = 0; x < w; x++) {
+      counts[x] = donors[x];
+      accum[x] = !hydro_is_sea(hy, row[x]);
+    }
+  }
+}
+
+// Fills hy->accum from hy->dirs. Cells are visited upstream first, starting
+// from the ones nothing flows into, so every cell is handled once.
+uint8 hydro_accumulate(threadpool pool, hydrology hy) {
+  uint64 cells = (uint64) hy->w * hy->h;
+  uint32* donors = (uint32*) malloc(cells * sizeof(uint32));
+  uint32* queue = (uint32*) malloc(cells * sizeof(uint32));
+
+  if (!donors || !queue) {
+    free(donors);
+    free(queue);
+    return 0;
+  }
+
+  hydro_job job = {
+    .hy = hy,
+    .counts = donors,
+    .scratch = (uint32*) malloc((uint64) pool_workers(pool) * hy->w * 2 * sizeof(uint32))
+  };
+
+  if (!job.scratch) {
+    free(donors);
+    free(queue);
+    return 0;
+  }
+
+  pool_run(pool, (hy->h + HYDRO_BAND_ROWS - 1) / HYDRO_BAND_ROWS, hydro_donors_band, &job);
+  free(job.scratch);
+
+  uint64 head = 0;
+  uint64 tail = 0;
+
+  for (uint64 c = 0; c < cells; c++) {
+    if (donors[c] == 0) {
+      queue[tail++] = c;
+    }
+  }
+
+  while (head < tail) {
+    uint32 c = queue[head++];
+    uint8 dir = hy->dirs[c];
+
+    if (dir == FLOW_NONE) {
+      continue;
+    }
+
+    uint32 next = c + flowDx[dir] + flowDy[dir] * (int32) hy->w;
+    hy->accum[next] += hy->accum[c];
+
+    if (--donors[next] == 0) {
+      queue[tail++] = next;
+    }
+  }
+
+  free(donors);
+  free(queue);
+
+  return 1;
+}
+
+static void hydro_rivers_band(void* ctx, uint32 task, uint32 worker) {
+  hydro_job* job = (hydro_job*) ctx;
+  hydrology hy = job->hy;
+  landmask rivers = job->rivers;
+
+  uint32 y0 = task * HYDRO_BAND_ROWS;
+  uint32 y1 = y0 + HYDRO_BAND_ROWS < hy->h ? y0 + HYDRO_BAND_ROWS : hy->h;
+
+  for (uint32 y = y0; y < y1; y++) {
+    const uint32* accum = hy->accum + (uint64) y * hy->w;
+    const float* filled = hy->filled + (uint64) y * hy->w;
+    uint64* row = landmask_row(rivers, y);
+
+    memset(row, 0, rivers->words * sizeof(uint64));
+
+    for (uint32 x = 0; x < hy->w; x++) {
+      if (accum[x] >= job->threshold && !hydro_is_sea(hy, filled[x])) {
+        row[x / 64] |= 1ull << (x % 64);
+      }
+    }
+  }
+}
+
+// Marks the land cells that at least threshold cells drain through
+uint8 hydro_rivers(threadpool pool, hydrology hy, uint32 threshold, landmask rivers) {
+  if (!hy || !rivers || rivers->w != hy->w || rivers->h != hy->h) {
+    return 0;
+  }
+
+  hydro_job job = {
+    .hy = hy,
+    .threshold = threshold,
+    .rivers = rivers
+  };
+
+  pool_run(pool, (hy->h + HYDRO_BAND_ROWS - 1) / HYDRO_BAND_ROWS, hydro_rivers_band, &job);
+
+  return 1;
+}
+
+// Fill, directions and accumulation in one go
+uint8 hydro_run(threadpool pool, hydrology hy, heightmap hmap, double sealevel) {
+  if (!hydro_fill(hy, hmap, sealevel)) {
+    return 0;
+  }
+
+  return hydro_directions(pool, hy) && hydro_accumulate(pool, hy);
+}
@@ -0,0 +1,295 @@
+#include "common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define CHANNELS    3
+
+typedef struct {
+  uint32 w;
+  uint32 h;
+  uint8* buf;
+} img;
+
+img allocImage(uint32 w, uint32 h) {
+  uint64 memsize = (uint64) CHANNELS * w * h;
+  uint8* buf = (uint8*) malloc(memsize);
+  img i = {
+    .w = w, 
+    .h = h, 
+    .buf = buf
+  };
+
+  if (buf) {
+    memset(buf, 255, memsize);
+  }
+
+  return i;
+}
+
+void freeimg(img i) {
+  if (!i.buf) {
+    return;
+  }
+
+  free(i.buf);
+}
+
+uint8* offsetBy(img image, int32 x, int32 y) {
+  uint64 offset = 0;
+  offset += x;
+  offset += (uint64) y * image.w;
+  offset *= CHANNELS;
+  return image.buf + offset;
+}
+
+void setcolor(img image, int32 x, int32 y, color24 color) {
+  uint8* ptr = offsetBy(image, x, y);
+  ptr[0] = color.r;
+  ptr[1] = color.g;
+  ptr[2] = color.b;
+}
+
+color24 getcolor(img image, int32 x, int32 y) {
+  uint8* ptr = offsetBy(image, x, y);
+  color24 res = {
+    .r = ptr[0],
+    .g = ptr[1],
+    .b = ptr[2]
+  };
+
+  return res;
+}
+
+typedef void (*shader)(img image, int32 x, int32 y, color24* out);
+
+void applyshader(img image, shader shaderFunc) {
+  uint64 imgsize = (uint64) image.w * image.h;
+  uint64 pixelsDone = 0;
+
+  color24 c = {
+    .r = 0,
+    .g = 0,
+    .b = 0
+  };
+
+  uint8* ptr = image.buf;
+
+  for (int32 y = 0; y < image.h; y++) {
+    for (int32 x = 0; x < image.w; x++) {
+      shaderFunc(image, x, y, &c);
+
+      ptr[0] = c.r;
+      ptr[1] = c.g;
+      ptr[2] = c.b;
+
+      ptr += CHANNELS;
+    }
+  }
+}
+
+#define SHADER_TILE 64
+
+typedef struct {
+  img image;
+  shader func;
+  uint32 tilesx;
+} shader_job;
+
+static void shadetile(void* ctx, uint32 task, uint32 worker) {
+  shader_job* job = (shader_job*) ctx;
+  img image = job->image;
+
+  uint32 x0 = (task % job->tilesx) * SHADER_TILE;
+  uint32 y0 = (task / job->tilesx) * SHADER_TILE;
+  uint32 x1 = x0 + SHADER_TILE < image.w ? x0 + SHADER_TILE : image.w;
+  uint32 y1 = y0 + SHADER_TILE < image.h ? y0 + SHADER_TILE : image.h;
+
+  color24 c = {
+    .r = 0,
+    .g = 0,
+    .b = 0
+  };
+
+  for (uint32 y = y0; y < y1; y++) {
+    uint8* ptr = offsetBy(image, x0, y);
+
+    for (uint32 x = x0; x < x1; x++) {
+      job->func(image, x, y, &c);
+
+      ptr[0] = c.r;
+      ptr[1] = c.g;
+      ptr[2] = c.b;
+
+      ptr += CHANNELS;
+    }
+  }
+}
+
+// applyshader on the pool, for per-pixel shaders that have no span version.
+// Work is split into SHADER_TILE sized tiles, a NULL pool shades them in
+// order on the calling thread. Every pixel is written by exactly one tile, so
+// the result matches applyshader for any shader that always writes to out.
+void applyshader_parallel(threadpool pool, img image, shader shaderFunc) {
+  uint32 tilesx = (image.w + SHADER_TILE - 1) / SHADER_TILE;
+  uint32 tilesy = (image.h + SHADER_TILE - 1) / SHADER_TILE;
+
+  shader_job job = {
+    .image = image,
+    .func = shaderFunc,
+    .tilesx = tilesx
+  };
+
+  pool_run(pool, tilesx * tilesy, shadetile, &job);
+}
+
+// Shades count pixels of row y starting at x. heights points at the matching
+// heightmap samples and out at the first byte of the span in the image.
+// Stages run one after another on the same span, so later stages see what
+// earlier ones wrote.
+typedef void (*spanshader)(img image, int32 x, int32 y, int32 count, const float* heights, uint8* out);
+
+#define SPAN_ROWS 8
+#define SPAN_WIDTH 1024
+
+typedef struct {
+  img image;
+  heightmap hmap;
+  const spanshader* stages;
+  uint32 count;
+  uint32 chunksx;
+} span_job;
+
+static void shadespans(void* ctx, uint32 task, uint32 worker) {
+  span_job* job = (span_job*) ctx;
+  img image = job->image;
+
+  uint32 x0 = (task % job->chunksx) * SPAN_WIDTH;
+  uint32 y0 = (task / job->chunksx) * SPAN_ROWS;
+  uint32 x1 = x0 + SPAN_WIDTH < image.w ? x0 + SPAN_WIDTH : image.w;
+  uint32 y1 = y0 + SPAN_ROWS < image.h ? y0 + SPAN_ROWS : image.h;
+
+  for (uint32 y = y0; y < y1; y++) {
+    const float* heights = job->hmap->heightData + x0 + (uint64) y * job->hmap->width;
+    uint8* ptr = offsetBy(image, x0, y);
+
+    for (uint32 s = 0; s < job->count; s++) {
+      job->stages[s](image, x0, y, x1 - x0, heights, ptr);
+    }
+  }
+}
+
+// Runs several span shaders over the image in one traversal. hmap must cover
+// the image, span shaders get whole row segments so they can be vectorized.
+//
+// Stages that need a neighbourhood get it from their inputs, never from the
+// image: they may read any row of hmap (heights is a pointer into
+// heightData, so heights - hmap->width is the row above) and any mask built
+// before the pipeline runs, like the coastMask outlineLandSpan reads. Of the
+// image they may only read their own span, which holds what the earlier
+// stages wrote. Other pixels belong to chunks that may not be shaded yet or
+// are being shaded on another worker.
+//
+// Work is split into SPAN_WIDTH x SPAN_ROWS chunks and shaded on the pool, a
+// NULL pool shades them in order on the calling thread. Every pixel belongs
+// to exactly one chunk, so the result doesn't depend on the pool.
+void applyspanpipeline(threadpool pool, img image, heightmap hmap, const spanshader* stages, uint32 count) {
+  if (!hmap || hmap->width != image.w || hmap->height < image.h) {
+    return;
+  }
+
+  uint32 chunksx = (image.w + SPAN_WIDTH - 1) / SPAN_WIDTH;
+  uint32 bands = (image.h + SPAN_ROWS - 1) / SPAN_ROWS;
+
+  span_job job = {
+    .image = image,
+    .hmap = hmap,
+    .stages = stages,
+    .count = count,
+    .chunksx = chunksx
+  };
+
+  pool_run(pool, chunksx * bands, shadespans, &job);
+}
+
+// One palette index per pixel, for images that only use a few colors. Takes
+// a third of the memory of an img and is written out as an indexed PNG.
+typedef struct {
+  uint32 w;
+  uint32 h;
+  uint8* buf;
+} indeximg;
+
+indeximg allocIndexImage(uint32 w, uint32 h) {
+  uint64 memsize = (uint64) w * h;
+  uint8* buf = (uint8*) malloc(memsize);
+  indeximg i = {
+    .w = w,
+    .h = h,
+    .buf = buf
+  };
+
+  if (buf) {
+    memset(buf, 0, memsize);
+  }
+
+  return i;
+}
+
+void freeindeximg(indeximg i) {
+  if (!i.buf) {
+    return;
+  }
+
+  free(i.buf);
+}
+
+// spanshader for index images, out points at count indices
+typedef void (*indexspanshader)(indeximg image, int32 x, int32 y, int32 count, const float* heights, uint8* out);
+
+typedef struct {
+  indeximg image;
+  heightmap hmap;
+  const indexspanshader* stages;
+  uint32 count;
+  uint32 chunksx;
+} index_span_job;
+
+static void shadeindexspans(void* ctx, uint32 task, uint32 worker) {
+  index_span_job* job = (index_span_job*) ctx;
+  indeximg image = job->image;
+
+  uint32 x0 = (task % job->chunksx) * SPAN_WIDTH;
+  uint32 y0 = (task / job->chunksx) * SPAN_ROWS;
+  uint32 x1 = x0 + SPAN_WIDTH < image.w ? x0 + SPAN_WIDTH : image.w;
+  uint32 y1 = y0 + SPAN_ROWS < image.h ? y0 + SPAN_ROWS : image.h;
+
+  for (uint32 y = y0; y < y1; y++) {
+    const float* heights = job->hmap->heightData + x0 + (uint64) y * job->hmap->width;
+    uint8* ptr = image.buf + x0 + (uint64) y * image.w;
+
+    for (uint32 s = 0; s < job->count; s++) {
+      job->stages[s](image, x0, y, x1 - x0, heights, ptr);
+    }
+  }
+}
+
+// applyspanpipeline for index images
+void applyindexpipeline(threadpool pool, indeximg image, heightmap hmap, const indexspanshader* stages, uint32 count) {
+  if (!hmap || hmap->width != image.w || hmap->height < image.h) {
+    return;
+  }
+
+  uint32 chunksx = (image.w + SPAN_WIDTH - 1) / SPAN_WIDTH;
+  uint32 bands = (image.h + SPAN_ROWS - 1) / SPAN_ROWS;
+
+  index_span_job job = {
+    .image = image,
+    .hmap = hmap,
+    .stages = stages,
+    .count = count,
+    .chunksx = chunksx
+  };
+
+  pool_run(pool, chunksx * bands, shadeindexspans, &job);
+}
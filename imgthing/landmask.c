@@ -0,0 +1,276 @@
+#include "common.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LANDMASK_X86
+#endif
+
+// One bit per pixel masks over a heightmap. landmask_build classifies every
+// height against sea level once, 64 pixels per word, and landmask_coast turns
+// that into the coastline with word wide shifts and ands/ors over three rows
+// instead of looking at nine heights per pixel. Bit x % 64 of word x / 64 of
+// a row is pixel x, bits past the width are 0.
+
+#define LANDMASK_BAND_ROWS 64
+
+typedef struct {
+  uint32 w;
+  uint32 h;
+  // uint64 words per row
+  uint32 words;
+  uint64* bits;
+} landmask_t;
+
+typedef landmask_t* landmask;
+
+landmask landmask_alloc(uint32 w, uint32 h) {
+  landmask mask = (landmask) malloc(sizeof(landmask_t));
+  uint32 words = (w + 63) / 64;
+  uint64* bits = (uint64*) calloc((uint64) words * h, sizeof(uint64));
+
+  if (!mask || !bits) {
+    free(mask);
+    free(bits);
+    return NULL;
+  }
+
+  mask->w = w;
+  mask->h = h;
+  mask->words = words;
+  mask->bits = bits;
+
+  return mask;
+}
+
+void landmask_free(landmask mask) {
+  if (!mask) {
+    return;
+  }
+
+  free(mask->bits);
+  free(mask);
+}
+
+static inline uint64* landmask_row(landmask mask, uint32 y) {
+  return mask->bits + (uint64) y * mask->words;
+}
+
+uint8 landmask_get(landmask mask, int32 x, int32 y) {
+  if (!mask || x < 0 || y < 0 || x >= mask->w || y >= mask->h) {
+    return 0;
+  }
+
+  return (landmask_row(mask, y)[x / 64] >> (x % 64)) & 1;
+}
+
+// First set pixel of row y in x..end-1, or end if there is none
+int32 landmask_next(landmask mask, int32 x, int32 y, int32 end) {
+  const uint64* row = landmask_row(mask, y);
+
+  if (end > mask->w) {
+    end = mask->w;
+  }
+
+  while (x < end) {
+    uint64 word = row[x / 64] >> (x % 64);
+
+    if (word) {
+      x += __builtin_ctzll(word);
+      return x < end ? x : end;
+    }
+
+    x = (x / 64 + 1) * 64;
+  }
+
+  return end;
+}
+
+// Sets bit i of out for every height that is not below sealevel, count bits
+typedef void (*landmask_kernel)(uint64* out, const float* heights, uint32 count, double sealevel);
+
+static void landmask_row_scalar(uint64* out, const float* heights, uint32 count, double sealevel) {
+  memset(out, 0, ((count + 63) / 64) * sizeof(uint64));
+
+  for (uint32 i = 0; i < count; i++) {
+    if (!(heights[i] < sealevel)) {
+      out[i / 64] |= 1ull << (i % 64);
+    }
+  }
+}
+
+#ifdef LANDMASK_X86
+
+__attribute__((target("sse2")))
+static void landmask_row_sse2(uint64* out, const float* heights, uint32 count, double sealevel) {
+  __m128 threshold = _mm_set1_ps(heightcolor_threshold(sealevel));
+  uint32 i = 0;
+
+  for (; i + 64 <= count; i += 64) {
+    uint64 word = 0;
+
+    for (uint32 l = 0; l < 64; l += 4) {
+      __m128 sea = _mm_cmplt_ps(_mm_loadu_ps(heights + i + l), threshold);
+      word |= (uint64) (~_mm_movemask_ps(sea) & 0xF) << l;
+    }
+
+    out[i / 64] = word;
+  }
+
+  if (i < count) {
+    landmask_row_scalar(out + i / 64, heights + i, count - i, sealevel);
+  }
+}
+
+__attribute__((target("avx2")))
+static void landmask_row_avx2(uint64* out, const float* heights, uint32 count, double sealevel) {
+  __m256 threshold = _mm256_set1_ps(heightcolor_threshold(sealevel));
+  uint32 i = 0;
+
+  for (; i + 64 <= count; i += 64) {
+    uint64 word = 0;
+
+    for (uint32 l = 0; l < 64; l += 8) {
+      __m256 sea = _mm256_cmp_ps(_mm256_loadu_ps(heights + i + l), threshold, _CMP_LT_OQ);
+      word |= (uint64) (~_mm256_movemask_ps(sea) & 0xFF) << l;
+    }
+
+    out[i / 64] = word;
+  }
+
+  if (i < count) {
+    landmask_row_scalar(out + i / 64, heights + i, count - i, sealevel);
+  }
+}
+
+#endif // LANDMASK_X86
+
+static landmask_kernel landmask_select() {
+#ifdef LANDMASK_X86
+  uint32 features = cpu_features();
+
+  if (features & CPU_AVX2) {
+    return landmask_row_avx2;
+  }
+  if (features & CPU_SSE2) {
+    return landmask_row_sse2;
+  }
+#endif
+
+  return landmask_row_scalar;
+}
+
+typedef struct {
+  landmask mask;
+  landmask src;
+  heightmap hmap;
+  double sealevel;
+  landmask_kernel kernel;
+} landmask_job;
+
+static void landmask_build_band(void* ctx, uint32 task, uint32 worker) {
+  landmask_job* job = (landmask_job*) ctx;
+  landmask mask = job->mask;
+
+  uint32 y0 = task * LANDMASK_BAND_ROWS;
+  uint32 y1 = y0 + LANDMASK_BAND_ROWS < mask->h ? y0 + LANDMASK_BAND_ROWS : mask->h;
+
+  for (uint32 y = y0; y < y1; y++) {
+    const float* heights = job->hmap->heightData + (uint64) y * job->hmap->width;
+    job->kernel(landmask_row(mask, y), heights, mask->w, job->sealevel);
+  }
+}
+
+// Sets every pixel of mask whose height in hmap is not below sealevel, the
+// same test as hmap_getsample(...) < sealevel failing. hmap must cover mask.
+uint8 landmask_build(threadpool pool, landmask mask, heightmap hmap, double sealevel) {
+  if (!mask || !hmap || hmap->width < mask->w || hmap->height < mask->h) {
+    return 0;
+  }
+
+  landmask_job job = {
+    .mask = mask,
+    .hmap = hmap,
+    .sealevel = sealevel,
+    .kernel = landmask_select()
+  };
+
+  pool_run(pool, (mask->h + LANDMASK_BAND_ROWS - 1) / LANDMASK_BAND_ROWS, landmask_build_band, &job);
+
+  return 1;
+}
+
+// Word i of a row with its horizontal neighbours folded in. Pixels past the
+// edges read as edge, 0 for the or and all ones for the and.
+static inline uint64 landmask_hor_or(const uint64* row, uint32 i, uint32 words) {
+  uint64 left = i > 0 ? row[i - 1] >> 63 : 0;
+  uint64 right = i + 1 < words ? row[i + 1] << 63 : 0;
+
+  return row[i] | (row[i] << 1) | left | (row[i] >> 1) | right;
+}
+
+static inline uint64 landmask_hor_and(const uint64* row, uint32 i, uint32 words, uint64 tail) {
+  uint64 cur = i + 1 < words ? row[i] : row[i] | tail;
+  uint64 left = i > 0 ? row[i - 1] >> 63 : 1;
+  uint64 right = i + 1 < words ? row[i + 1] << 63 : 1ull << 63;
+
+  return cur & ((cur << 1) | left) & ((cur >> 1) | right);
+}
+
+static void landmask_coast_band(void* ctx, uint32 task, uint32 worker) {
+  landmask_job* job = (landmask_job*) ctx;
+  landmask src = job->src;
+  landmask dst = job->mask;
+
+  uint32 words = src->words;
+  uint32 used = src->w % 64;
+  uint64 valid = used ? (1ull << used) - 1 : ~0ull;
+
+  uint32 y0 = task * LANDMASK_BAND_ROWS;
+  uint32 y1 = y0 + LANDMASK_BAND_ROWS < src->h ? y0 + LANDMASK_BAND_ROWS : src->h;
+
+  for (uint32 y = y0; y < y1; y++) {
+    const uint64* above = y > 0 ? landmask_row(src, y - 1) : NULL;
+    const uint64* row = landmask_row(src, y);
+    const uint64* below = y + 1 < src->h ? landmask_row(src, y + 1) : NULL;
+    uint64* out = landmask_row(dst, y);
+
+    for (uint32 i = 0; i < words; i++) {
+      uint64 any = landmask_hor_or(row, i, words);
+      uint64 all = landmask_hor_and(row, i, words, ~valid);
+
+      if (above) {
+        any |= landmask_hor_or(above, i, words);
+        all &= landmask_hor_and(above, i, words, ~valid);
+      }
+      if (below) {
+        any |= landmask_hor_or(below, i, words);
+        all &= landmask_hor_and(below, i, words, ~valid);
+      }
+
+      // A pixel is on the coast when its 3x3 neighbourhood has both land
+      // and sea in it
+      out[i] = any ^ all;
+    }
+
+    out[words - 1] &= valid;
+  }
+}
+
+// Sets every pixel of coast that has both land and sea among itself and its
+// eight neighbours in land. coast must be the same size as land.
+uint8 landmask_coast(threadpool pool, landmask land, landmask coast) {
+  if (!land || !coast || land->w != coast->w || land->h != coast->h || land->w == 0) {
+    return 0;
+  }
+
+  landmask_job job = {
+    .mask = coast,
+    .src = land
+  };
+
+  pool_run(pool, (land->h + LANDMASK_BAND_ROWS - 1) / LANDMASK_BAND_ROWS, landmask_coast_band, &job);
+
+  return 1;
+}
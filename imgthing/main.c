@@ -6,123 +6,40 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #define STB_IMAGE_IMPLEMENTATION
 
+unsigned int checksum_crc32(unsigned char* buffer, int len);
+unsigned int checksum_adler32(unsigned int adler, const unsigned char* data, int len);
+
+#define STBIW_CRC32 checksum_crc32
+#define STBIW_ADLER32 checksum_adler32
+
 #include "stbi_image_write.h"
 #include "common.h"
+#include "cpu.c"
+#include "checksum.c"
 #include "perlin.c"
 #include "color.c"
+#include "threadpool.c"
+#include "thermal.c"
 #include "diamondsquare.c"
-
-#define WIDTH    2050
-#define HEIGHT   1025
-#define CHANNELS    3
-
-typedef struct {
-  uint32 w;
-  uint32 h;
-  uint8* buf;
-} img;
+#include "world.c"
+#include "hmapfile.c"
+#include "image.c"
+#include "raster.c"
+#include "heightcolor.c"
+#include "palettelut.c"
+#include "landmask.c"
+#include "hydrology.c"
+#include "erosion.c"
+#include "pngstream.c"
+#include "tiles.c"
+#include "report.c"
+
+// Map size, set with --width= and --height=
+static uint32 mapWidth = 2050;
+static uint32 mapHeight = 1025;
 
 #define relto(v, min, max) ((v - min) / (max - min))
 
-img allocImage(uint32 w, uint32 h) {
-  uint64 memsize = CHANNELS * w * h;
-  uint8* buf = (uint8*) malloc(memsize);
-  img i = {
-    .w = w, 
-    .h = h, 
-    .buf = buf
-  };
-
-  if (buf) {
-    memset(buf, 255, memsize);
-  }
-
-  return i;
-}
-
-void freeimg(img i) {
-  if (!i.buf) {
-    return;
-  }
-
-  free(i.buf);
-}
-
-uint8* offsetBy(img image, int32 x, int32 y) {
-  uint64 offset = 0;
-  offset += x;
-  offset += y * image.w;
-  offset *= CHANNELS;
-  return image.buf + offset;
-}
-
-void setcolor(img image, int32 x, int32 y, color24 color) {
-  uint8* ptr = offsetBy(image, x, y);
-  ptr[0] = color.r;
-  ptr[1] = color.g;
-  ptr[2] = color.b;
-}
-
-color24 getcolor(img image, int32 x, int32 y) {
-  uint8* ptr = offsetBy(image, x, y);
-  color24 res = {
-    .r = ptr[0],
-    .g = ptr[1],
-    .b = ptr[2]
-  };
-
-  return res;
-}
-
-void drawline(img image, color24 c, int32 xfrom, int32 yfrom, int32 xto, int32 yto) {
-  float xdif = xto - xfrom;
-  float ydif = yto - yfrom;
-  float dist = sqrt((xdif * xdif) + (ydif * ydif));
-
-  float xstep = xdif / dist;
-  float ystep = ydif / dist;
-
-  float x = xfrom;
-  float y = yfrom;
-
-  for (int32 i = 0; i < dist; i++) {
-    int32 px = floorf(x);
-    int32 py = floorf(y);
-
-    setcolor(image, px, py, c);
-
-    x += xstep;
-    y += ystep;
-  }
-}
-
-typedef void (*shader)(img image, int32 x, int32 y, color24* out);
-
-void applyshader(img image, shader shaderFunc) {
-  uint32 imgsize = image.w * image.h;
-  uint32 pixelsDone = 0;
-
-  color24 c = {
-    .r = 0,
-    .g = 0,
-    .b = 0
-  };
-
-  uint8* ptr = image.buf;
-
-  for (int32 y = 0; y < image.h; y++) {
-    for (int32 x = 0; x < image.w; x++) {
-      shaderFunc(image, x, y, &c);
-
-      ptr[0] = c.r;
-      ptr[1] = c.g;
-      ptr[2] = c.b;
-
-      ptr += CHANNELS;
-    }
-  }
-}
-
 float f(float x) {
   return (x + 1.0f) / 2.0f;
 }
@@ -135,6 +52,19 @@ float f(float x) {
 static color_array terrainColors = NULL;
 static color_array seaColors = NULL;
 
+// Palette for indexed output: black for outlines, then the terrain colors,
+// then the sea colors, then rivers
+#define INDEX_OUTLINE 0
+#define INDEX_LAND 1
+
+static color_array indexPalette = NULL;
+static uint8 indexSea = 0;
+static uint8 indexRiver = 0;
+
+#define RIVER_COLOR color(0x3c, 0x96, 0xaa)
+// Land cells that at least this many cells drain through are drawn as rivers
+#define RIVER_CELLS 2000
+
 static heightmap terrainHeightMap = NULL;
 
 void colorheightmap(img image, int32 x, int32 y, color24* out) {
@@ -159,11 +89,36 @@ void colorheightmap(img image, int32 x, int32 y, color24* out) {
   pickcolor(out, terrainColors, noise);
 }
 
+// Height to color tables for the span shaders, built with the palettes
+#define TERRAIN_LUT_BITS 12
+
+static palette_lut terrainLut = NULL;
+static lutcolor_kernel lutcolorKernel = lutcolor_scalar;
+static lutindex_kernel lutindexKernel = lutindex_scalar;
+
+// Span version of colorheightmap, uses the SIMD kernel picked at startup
+void colorheightmapSpan(img image, int32 x, int32 y, int32 count, const float* heights, uint8* out) {
+  lutcolorKernel(terrainLut, out, heights, count);
+}
+
+// colorheightmapSpan for index images
+void indexheightmapSpan(indeximg image, int32 x, int32 y, int32 count, const float* heights, uint8* out) {
+  lutindexKernel(terrainLut, out, heights, count);
+}
+
 void shaderTest(img image, int32 x, int32 y, color24* out) {
   setc(out, 255);
 }
 
-void outlineLand(img image, int32 x, int32 y, color24* out) {
+// Land and coastline masks of terrainHeightMap, see buildmasks
+static landmask landMask = NULL;
+static landmask coastMask = NULL;
+
+static uint8 iscoast(img image, int32 x, int32 y) {
+  if (coastMask) {
+    return landmask_get(coastMask, x, y);
+  }
+
   float sample = hmap_getsample(terrainHeightMap, x, y);
   uint8 issea = sample < SEALEVEL;
 
@@ -186,11 +141,19 @@ void outlineLand(img image, int32 x, int32 y, color24* out) {
         continue;
       }
 
-      setc(out, 0);
-      return;
+      return 1;
     }
   }
 
+  return 0;
+}
+
+void outlineLand(img image, int32 x, int32 y, color24* out) {
+  if (iscoast(image, x, y)) {
+    setc(out, 0);
+    return;
+  }
+
   color24 c = getcolor(image, x, y);
   // printf("Pre existing color: %x %x %x\n", c.r, c.g, c.b);
 
@@ -199,6 +162,43 @@ void outlineLand(img image, int32 x, int32 y, color24* out) {
   out->b = c.b;
 }
 
+void outlineLandSpan(img image, int32 x, int32 y, int32 count, const float* heights, uint8* out) {
+  if (!coastMask) {
+    for (int32 i = 0; i < count; i++) {
+      if (iscoast(image, x + i, y)) {
+        memset(out + i * CHANNELS, 0, CHANNELS);
+      }
+    }
+    return;
+  }
+
+  int32 end = x + count;
+  for (int32 px = landmask_next(coastMask, x, y, end); px < end; px = landmask_next(coastMask, px + 1, y, end)) {
+    memset(out + (px - x) * CHANNELS, 0, CHANNELS);
+  }
+}
+
+void outlineLandIndexSpan(indeximg image, int32 x, int32 y, int32 count, const float* heights, uint8* out) {
+  if (!coastMask) {
+    img bounds = {
+      .w = image.w,
+      .h = image.h,
+      .buf = NULL
+    };
+
+    for (int32 i = 0; i < count; i++) {
+      if (iscoast(bounds, x + i, y)) {
+        out[i] = INDEX_OUTLINE;
+      }
+    }
+    return;
+  }
+
+  int32 end = x + count;
+  for (int32 px = landmask_next(coastMask, x, y, end); px < end; px = landmask_next(coastMask, px + 1, y, end)) {
+    out[px - x] = INDEX_OUTLINE;
+  }
+}
 
 uint8 createpalettes() {
   terrainColors = colors_malloc(7);
@@ -223,120 +223,266 @@ uint8 createpalettes() {
   color_array_set(seaColors, 4, color(0x41, 0xa5, 0xb4));
   color_array_set(seaColors, 5, color(0x3c, 0x96, 0xaa));
 
+  indexSea = INDEX_LAND + terrainColors->length;
+  indexRiver = indexSea + seaColors->length;
+  indexPalette = colors_malloc(indexRiver + 1);
+
+  if (!indexPalette) {
+    return 0;
+  }
+
+  color_array_set(indexPalette, INDEX_OUTLINE, BLACK);
+
+  for (uint32 i = 0; i < terrainColors->length; i++) {
+    color_array_set(indexPalette, INDEX_LAND + i, color_array_get(terrainColors, i));
+  }
+  for (uint32 i = 0; i < seaColors->length; i++) {
+    color_array_set(indexPalette, indexSea + i, color_array_get(seaColors, i));
+  }
+  color_array_set(indexPalette, indexRiver, RIVER_COLOR);
+
+  terrainLut = palette_lut_alloc(terrainColors, seaColors, SEALEVEL, TERRAIN_LUT_BITS, LUT_STEPPED, INDEX_LAND, indexSea);
+  if (!terrainLut) {
+    return 0;
+  }
+
+  lutcolorKernel = lutcolor_select();
+  lutindexKernel = lutindex_select();
+
   return 1;
 }
 
-uint8 generateheightmap() {
-  heightmap hmap = hmap_alloc(WIDTH, HEIGHT);
+// Weathers slopes steeper than the talus on the raw heights
+static thermal_params terrainThermal;
+
+uint8 generateheightmap(threadpool pool, uint64 seed) {
+  heightmap hmap = hmap_alloc(mapWidth, mapHeight);
   if (!hmap) {
     return 0;
   }
 
   terrainHeightMap = hmap;
 
-  srand(time(NULL));
-  hmap_generate(hmap);
+  thermal_default_params(&terrainThermal);
+
+  hmap->seed = seed;
+  hmap->thermal = &terrainThermal;
+  hmap_generate_parallel(pool, hmap);
 
   return 1;
 }
 
-int32 randomInt(int32 max) {
-  uint32 r = rand();
-  return r % max;
+// Droplets per sample, enough to carve valleys without flattening the map
+#define EROSION_DROPLETS_PER_CELL 0.5
+
+// Sets droplets to how many were run
+uint8 erodeheightmap(threadpool pool, uint64 seed, uint64* droplets) {
+  erosion_params params;
+  *droplets = (uint64) (terrainHeightMap->width * (uint64) terrainHeightMap->height * EROSION_DROPLETS_PER_CELL);
+
+  erosion_default_params(&params, seed, *droplets);
+  params.sealevel = SEALEVEL;
+
+  return erosion_run(pool, terrainHeightMap, &params);
 }
 
-void paintRiverTile(img image, int32 centerx, int32 centery, float size) {
-  int32 isize = (int32) size;
-  int32 h = isize / 2;
+// Classifies terrainHeightMap into land and sea once, for the coastline and
+// anything else that needs to know which pixels are land
+uint8 buildmasks(threadpool pool) {
+  landmask_free(landMask);
+  landmask_free(coastMask);
 
-  color24 c = color(0, 0, 255);
+  landMask = landmask_alloc(terrainHeightMap->width, terrainHeightMap->height);
+  coastMask = landmask_alloc(terrainHeightMap->width, terrainHeightMap->height);
 
-  for (int32 rx = -h; rx <= h; rx++) {
-    for (int32 ry = -h; ry <= h; ry++) {
-      setcolor(image, rx + centerx, ry + centery, c);
-    }
+  if (!landMask || !coastMask) {
+    landmask_free(landMask);
+    landmask_free(coastMask);
+    landMask = coastMask = NULL;
+    return 0;
   }
+
+  return landmask_build(pool, landMask, terrainHeightMap, SEALEVEL) && landmask_coast(pool, landMask, coastMask);
 }
 
-void placeRivers(img image) {
-  uint32 rivers = 10;
-  uint32 attempts = 0;
+static hydrology terrainHydrology = NULL;
+static landmask riverMask = NULL;
 
-  while (rivers > 0 && attempts < 500) {
-    attempts++;
+// Works out where water flows over terrainHeightMap and marks the rivers
+uint8 buildrivers(threadpool pool) {
+  hydro_free(terrainHydrology);
+  landmask_free(riverMask);
 
-    int32 rx = randomInt(image.w);
-    int32 ry = randomInt(image.h);
+  terrainHydrology = hydro_alloc(terrainHeightMap->width, terrainHeightMap->height);
+  riverMask = landmask_alloc(terrainHeightMap->width, terrainHeightMap->height);
 
-    float sample = hmap_getsample(terrainHeightMap, rx, ry);
+  if (!terrainHydrology || !riverMask) {
+    return 0;
+  }
 
-    if (sample < SEALEVEL) {
-      continue;
-    }
+  if (!hydro_run(pool, terrainHydrology, terrainHeightMap, SEALEVEL)) {
+    return 0;
+  }
 
-    rivers--;
-
-    float riverGrowth = 0.1f;
-    float riverWidth = 2.0f;
-
-    while (1) {
-      paintRiverTile(image, rx, ry, riverWidth);
-      uint8 foundmove = 0;
-      int32 searchRange = (int32) riverWidth;
-
-      for (int32 dx = -searchRange; dx <= searchRange; dx++) {
-        for (int32 dy = -searchRange; dy <= searchRange; dy++) {
-          float dsample = hmap_getsample(terrainHeightMap, rx + dx, ry + dy);
-
-          if (dsample < SEALEVEL) {
-            goto afterloop;
-          }
-
-          if (dsample < sample) {
-            sample = dsample;
-            rx = rx + dx;
-            ry = ry + dy;
-            foundmove = 1;
-            riverWidth += riverGrowth;
-            goto afterloop;
-          }
-        }
-      }
+  return hydro_rivers(pool, terrainHydrology, RIVER_CELLS, riverMask);
+}
 
-afterloop:
-      if (!foundmove) {
-        break;
-      }
-    }
+void riverSpan(img image, int32 x, int32 y, int32 count, const float* heights, uint8* out) {
+  color24 c = RIVER_COLOR;
+  int32 end = x + count;
+
+  for (int32 px = landmask_next(riverMask, x, y, end); px < end; px = landmask_next(riverMask, px + 1, y, end)) {
+    uint8* o = out + (px - x) * CHANNELS;
+    o[0] = c.r;
+    o[1] = c.g;
+    o[2] = c.b;
   }
 }
 
-int32 main() {
-  img image = allocImage(WIDTH, HEIGHT);
+void riverIndexSpan(indeximg image, int32 x, int32 y, int32 count, const float* heights, uint8* out) {
+  int32 end = x + count;
 
+  for (int32 px = landmask_next(riverMask, x, y, end); px < end; px = landmask_next(riverMask, px + 1, y, end)) {
+    out[px - x] = indexRiver;
+  }
+}
+
+// bench.c includes this file for the pipeline and brings its own main
+#ifndef IMGTHING_NO_MAIN
+
+// Usage: imgthing [seed] [tile dir] [--json=report.json] [--width=N] [--height=N]
+int32 main(int32 argc, char** argv) {
+  const char* args[2] = { NULL, NULL };
+  const char* jsonPath = NULL;
+  uint32 nargs = 0;
+
+  for (int32 i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--json=", 7) == 0) {
+      jsonPath = argv[i] + 7;
+    } else if (strncmp(argv[i], "--width=", 8) == 0) {
+      mapWidth = strtoul(argv[i] + 8, NULL, 10);
+    } else if (strncmp(argv[i], "--height=", 9) == 0) {
+      mapHeight = strtoul(argv[i] + 9, NULL, 10);
+    } else if (nargs < 2) {
+      args[nargs++] = argv[i];
+    }
+  }
+
+  if (mapWidth == 0 || mapHeight == 0) {
+    printf("Map size must be at least 1x1\n");
+    return EXIT_FAILURE;
+  }
+
+  report timings = report_alloc();
+  uint64 pixels = (uint64) mapWidth * mapHeight;
+
+  indeximg image = allocIndexImage(mapWidth, mapHeight);
+  threadpool pool = pool_alloc(0);
+
+  uint64 seed = time(NULL);
+  if (args[0]) {
+    seed = strtoull(args[0], NULL, 10);
+  }
+
+  uint32 stage = report_begin(timings, "createpalettes");
   if (!createpalettes()) {
     printf("Failed to allocate palettes.\n");
     return EXIT_FAILURE;
   }
+  report_end(timings, stage, 0, 0);
   printf("Generated palettes...");
 
-  if (!generateheightmap()) {
+  stage = report_begin(timings, "generateheightmap");
+  if (!generateheightmap(pool, seed)) {
     printf("Failed to generate height map\n");
     return EXIT_FAILURE;
   }
-  printf("Generated heightmap...\n");
+  report_end(timings, stage, pixels, pixels * sizeof(float));
+  printf("Generated heightmap... seed=%llu\n", seed);
+
+  stage = report_begin(timings, "erode");
+  uint64 droplets = 0;
+  if (!erodeheightmap(pool, seed, &droplets)) {
+    printf("Failed to erode height map\n");
+    return EXIT_FAILURE;
+  }
+  report_end(timings, stage, pixels, pixels * sizeof(float));
+  report_items(timings, stage, "droplets", droplets);
+
+  stage = report_begin(timings, "buildmasks");
+  if (!buildmasks(pool)) {
+    printf("Failed to build land masks\n");
+    return EXIT_FAILURE;
+  }
+  report_end(timings, stage, pixels, pixels * sizeof(float));
+
+  stage = report_begin(timings, "buildrivers");
+  if (!buildrivers(pool)) {
+    printf("Failed to build rivers\n");
+    return EXIT_FAILURE;
+  }
+  report_end(timings, stage, pixels, pixels * sizeof(float));
 
   // applyshader(image, shaderTest);
-  applyshader(image, colorheightmap);
 
-  // placeRivers(image);
+  // The map only uses the palette colors, so shade straight to indices and
+  // write an indexed PNG
 
-  applyshader(image, outlineLand);
+  stage = report_begin(timings, "shade");
+  indexspanshader stages[] = { indexheightmapSpan, riverIndexSpan, outlineLandIndexSpan };
+  applyindexpipeline(pool, image, terrainHeightMap, stages, 3);
+  report_end(timings, stage, pixels, pixels);
 
   printf("Applied shader...\n");
 
-  int32 result = stbi_write_png("testfile.png", WIDTH, HEIGHT, CHANNELS, image.buf, WIDTH * CHANNELS);
+  stage = report_begin(timings, "writepng");
+  int32 result = png_stream_file_indexed(pool, "testfile.png", mapWidth, mapHeight, indexPalette->data, indexPalette->length, image.buf, mapWidth);
+
+  struct stat written;
+  report_end(timings, stage, pixels, stat("testfile.png", &written) == 0 ? (uint64) written.st_size : 0);
   printf("Wrote image! result=%i\n", result);
 
+  if (!result) {
+    printf("Failed to write testfile.png\n");
+    return EXIT_FAILURE;
+  }
+
+  // A second argument exports a tile pyramid of the truecolor render there
+  if (args[1]) {
+    img rgb = allocImage(mapWidth, mapHeight);
+
+    stage = report_begin(timings, "shadergb");
+    spanshader rgbStages[] = { colorheightmapSpan, riverSpan, outlineLandSpan };
+    applyspanpipeline(pool, rgb, terrainHeightMap, rgbStages, 3);
+    report_end(timings, stage, pixels, pixels * CHANNELS);
+
+    stage = report_begin(timings, "tiles");
+    tile_stats stats;
+    color24 ocean = color_array_get(seaColors, seaColors->length - 1);
+    int32 exported = tiles_export(pool, rgb, args[1], ocean, &stats);
+    report_end(timings, stage, stats.tiles * TILE_SIZE * TILE_SIZE, stats.bytes);
+
+    printf("Exported tiles! result=%i levels=%u tiles=%llu shared=%llu bytes=%llu\n",
+      exported, stats.levels, stats.tiles, stats.shared, stats.bytes);
+
+    freeimg(rgb);
+
+    if (!exported) {
+      printf("Failed to export tiles to %s\n", args[1]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  pool_free(pool);
+
+  report_text(timings, stdout);
+  if (jsonPath && !report_json_file(timings, jsonPath)) {
+    printf("Failed to write report to %s\n", jsonPath);
+  }
+
+  report_free(timings);
+
   return 0;
 }
+
+#endif
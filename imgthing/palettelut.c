@@ -0,0 +1,411 @@
+#include "common.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define PALETTELUT_X86
+#endif
+
+// Height to color lookup table. Heights 0..1 are quantized to 2^bits steps
+// and every step's color and palette index is worked out once, with the same
+// rules as colorheightmap, so shading a pixel is a multiply, a round and a
+// table load. Heights are rounded to the nearest step, so a pixel within half
+// a step of a color boundary can land on the neighbouring color.
+//
+// The split between land and sea is exact though: every height is compared
+// against sealevel first and its step clamped to that side of the table, so
+// the colors always agree with land masks built with the same < sealevel
+// test. Only the pick within the land or sea colors is quantized.
+
+#define LUT_STEPPED 0
+#define LUT_SMOOTH 1
+
+#define LUT_MIN_BITS 8
+#define LUT_MAX_BITS 16
+
+typedef struct {
+  uint32 bits;
+  uint8 mode;
+  // Largest step, heights are scaled by this before rounding
+  uint32 top;
+  // Smallest float that is not below sealevel, so float < threshold is the
+  // same test as float < sealevel in double
+  float threshold;
+  // Last sea step and first land step, sea heights are clamped to at most
+  // seaLast and land heights to at least landFirst
+  uint32 seaLast;
+  uint32 landFirst;
+  // Per step, colors packed as 0x00bbggrr and palette indices. indices has 3
+  // bytes of padding so it can be read with 32 bit gathers.
+  uint32* colors;
+  uint8* indices;
+} palette_lut_t;
+
+typedef palette_lut_t* palette_lut;
+
+// Builds a table for land and sea colors split at sealevel, like
+// colorheightmap. LUT_STEPPED picks colors like pickcolor, LUT_SMOOTH blends
+// them like lerpcolor. Indices are always the stepped pick, landBase plus the
+// land color's index or seaBase plus the sea color's. bits is clamped to
+// LUT_MIN_BITS..LUT_MAX_BITS.
+palette_lut palette_lut_alloc(color_array land, color_array sea, double sealevel, uint32 bits, uint8 mode, uint8 landBase, uint8 seaBase) {
+  if (!land || !sea || land->length == 0 || sea->length == 0) {
+    return NULL;
+  }
+
+  bits = bits < LUT_MIN_BITS ? LUT_MIN_BITS : bits > LUT_MAX_BITS ? LUT_MAX_BITS : bits;
+
+  uint32 steps = (1u << bits) + 1;
+  palette_lut lut = (palette_lut) malloc(sizeof(palette_lut_t));
+  uint32* colors = (uint32*) malloc(steps * sizeof(uint32));
+  uint8* indices = (uint8*) calloc(steps + 3, sizeof(uint8));
+
+  if (!lut || !colors || !indices) {
+    free(lut);
+    free(colors);
+    free(indices);
+    return NULL;
+  }
+
+  float threshold = (float) sealevel;
+  if ((double) threshold < sealevel) {
+    threshold = nextafterf(threshold, INFINITY);
+  }
+
+  lut->bits = bits;
+  lut->mode = mode;
+  lut->top = steps - 1;
+  lut->threshold = threshold;
+  lut->seaLast = 0;
+  lut->landFirst = lut->top;
+  lut->colors = colors;
+  lut->indices = indices;
+
+  for (uint32 q = 0; q < steps; q++) {
+    float noise = (float) q / lut->top;
+    color_array arr = land;
+    float delta = noise;
+    uint8 base = landBase;
+
+    if (noise < sealevel) {
+      arr = sea;
+      delta = 1.0f - noise / sealevel;
+      base = seaBase;
+      lut->seaLast = q;
+    } else if (q < lut->landFirst) {
+      lut->landFirst = q;
+    }
+
+    color24 c = BLACK;
+    uint32 pick = 0;
+
+    pickindex(&pick, arr, delta);
+
+    if (mode == LUT_SMOOTH) {
+      lerpcolor(&c, arr, delta);
+    } else {
+      pickcolor(&c, arr, delta);
+    }
+
+    colors[q] = c.r | (c.g << 8) | (c.b << 16);
+    indices[q] = base + pick;
+  }
+
+  return lut;
+}
+
+void palette_lut_free(palette_lut lut) {
+  if (!lut) {
+    return;
+  }
+
+  free(lut->colors);
+  free(lut->indices);
+  free(lut);
+}
+
+// Writes count RGB pixels for count heights. Heights outside 0..1 repeat the
+// previous pixel of the span, or are black at the start of it.
+typedef void (*lutcolor_kernel)(palette_lut lut, uint8* out, const float* heights, int32 count);
+
+// Same as lutcolor_kernel but writes palette indices, with index 0 at the
+// start of the span for heights outside 0..1
+typedef void (*lutindex_kernel)(palette_lut lut, uint8* out, const float* heights, int32 count);
+
+static inline uint8 palette_lut_step(palette_lut lut, float noise, uint32* q) {
+  if (noise < 0 || noise > 1.0f || noise != noise) {
+    return 0;
+  }
+
+  *q = (uint32) (noise * (float) lut->top + 0.5f);
+
+  if (noise < lut->threshold) {
+    *q = *q < lut->seaLast ? *q : lut->seaLast;
+  } else {
+    *q = *q > lut->landFirst ? *q : lut->landFirst;
+  }
+
+  return 1;
+}
+
+static void lutcolor_pixel(palette_lut lut, uint8* out, const float* heights, int32 i) {
+  uint8* px = out + i * CHANNELS;
+  uint32 q;
+
+  if (palette_lut_step(lut, heights[i], &q)) {
+    uint32 c = lut->colors[q];
+    px[0] = c;
+    px[1] = c >> 8;
+    px[2] = c >> 16;
+  } else if (i > 0) {
+    memmove(px, px - CHANNELS, CHANNELS);
+  } else {
+    memset(px, 0, CHANNELS);
+  }
+}
+
+static void lutindex_pixel(palette_lut lut, uint8* out, const float* heights, int32 i) {
+  uint32 q;
+
+  if (palette_lut_step(lut, heights[i], &q)) {
+    out[i] = lut->indices[q];
+  } else {
+    out[i] = i > 0 ? out[i - 1] : 0;
+  }
+}
+
+void lutcolor_scalar(palette_lut lut, uint8* out, const float* heights, int32 count) {
+  for (int32 i = 0; i < count; i++) {
+    lutcolor_pixel(lut, out, heights, i);
+  }
+}
+
+void lutindex_scalar(palette_lut lut, uint8* out, const float* heights, int32 count) {
+  for (int32 i = 0; i < count; i++) {
+    lutindex_pixel(lut, out, heights, i);
+  }
+}
+
+#ifdef PALETTELUT_X86
+
+// Scaled heights, clamped to the sea or land side of the table like
+// palette_lut_step, ready to be truncated to steps
+__attribute__((target("sse2")))
+static inline __m128 palette_lut_steps_sse2(__m128 h, __m128 top, __m128 half, __m128 threshold, __m128 seaLast, __m128 landFirst) {
+  __m128 scaled = _mm_add_ps(_mm_mul_ps(h, top), half);
+  __m128 issea = _mm_cmplt_ps(h, threshold);
+
+  return _mm_or_ps(_mm_and_ps(issea, _mm_min_ps(scaled, seaLast)), _mm_andnot_ps(issea, _mm_max_ps(scaled, landFirst)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256 palette_lut_steps_avx2(__m256 h, __m256 top, __m256 half, __m256 threshold, __m256 seaLast, __m256 landFirst) {
+  __m256 scaled = _mm256_add_ps(_mm256_mul_ps(h, top), half);
+  __m256 issea = _mm256_cmp_ps(h, threshold, _CMP_LT_OQ);
+
+  return _mm256_blendv_ps(_mm256_max_ps(scaled, landFirst), _mm256_min_ps(scaled, seaLast), issea);
+}
+
+__attribute__((target("sse2")))
+static void lutcolor_sse2(palette_lut lut, uint8* out, const float* heights, int32 count) {
+  __m128 zero = _mm_setzero_ps();
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128 top = _mm_set1_ps((float) lut->top);
+  __m128 half = _mm_set1_ps(0.5f);
+  __m128 threshold = _mm_set1_ps(lut->threshold);
+  __m128 seaLast = _mm_set1_ps((float) lut->seaLast);
+  __m128 landFirst = _mm_set1_ps((float) lut->landFirst);
+  const uint32* colors = lut->colors;
+
+  int32 i = 0;
+  int32 q[4];
+
+  for (; i + 4 <= count; i += 4) {
+    __m128 h = _mm_loadu_ps(heights + i);
+    __m128 valid = _mm_and_ps(_mm_cmpge_ps(h, zero), _mm_cmple_ps(h, one));
+
+    if (_mm_movemask_ps(valid) != 0xF) {
+      for (int32 l = 0; l < 4; l++) {
+        lutcolor_pixel(lut, out, heights, i + l);
+      }
+      continue;
+    }
+
+    _mm_storeu_si128((__m128i*) q, _mm_cvttps_epi32(palette_lut_steps_sse2(h, top, half, threshold, seaLast, landFirst)));
+
+    // Each 4 byte store spills one byte into the next pixel, which the next
+    // store overwrites; the last pixel is written bytewise
+    uint8* px = out + i * CHANNELS;
+    memcpy(px, &colors[q[0]], 4);
+    memcpy(px + 3, &colors[q[1]], 4);
+    memcpy(px + 6, &colors[q[2]], 4);
+
+    uint32 c = colors[q[3]];
+    px[9] = c;
+    px[10] = c >> 8;
+    px[11] = c >> 16;
+  }
+
+  for (; i < count; i++) {
+    lutcolor_pixel(lut, out, heights, i);
+  }
+}
+
+__attribute__((target("sse2")))
+static void lutindex_sse2(palette_lut lut, uint8* out, const float* heights, int32 count) {
+  __m128 zero = _mm_setzero_ps();
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128 top = _mm_set1_ps((float) lut->top);
+  __m128 half = _mm_set1_ps(0.5f);
+  __m128 threshold = _mm_set1_ps(lut->threshold);
+  __m128 seaLast = _mm_set1_ps((float) lut->seaLast);
+  __m128 landFirst = _mm_set1_ps((float) lut->landFirst);
+  const uint8* indices = lut->indices;
+
+  int32 i = 0;
+  int32 q[4];
+
+  for (; i + 4 <= count; i += 4) {
+    __m128 h = _mm_loadu_ps(heights + i);
+    __m128 valid = _mm_and_ps(_mm_cmpge_ps(h, zero), _mm_cmple_ps(h, one));
+
+    if (_mm_movemask_ps(valid) != 0xF) {
+      for (int32 l = 0; l < 4; l++) {
+        lutindex_pixel(lut, out, heights, i + l);
+      }
+      continue;
+    }
+
+    _mm_storeu_si128((__m128i*) q, _mm_cvttps_epi32(palette_lut_steps_sse2(h, top, half, threshold, seaLast, landFirst)));
+
+    out[i] = indices[q[0]];
+    out[i + 1] = indices[q[1]];
+    out[i + 2] = indices[q[2]];
+    out[i + 3] = indices[q[3]];
+  }
+
+  for (; i < count; i++) {
+    lutindex_pixel(lut, out, heights, i);
+  }
+}
+
+__attribute__((target("avx2")))
+static void lutcolor_avx2(palette_lut lut, uint8* out, const float* heights, int32 count) {
+  __m256 zero = _mm256_setzero_ps();
+  __m256 one = _mm256_set1_ps(1.0f);
+  __m256 top = _mm256_set1_ps((float) lut->top);
+  __m256 half = _mm256_set1_ps(0.5f);
+  __m256 threshold = _mm256_set1_ps(lut->threshold);
+  __m256 seaLast = _mm256_set1_ps((float) lut->seaLast);
+  __m256 landFirst = _mm256_set1_ps((float) lut->landFirst);
+  const int* colors = (const int*) lut->colors;
+
+  // Drops the unused fourth byte of each packed color, 12 bytes per lane
+  __m256i pack = _mm256_setr_epi8(
+    0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+    0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+  );
+
+  int32 i = 0;
+
+  for (; i + 8 <= count; i += 8) {
+    __m256 h = _mm256_loadu_ps(heights + i);
+    __m256 valid = _mm256_and_ps(_mm256_cmp_ps(h, zero, _CMP_GE_OQ), _mm256_cmp_ps(h, one, _CMP_LE_OQ));
+
+    if (_mm256_movemask_ps(valid) != 0xFF) {
+      for (int32 l = 0; l < 8; l++) {
+        lutcolor_pixel(lut, out, heights, i + l);
+      }
+      continue;
+    }
+
+    __m256i q = _mm256_cvttps_epi32(palette_lut_steps_avx2(h, top, half, threshold, seaLast, landFirst));
+    __m256i packed = _mm256_shuffle_epi8(_mm256_i32gather_epi32(colors, q, 4), pack);
+    __m128i first = _mm256_castsi256_si128(packed);
+    __m128i second = _mm256_extracti128_si256(packed, 1);
+
+    // The first store spills 4 junk bytes that the second one overwrites
+    uint8* px = out + i * CHANNELS;
+    _mm_storeu_si128((__m128i*) px, first);
+    _mm_storel_epi64((__m128i*) (px + 12), second);
+    uint32 last = _mm_cvtsi128_si32(_mm_srli_si128(second, 8));
+    memcpy(px + 20, &last, 4);
+  }
+
+  for (; i < count; i++) {
+    lutcolor_pixel(lut, out, heights, i);
+  }
+}
+
+__attribute__((target("avx2")))
+static void lutindex_avx2(palette_lut lut, uint8* out, const float* heights, int32 count) {
+  __m256 zero = _mm256_setzero_ps();
+  __m256 one = _mm256_set1_ps(1.0f);
+  __m256 top = _mm256_set1_ps((float) lut->top);
+  __m256 half = _mm256_set1_ps(0.5f);
+  __m256 threshold = _mm256_set1_ps(lut->threshold);
+  __m256 seaLast = _mm256_set1_ps((float) lut->seaLast);
+  __m256 landFirst = _mm256_set1_ps((float) lut->landFirst);
+  __m256i low = _mm256_set1_epi32(0xFF);
+  const int* indices = (const int*) lut->indices;
+
+  int32 i = 0;
+
+  for (; i + 8 <= count; i += 8) {
+    __m256 h = _mm256_loadu_ps(heights + i);
+    __m256 valid = _mm256_and_ps(_mm256_cmp_ps(h, zero, _CMP_GE_OQ), _mm256_cmp_ps(h, one, _CMP_LE_OQ));
+
+    if (_mm256_movemask_ps(valid) != 0xFF) {
+      for (int32 l = 0; l < 8; l++) {
+        lutindex_pixel(lut, out, heights, i + l);
+      }
+      continue;
+    }
+
+    // Byte gathers: read 4 bytes at each index and keep the first
+    __m256i q = _mm256_cvttps_epi32(palette_lut_steps_avx2(h, top, half, threshold, seaLast, landFirst));
+    __m256i idx = _mm256_and_si256(_mm256_i32gather_epi32(indices, q, 1), low);
+
+    __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(idx), _mm256_extracti128_si256(idx, 1));
+    _mm_storel_epi64((__m128i*) (out + i), _mm_packus_epi16(words, words));
+  }
+
+  for (; i < count; i++) {
+    lutindex_pixel(lut, out, heights, i);
+  }
+}
+
+#endif // PALETTELUT_X86
+
+// Picks the fastest kernel the CPU supports
+lutcolor_kernel lutcolor_select() {
+#ifdef PALETTELUT_X86
+  uint32 features = cpu_features();
+
+  if (features & CPU_AVX2) {
+    return lutcolor_avx2;
+  }
+  if (features & CPU_SSE2) {
+    return lutcolor_sse2;
+  }
+#endif
+
+  return lutcolor_scalar;
+}
+
+lutindex_kernel lutindex_select() {
+#ifdef PALETTELUT_X86
+  uint32 features = cpu_features();
+
+  if (features & CPU_AVX2) {
+    return lutindex_avx2;
+  }
+  if (features & CPU_SSE2) {
+    return lutindex_sse2;
+  }
+#endif
+
+  return lutindex_scalar;
+}
@@ -1,3 +1,4 @@
+#include "common.h"
 #include <math.h>
 
 static const int  SEED = 1985;
@@ -71,4 +72,281 @@ double perlin2d(double x, double y, double freq, int depth)
         ya *= 2;
     }
     return fin/div;
-}
\ No newline at end of file
+}
+// Batch evaluation of perlin2d. The vector paths process 4, 8 or 16 points
+// per step (two SSE2, AVX2 or AVX-512 registers of doubles) and are picked at
+// runtime. SSE2 has no gather so its table lookups stay scalar, but matches
+// perlin2d bit for bit. The AVX2/AVX-512 paths use FMA and may differ from
+// perlin2d in the last bits of the result.
+
+typedef void (*perlin_batch_kernel)(const double* x, const double* y, double freq, int depth, double* out, int count);
+
+static double perlin_div(int depth)
+{
+    double  amp = 1.0;
+    double  div = 0.0;
+    for (int i=0; i<depth; i++)
+    {
+        div += 256 * amp;
+        amp /= 2;
+    }
+    return div;
+}
+
+void perlin2d_batch_scalar(const double* x, const double* y, double freq, int depth, double* out, int count)
+{
+    for (int i=0; i<count; i++)
+        out[i] = perlin2d(x[i], y[i], freq, depth);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+// HASH widened to ints so it can be used with the gather instructions
+static int  HASH32[256];
+static int  hash32Ready = 0;
+
+static void perlin_init_hash32(void)
+{
+    if (hash32Ready)
+        return;
+    for (int i=0; i<256; i++)
+        HASH32[i] = HASH[i];
+    hash32Ready = 1;
+}
+
+__attribute__((target("sse2")))
+static inline __m128d noise2d_sse2(__m128d x, __m128d y)
+{
+    const __m128d  one = _mm_set1_pd(1.0);
+    const __m128d  three = _mm_set1_pd(3.0);
+    const __m128d  two = _mm_set1_pd(2.0);
+
+    // floor() without SSE4.1: truncate, then step down where that rounded up
+    __m128d  x_fl = _mm_cvtepi32_pd(_mm_cvttpd_epi32(x));
+    __m128d  y_fl = _mm_cvtepi32_pd(_mm_cvttpd_epi32(y));
+    x_fl = _mm_sub_pd(x_fl, _mm_and_pd(_mm_cmpgt_pd(x_fl, x), one));
+    y_fl = _mm_sub_pd(y_fl, _mm_and_pd(_mm_cmpgt_pd(y_fl, y), one));
+
+    int  xi[4], yi[4];
+    _mm_storeu_si128((__m128i*) xi, _mm_cvttpd_epi32(x_fl));
+    _mm_storeu_si128((__m128i*) yi, _mm_cvttpd_epi32(y_fl));
+
+    const __m128d  s = _mm_set_pd(noise2(xi[1], yi[1]), noise2(xi[0], yi[0]));
+    const __m128d  t = _mm_set_pd(noise2(xi[1]+1, yi[1]), noise2(xi[0]+1, yi[0]));
+    const __m128d  u = _mm_set_pd(noise2(xi[1], yi[1]+1), noise2(xi[0], yi[0]+1));
+    const __m128d  v = _mm_set_pd(noise2(xi[1]+1, yi[1]+1), noise2(xi[0]+1, yi[0]+1));
+
+    const __m128d  x_frac = _mm_sub_pd(x, x_fl);
+    const __m128d  y_frac = _mm_sub_pd(y, y_fl);
+    const __m128d  xs = _mm_mul_pd(_mm_mul_pd(x_frac, x_frac), _mm_sub_pd(three, _mm_mul_pd(two, x_frac)));
+    const __m128d  ys = _mm_mul_pd(_mm_mul_pd(y_frac, y_frac), _mm_sub_pd(three, _mm_mul_pd(two, y_frac)));
+
+    const __m128d  low = _mm_add_pd(s, _mm_mul_pd(xs, _mm_sub_pd(t, s)));
+    const __m128d  high = _mm_add_pd(u, _mm_mul_pd(xs, _mm_sub_pd(v, u)));
+    return _mm_add_pd(low, _mm_mul_pd(ys, _mm_sub_pd(high, low)));
+}
+
+__attribute__((target("sse2")))
+static void perlin2d_batch_sse2(const double* x, const double* y, double freq, int depth, double* out, int count)
+{
+    const __m128d  f = _mm_set1_pd(freq);
+    const __m128d  div = _mm_set1_pd(perlin_div(depth));
+    int  i = 0;
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128d  xa0 = _mm_mul_pd(_mm_loadu_pd(x + i), f);
+        __m128d  ya0 = _mm_mul_pd(_mm_loadu_pd(y + i), f);
+        __m128d  xa1 = _mm_mul_pd(_mm_loadu_pd(x + i + 2), f);
+        __m128d  ya1 = _mm_mul_pd(_mm_loadu_pd(y + i + 2), f);
+        __m128d  fin0 = _mm_setzero_pd();
+        __m128d  fin1 = _mm_setzero_pd();
+        double  amp = 1.0;
+        for (int o=0; o<depth; o++)
+        {
+            const __m128d  a = _mm_set1_pd(amp);
+            fin0 = _mm_add_pd(fin0, _mm_mul_pd(noise2d_sse2(xa0, ya0), a));
+            fin1 = _mm_add_pd(fin1, _mm_mul_pd(noise2d_sse2(xa1, ya1), a));
+            amp /= 2;
+            xa0 = _mm_add_pd(xa0, xa0);
+            ya0 = _mm_add_pd(ya0, ya0);
+            xa1 = _mm_add_pd(xa1, xa1);
+            ya1 = _mm_add_pd(ya1, ya1);
+        }
+        _mm_storeu_pd(out + i, _mm_div_pd(fin0, div));
+        _mm_storeu_pd(out + i + 2, _mm_div_pd(fin1, div));
+    }
+
+    perlin2d_batch_scalar(x + i, y + i, freq, depth, out + i, count - i);
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256d noise2d_avx2(__m256d x, __m256d y)
+{
+    const __m128i  mask = _mm_set1_epi32(255);
+    const __m128i  onei = _mm_set1_epi32(1);
+    const __m256d  three = _mm256_set1_pd(3.0);
+    const __m256d  two = _mm256_set1_pd(2.0);
+
+    const __m256d  x_fl = _mm256_floor_pd(x);
+    const __m256d  y_fl = _mm256_floor_pd(y);
+    const __m128i  xi = _mm256_cvttpd_epi32(x_fl);
+    const __m128i  yi = _mm256_cvttpd_epi32(y_fl);
+
+    // noise2: HASH[(HASH[(y + SEED) & 255] + x) & 255]
+    const __m128i  hy0 = _mm_i32gather_epi32(HASH32, _mm_and_si128(_mm_add_epi32(yi, _mm_set1_epi32(SEED)), mask), 4);
+    const __m128i  hy1 = _mm_i32gather_epi32(HASH32, _mm_and_si128(_mm_add_epi32(yi, _mm_set1_epi32(SEED + 1)), mask), 4);
+    const __m128i  bx0 = _mm_add_epi32(hy0, xi);
+    const __m128i  bx1 = _mm_add_epi32(hy1, xi);
+
+    const __m256d  s = _mm256_cvtepi32_pd(_mm_i32gather_epi32(HASH32, _mm_and_si128(bx0, mask), 4));
+    const __m256d  t = _mm256_cvtepi32_pd(_mm_i32gather_epi32(HASH32, _mm_and_si128(_mm_add_epi32(bx0, onei), mask), 4));
+    const __m256d  u = _mm256_cvtepi32_pd(_mm_i32gather_epi32(HASH32, _mm_and_si128(bx1, mask), 4));
+    const __m256d  v = _mm256_cvtepi32_pd(_mm_i32gather_epi32(HASH32, _mm_and_si128(_mm_add_epi32(bx1, onei), mask), 4));
+
+    const __m256d  x_frac = _mm256_sub_pd(x, x_fl);
+    const __m256d  y_frac = _mm256_sub_pd(y, y_fl);
+    const __m256d  xs = _mm256_mul_pd(_mm256_mul_pd(x_frac, x_frac), _mm256_fnmadd_pd(two, x_frac, three));
+    const __m256d  ys = _mm256_mul_pd(_mm256_mul_pd(y_frac, y_frac), _mm256_fnmadd_pd(two, y_frac, three));
+
+    const __m256d  low = _mm256_fmadd_pd(xs, _mm256_sub_pd(t, s), s);
+    const __m256d  high = _mm256_fmadd_pd(xs, _mm256_sub_pd(v, u), u);
+    return _mm256_fmadd_pd(ys, _mm256_sub_pd(high, low), low);
+}
+
+__attribute__((target("avx2,fma")))
+static void perlin2d_batch_avx2(const double* x, const double* y, double freq, int depth, double* out, int count)
+{
+    const __m256d  f = _mm256_set1_pd(freq);
+    const __m256d  div = _mm256_set1_pd(perlin_div(depth));
+    int  i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256d  xa0 = _mm256_mul_pd(_mm256_loadu_pd(x + i), f);
+        __m256d  ya0 = _mm256_mul_pd(_mm256_loadu_pd(y + i), f);
+        __m256d  xa1 = _mm256_mul_pd(_mm256_loadu_pd(x + i + 4), f);
+        __m256d  ya1 = _mm256_mul_pd(_mm256_loadu_pd(y + i + 4), f);
+        __m256d  fin0 = _mm256_setzero_pd();
+        __m256d  fin1 = _mm256_setzero_pd();
+        double  amp = 1.0;
+        for (int o=0; o<depth; o++)
+        {
+            const __m256d  a = _mm256_set1_pd(amp);
+            fin0 = _mm256_fmadd_pd(noise2d_avx2(xa0, ya0), a, fin0);
+            fin1 = _mm256_fmadd_pd(noise2d_avx2(xa1, ya1), a, fin1);
+            amp /= 2;
+            xa0 = _mm256_add_pd(xa0, xa0);
+            ya0 = _mm256_add_pd(ya0, ya0);
+            xa1 = _mm256_add_pd(xa1, xa1);
+            ya1 = _mm256_add_pd(ya1, ya1);
+        }
+        _mm256_storeu_pd(out + i, _mm256_div_pd(fin0, div));
+        _mm256_storeu_pd(out + i + 4, _mm256_div_pd(fin1, div));
+    }
+
+    perlin2d_batch_scalar(x + i, y + i, freq, depth, out + i, count - i);
+}
+
+__attribute__((target("avx512f,avx2,fma")))
+static inline __m512d noise2d_avx512(__m512d x, __m512d y)
+{
+    const __m256i  mask = _mm256_set1_epi32(255);
+    const __m256i  onei = _mm256_set1_epi32(1);
+    const __m512d  three = _mm512_set1_pd(3.0);
+    const __m512d  two = _mm512_set1_pd(2.0);
+
+    const __m512d  x_fl = _mm512_roundscale_pd(x, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    const __m512d  y_fl = _mm512_roundscale_pd(y, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    const __m256i  xi = _mm512_cvttpd_epi32(x_fl);
+    const __m256i  yi = _mm512_cvttpd_epi32(y_fl);
+
+    const __m256i  hy0 = _mm256_i32gather_epi32(HASH32, _mm256_and_si256(_mm256_add_epi32(yi, _mm256_set1_epi32(SEED)), mask), 4);
+    const __m256i  hy1 = _mm256_i32gather_epi32(HASH32, _mm256_and_si256(_mm256_add_epi32(yi, _mm256_set1_epi32(SEED + 1)), mask), 4);
+    const __m256i  bx0 = _mm256_add_epi32(hy0, xi);
+    const __m256i  bx1 = _mm256_add_epi32(hy1, xi);
+
+    const __m512d  s = _mm512_cvtepi32_pd(_mm256_i32gather_epi32(HASH32, _mm256_and_si256(bx0, mask), 4));
+    const __m512d  t = _mm512_cvtepi32_pd(_mm256_i32gather_epi32(HASH32, _mm256_and_si256(_mm256_add_epi32(bx0, onei), mask), 4));
+    const __m512d  u = _mm512_cvtepi32_pd(_mm256_i32gather_epi32(HASH32, _mm256_and_si256(bx1, mask), 4));
+    const __m512d  v = _mm512_cvtepi32_pd(_mm256_i32gather_epi32(HASH32, _mm256_and_si256(_mm256_add_epi32(bx1, onei), mask), 4));
+
+    const __m512d  x_frac = _mm512_sub_pd(x, x_fl);
+    const __m512d  y_frac = _mm512_sub_pd(y, y_fl);
+    const __m512d  xs = _mm512_mul_pd(_mm512_mul_pd(x_frac, x_frac), _mm512_fnmadd_pd(two, x_frac, three));
+    const __m512d  ys = _mm512_mul_pd(_mm512_mul_pd(y_frac, y_frac), _mm512_fnmadd_pd(two, y_frac, three));
+
+    const __m512d  low = _mm512_fmadd_pd(xs, _mm512_sub_pd(t, s), s);
+    const __m512d  high = _mm512_fmadd_pd(xs, _mm512_sub_pd(v, u), u);
+    return _mm512_fmadd_pd(ys, _mm512_sub_pd(high, low), low);
+}
+
+__attribute__((target("avx512f,avx2,fma")))
+static void perlin2d_batch_avx512(const double* x, const double* y, double freq, int depth, double* out, int count)
+{
+    const __m512d  f = _mm512_set1_pd(freq);
+    const __m512d  div = _mm512_set1_pd(perlin_div(depth));
+    int  i = 0;
+
+    for (; i + 16 <= count; i += 16)
+    {
+        __m512d  xa0 = _mm512_mul_pd(_mm512_loadu_pd(x + i), f);
+        __m512d  ya0 = _mm512_mul_pd(_mm512_loadu_pd(y + i), f);
+        __m512d  xa1 = _mm512_mul_pd(_mm512_loadu_pd(x + i + 8), f);
+        __m512d  ya1 = _mm512_mul_pd(_mm512_loadu_pd(y + i + 8), f);
+        __m512d  fin0 = _mm512_setzero_pd();
+        __m512d  fin1 = _mm512_setzero_pd();
+        double  amp = 1.0;
+        for (int o=0; o<depth; o++)
+        {
+            const __m512d  a = _mm512_set1_pd(amp);
+            fin0 = _mm512_fmadd_pd(noise2d_avx512(xa0, ya0), a, fin0);
+            fin1 = _mm512_fmadd_pd(noise2d_avx512(xa1, ya1), a, fin1);
+            amp /= 2;
+            xa0 = _mm512_add_pd(xa0, xa0);
+            ya0 = _mm512_add_pd(ya0, ya0);
+            xa1 = _mm512_add_pd(xa1, xa1);
+            ya1 = _mm512_add_pd(ya1, ya1);
+        }
+        _mm512_storeu_pd(out + i, _mm512_div_pd(fin0, div));
+        _mm512_storeu_pd(out + i + 8, _mm512_div_pd(fin1, div));
+    }
+
+    perlin2d_batch_avx2(x + i, y + i, freq, depth, out + i, count - i);
+}
+#endif
+
+// Best kernel for what cpu_features reports right now, so cpu_restrict can
+// force the older ones
+static perlin_batch_kernel perlin_select(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    const uint32  features = cpu_features();
+    perlin_init_hash32();
+    if (features & CPU_AVX512F)
+        return perlin2d_batch_avx512;
+    if ((features & CPU_AVX2) && (features & CPU_FMA))
+        return perlin2d_batch_avx2;
+    if (features & CPU_SSE2)
+        return perlin2d_batch_sse2;
+#endif
+    return perlin2d_batch_scalar;
+}
+
+static perlin_batch_kernel  perlinKernel = NULL;
+
+// Sets up the tables and picks the batch kernel once. Call it before using
+// perlin2d_batch from more than one thread, like checksum_select.
+void perlin_batch_select(void)
+{
+    if (!perlinKernel)
+        perlinKernel = perlin_select();
+}
+
+// out[i] = perlin2d(x[i], y[i], freq, depth) for every i < count
+void perlin2d_batch(const double* x, const double* y, double freq, int depth, double* out, int count)
+{
+    perlin_batch_select();
+    perlinKernel(x, y, freq, depth, out, count);
+}
@@ -0,0 +1,455 @@
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Incremental PNG writer. Rows are filtered as they arrive and deflated in
+// blocks of about PNG_STREAM_FLUSH bytes, each primed with the previous 32K
+// of input and closed with a sync flush, then written out as its own IDAT
+// chunk. Memory use is bounded by the window and the blocks in flight no
+// matter how large the image is, and the first bytes go out long before the
+// last row is shaded. Rows are written top to bottom, so
+// stbi_flip_vertically_on_write is not supported.
+//
+// Since blocks only depend on their input and the 32K before it, a stream
+// with a pool buffers one block per worker and compresses them in parallel,
+// pigz style. The per-block adler32s are combined into the one for the whole
+// stream, and the result is still a single valid zlib stream.
+
+#define PNG_STREAM_FLUSH (256 * 1024)
+#define PNG_STREAM_WINDOW 32768
+
+typedef struct {
+  stbi_write_func* func;
+  void* context;
+
+  int w;
+  int h;
+  int n;
+  int bits;
+  int rowBytes;
+  int rows;
+  int quality;
+  uint8 failed;
+
+  threadpool pool;
+  uint32 blocks;
+
+  // Set by sinks that can report write errors, see png_stream_fd
+  const uint8* sinkFailed;
+
+  // Previous row followed by the current one, as stored in the file
+  uint8* raw;
+  signed char* line;
+
+  // Up to PNG_STREAM_WINDOW bytes of history followed by pending filtered rows
+  uint8* window;
+  int dict;
+  int pending;
+
+  uint32 adler;
+} png_stream_t;
+
+typedef png_stream_t* png_stream;
+
+// Context for png_stream_fd_write. failed is set once a write fails, and a
+// stream writing through it fails from then on.
+typedef struct {
+  int fd;
+  uint8 failed;
+} png_stream_fd;
+
+// stbi_write_func that writes to the png_stream_fd context points to
+void png_stream_fd_write(void* context, void* data, int size) {
+  png_stream_fd* sink = (png_stream_fd*) context;
+  uint8* p = (uint8*) data;
+
+  while (size > 0 && !sink->failed) {
+    ssize_t written = write(sink->fd, p, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      sink->failed = 1;
+      return;
+    }
+
+    p += written;
+    size -= (int) written;
+  }
+}
+
+static void png_stream_write(png_stream s, void* data, int size) {
+  s->func(s->context, data, size);
+
+  if (s->sinkFailed && *s->sinkFailed) {
+    s->failed = 1;
+  }
+}
+
+static void png_stream_chunk(png_stream s, const char* tag, const uint8* prefix, int prefixLen, const uint8* data, int len, const uint8* suffix, int suffixLen) {
+  int total = prefixLen + len + suffixLen;
+  uint8* chunk = (uint8*) malloc(total + 12);
+
+  if (!chunk) {
+    s->failed = 1;
+    return;
+  }
+
+  uint8* o = chunk;
+  stbiw__wp32(o, total);
+  stbiw__wptag(o, tag);
+
+  if (prefixLen) {
+    memcpy(o, prefix, prefixLen);
+    o += prefixLen;
+  }
+  if (len) {
+    memcpy(o, data, len);
+    o += len;
+  }
+  if (suffixLen) {
+    memcpy(o, suffix, suffixLen);
+    o += suffixLen;
+  }
+
+  stbiw__wpcrc(&o, total);
+
+  png_stream_write(s, chunk, total + 12);
+  free(chunk);
+}
+
+typedef struct {
+  png_stream s;
+  uint32 count;
+  uint8 final;
+  uint8** out;
+  int* outLen;
+  uint32* adler;
+} png_flush_job;
+
+static void png_stream_block(void* ctx, uint32 task, uint32 worker) {
+  png_flush_job* job = (png_flush_job*) ctx;
+  png_stream s = job->s;
+
+  int start = s->dict + (int) task * PNG_STREAM_FLUSH;
+  int end = start + PNG_STREAM_FLUSH < s->dict + s->pending ? start + PNG_STREAM_FLUSH : s->dict + s->pending;
+  int dict = start < PNG_STREAM_WINDOW ? start : PNG_STREAM_WINDOW;
+  uint8 final = job->final && task == job->count - 1;
+
+  uint8* data = s->window + start - dict;
+  job->out[task] = stbi_zlib_deflate_block(data, dict, dict + end - start, &job->outLen[task], s->quality, final);
+  job->adler[task] = stbi_zlib_adler32(1, s->window + start, end - start);
+}
+
+static void png_stream_flush(png_stream s, uint8 final) {
+  uint32 count = (s->pending + PNG_STREAM_FLUSH - 1) / PNG_STREAM_FLUSH;
+  if (count == 0) {
+    count = 1;
+  }
+
+  uint8** out = (uint8**) calloc(count, sizeof(uint8*));
+  int* outLen = (int*) calloc(count, sizeof(int));
+  uint32* adler = (uint32*) calloc(count, sizeof(uint32));
+
+  if (!out || !outLen || !adler) {
+    free(out);
+    free(outLen);
+    free(adler);
+    s->failed = 1;
+    return;
+  }
+
+  png_flush_job job = {
+    .s = s,
+    .count = count,
+    .final = final,
+    .out = out,
+    .outLen = outLen,
+    .adler = adler
+  };
+
+  pool_run(s->pool, count, png_stream_block, &job);
+
+  int offset = s->dict;
+
+  for (uint32 b = 0; b < count; b++) {
+    int len = offset + PNG_STREAM_FLUSH < s->dict + s->pending ? PNG_STREAM_FLUSH : s->dict + s->pending - offset;
+    s->adler = stbi_zlib_adler32_combine(s->adler, adler[b], len);
+    offset += len;
+  }
+
+  // zlib header goes in front of the first block, adler32 after the last
+  uint8 header[2] = { 0x78, 0x5e };
+  uint8 trailer[4] = {
+    STBIW_UCHAR(s->adler >> 24), STBIW_UCHAR(s->adler >> 16),
+    STBIW_UCHAR(s->adler >> 8), STBIW_UCHAR(s->adler)
+  };
+
+  for (uint32 b = 0; b < count; b++) {
+    if (!out[b]) {
+      s->failed = 1;
+      continue;
+    }
+
+    uint8 first = s->dict == 0 && b == 0;
+    uint8 last = final && b == count - 1;
+
+    if (!s->failed) {
+      png_stream_chunk(s, "IDAT", header, first ? 2 : 0, out[b], outLen[b], trailer, last ? 4 : 0);
+    }
+
+    STBIW_FREE(out[b]);
+  }
+
+  free(out);
+  free(outLen);
+  free(adler);
+
+  int total = s->dict + s->pending;
+  int keep = total < PNG_STREAM_WINDOW ? total : PNG_STREAM_WINDOW;
+
+  memmove(s->window, s->window + total - keep, keep);
+  s->dict = keep;
+  s->pending = 0;
+}
+
+static png_stream png_stream_open(threadpool pool, stbi_write_func* func, void* context, int w, int h, int n, int bits, int rowBytes) {
+  if (w <= 0 || h <= 0 || stbi__flip_vertically_on_write) {
+    return NULL;
+  }
+
+  png_stream s = (png_stream) calloc(1, sizeof(png_stream_t));
+  if (!s) {
+    return NULL;
+  }
+
+  // Blocks get their adler32 on the pool
+  checksum_select();
+
+  s->func = func;
+  s->context = context;
+  s->sinkFailed = func == png_stream_fd_write ? &((png_stream_fd*) context)->failed : NULL;
+  s->w = w;
+  s->h = h;
+  s->n = n;
+  s->bits = bits;
+  s->rowBytes = rowBytes;
+  s->quality = stbi_write_png_compression_level;
+  s->adler = 1;
+  s->pool = pool;
+  s->blocks = pool_workers(pool);
+  s->raw = (uint8*) malloc(rowBytes * 2);
+  s->line = (signed char*) malloc(rowBytes);
+  s->window = (uint8*) malloc(PNG_STREAM_WINDOW + (uint64) PNG_STREAM_FLUSH * s->blocks + rowBytes + 1);
+
+  if (!s->raw || !s->line || !s->window) {
+    free(s->raw);
+    free(s->line);
+    free(s->window);
+    free(s);
+    return NULL;
+  }
+
+  return s;
+}
+
+static void png_stream_header(png_stream s, int ctype) {
+  uint8 head[8 + 25] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+  uint8* o = head + 8;
+
+  stbiw__wp32(o, 13);
+  stbiw__wptag(o, "IHDR");
+  stbiw__wp32(o, s->w);
+  stbiw__wp32(o, s->h);
+  *o++ = STBIW_UCHAR(s->bits);
+  *o++ = STBIW_UCHAR(ctype);
+  *o++ = 0;
+  *o++ = 0;
+  *o++ = 0;
+  stbiw__wpcrc(&o, 13);
+
+  png_stream_write(s, head, sizeof(head));
+}
+
+// Starts a w x h PNG with n channels, writing through func. With a pool,
+// blocks are compressed in parallel. Returns NULL if out of memory.
+png_stream png_stream_begin_parallel(threadpool pool, stbi_write_func* func, void* context, int w, int h, int n) {
+  if (n < 1 || n > 4) {
+    return NULL;
+  }
+
+  png_stream s = png_stream_open(pool, func, context, w, h, n, 8, w * n);
+  if (!s) {
+    return NULL;
+  }
+
+  int ctype[5] = { -1, 0, 4, 2, 6 };
+  png_stream_header(s, ctype[n]);
+
+  return s;
+}
+
+// Starts an indexed color PNG. Rows are given as one palette index per pixel
+// and stored with bits (1, 2, 4 or 8) bits per pixel, so every index must be
+// below both count and 1 << bits.
+png_stream png_stream_begin_indexed(threadpool pool, stbi_write_func* func, void* context, int w, int h, int bits, const color24* palette, int count) {
+  if ((bits != 1 && bits != 2 && bits != 4 && bits != 8) || !palette || count < 1 || count > (1 << bits)) {
+    return NULL;
+  }
+
+  png_stream s = png_stream_open(pool, func, context, w, h, 1, bits, (w * bits + 7) / 8);
+  if (!s) {
+    return NULL;
+  }
+
+  uint8 plte[256 * 3];
+  for (int i = 0; i < count; i++) {
+    plte[i * 3 + 0] = palette[i].r;
+    plte[i * 3 + 1] = palette[i].g;
+    plte[i * 3 + 2] = palette[i].b;
+  }
+
+  png_stream_header(s, 3);
+  png_stream_chunk(s, "PLTE", NULL, 0, plte, count * 3, NULL, 0);
+
+  return s;
+}
+
+// Smallest bit depth an indexed PNG with count colors can use
+int png_index_bits(int count) {
+  if (count <= 2) {
+    return 1;
+  }
+  if (count <= 4) {
+    return 2;
+  }
+  if (count <= 16) {
+    return 4;
+  }
+
+  return 8;
+}
+
+// Adds the next row, w * n bytes, or w indices for indexed streams
+void png_stream_row(png_stream s, const uint8* row) {
+  if (!s || s->failed || s->rows >= s->h) {
+    return;
+  }
+
+  int rowBytes = s->rowBytes;
+  int force = stbi_write_force_png_filter >= 5 ? -1 : stbi_write_force_png_filter;
+
+  // Filtering looks at the row above through the stride, so the first row
+  // sits in the first slot and every later row in the second
+  int slot = s->rows == 0 ? 0 : 1;
+  uint8* dstRow = s->raw + slot * rowBytes;
+
+  if (s->bits == 8) {
+    memcpy(dstRow, row, rowBytes);
+  } else {
+    // Packs indices most significant bits first, padding the last byte
+    int perByte = 8 / s->bits;
+    memset(dstRow, 0, rowBytes);
+
+    for (int x = 0; x < s->w; x++) {
+      int shift = 8 - s->bits * (x % perByte + 1);
+      dstRow[x / perByte] |= (uint8) (row[x] << shift);
+    }
+  }
+
+  // Sub-byte pixels filter with a one byte distance, like 8-bit grey
+  int width = s->bits == 8 ? s->w : rowBytes;
+  int filter = stbiw__filter_png_line(s->raw, rowBytes, width, 2, slot, s->n, force, s->line);
+
+  uint8* dst = s->window + s->dict + s->pending;
+  dst[0] = (uint8) filter;
+  memcpy(dst + 1, s->line, rowBytes);
+  s->pending += rowBytes + 1;
+
+  if (slot == 1) {
+    memcpy(s->raw, s->raw + rowBytes, rowBytes);
+  }
+
+  s->rows++;
+
+  if (s->rows == s->h) {
+    png_stream_flush(s, 1);
+  } else if (s->pending >= PNG_STREAM_FLUSH * (int) s->blocks) {
+    png_stream_flush(s, 0);
+  }
+}
+
+// Writes IEND and frees the stream. Returns 1 if every row was written and,
+// for sinks that report errors, made it out.
+uint8 png_stream_end(png_stream s) {
+  if (!s) {
+    return 0;
+  }
+
+  uint8 ok = !s->failed && s->rows == s->h;
+
+  if (ok) {
+    png_stream_chunk(s, "IEND", NULL, 0, NULL, 0, NULL, 0);
+    ok = !s->failed;
+  }
+
+  free(s->raw);
+  free(s->line);
+  free(s->window);
+  free(s);
+
+  return ok;
+}
+
+static uint8 png_stream_file_rows(png_stream_fd* sink, png_stream s, int h, const uint8* pixels, int stride) {
+  if (!s) {
+    close(sink->fd);
+    return 0;
+  }
+
+  for (int y = 0; y < h; y++) {
+    png_stream_row(s, pixels + (uint64) y * stride);
+  }
+
+  uint8 ok = png_stream_end(s);
+
+  if (close(sink->fd) != 0) {
+    ok = 0;
+  }
+
+  return ok;
+}
+
+// Streams an in-memory image to path, equivalent to stbi_write_png without
+// building the whole file in memory first. pool may be NULL.
+uint8 png_stream_file(threadpool pool, const char* path, int w, int h, int n, const uint8* pixels, int stride) {
+  png_stream_fd sink = {
+    .fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+  };
+
+  if (sink.fd < 0) {
+    return 0;
+  }
+
+  png_stream s = png_stream_begin_parallel(pool, png_stream_fd_write, &sink, w, h, n);
+  return png_stream_file_rows(&sink, s, h, pixels, stride);
+}
+
+// Writes an index image as an indexed PNG using the smallest bit depth that
+// fits count colors
+uint8 png_stream_file_indexed(threadpool pool, const char* path, int w, int h, const color24* palette, int count, const uint8* indices, int stride) {
+  png_stream_fd sink = {
+    .fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+  };
+
+  if (sink.fd < 0) {
+    return 0;
+  }
+
+  png_stream s = png_stream_begin_indexed(pool, png_stream_fd_write, &sink, w, h, png_index_bits(count), palette, count);
+  return png_stream_file_rows(&sink, s, h, indices, stride);
+}
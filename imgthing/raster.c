@@ -0,0 +1,351 @@
+#include "common.h"
+#include <math.h>
+#include <stdlib.h>
+
+// Line drawing for overlays. Hard lines are integer Bresenham between pixel
+// centres, smooth ones are Wu lines that spread each step over the two
+// pixels nearest the line by coverage. Everything is clipped to the image
+// first, so lines may start and end anywhere.
+//
+// raster_lines draws a batch in parallel over row bands. A band draws the
+// rows of every line that cross it, in batch order, and the pixels of a
+// line don't depend on where it was clipped, so the result is the same as
+// drawing the lines one after the other.
+
+#define RASTER_BAND_ROWS 64
+
+// Hard line endpoints further out than this are dropped, it keeps the
+// Bresenham terms within 64 bits
+#define RASTER_MAX_COORD (1 << 29)
+
+typedef struct {
+  float x0;
+  float y0;
+  float x1;
+  float y1;
+  color24 rgb;
+  // Wu line when set, otherwise Bresenham between the rounded endpoints
+  uint8 smooth;
+} raster_line;
+
+// Liang-Barsky: narrows t0..t1 to where p0 + t * dp stays within lo..hi.
+// Returns 0 once nothing is left.
+static uint8 raster_clip_axis(double p0, double dp, double lo, double hi, double* t0, double* t1) {
+  if (dp == 0) {
+    return p0 >= lo && p0 <= hi;
+  }
+
+  double ta = (lo - p0) / dp;
+  double tb = (hi - p0) / dp;
+
+  if (ta > tb) {
+    double t = ta;
+    ta = tb;
+    tb = t;
+  }
+
+  *t0 = ta > *t0 ? ta : *t0;
+  *t1 = tb < *t1 ? tb : *t1;
+
+  return *t0 <= *t1;
+}
+
+// Clips the segment to x0..x1, y0..y1 in place. Returns 0 if none of it is
+// inside.
+uint8 raster_clip(float* x0, float* y0, float* x1, float* y1, float left, float top, float right, float bottom) {
+  double dx = (double) *x1 - *x0;
+  double dy = (double) *y1 - *y0;
+  double t0 = 0;
+  double t1 = 1;
+
+  if (!raster_clip_axis(*x0, dx, left, right, &t0, &t1) || !raster_clip_axis(*y0, dy, top, bottom, &t0, &t1)) {
+    return 0;
+  }
+
+  float sx = *x0;
+  float sy = *y0;
+
+  *x0 = sx + t0 * dx;
+  *y0 = sy + t0 * dy;
+  *x1 = sx + t1 * dx;
+  *y1 = sy + t1 * dy;
+
+  return 1;
+}
+
+static inline int64 raster_ceildiv(int64 a, int64 b) {
+  return a >= 0 ? (a + b - 1) / b : -((-a) / b);
+}
+
+// Bresenham from x0, y0 to x1, y1, both ends included, drawing only the
+// pixels in rows top..bottom - 1. Step i along the major axis is at minor
+// offset floor((2 * i * minor + major) / (2 * major)), so the range of
+// steps inside the image and band is worked out directly from that and the
+// loop starts there with the matching error term, no per pixel checks.
+static void raster_hard(img image, color24 c, int32 x0, int32 y0, int32 x1, int32 y1, int32 top, int32 bottom) {
+  if (abs(x0) > RASTER_MAX_COORD || abs(y0) > RASTER_MAX_COORD || abs(x1) > RASTER_MAX_COORD || abs(y1) > RASTER_MAX_COORD) {
+    return;
+  }
+
+  int64 dx = (int64) x1 - x0;
+  int64 dy = (int64) y1 - y0;
+  int64 ax = dx < 0 ? -dx : dx;
+  int64 ay = dy < 0 ? -dy : dy;
+  int32 sx = dx < 0 ? -1 : 1;
+  int32 sy = dy < 0 ? -1 : 1;
+
+  uint8 steep = ay > ax;
+  int64 major = steep ? ay : ax;
+  int64 minor = steep ? ax : ay;
+
+  if (major == 0) {
+    if (x0 >= 0 && x0 < (int32) image.w && y0 >= top && y0 < bottom) {
+      setcolor(image, x0, y0, c);
+    }
+    return;
+  }
+
+  // Major axis a, minor axis b, each with the range of pixels to draw
+  int64 a0 = steep ? y0 : x0;
+  int64 b0 = steep ? x0 : y0;
+  int32 sa = steep ? sy : sx;
+  int32 sb = steep ? sx : sy;
+  int64 alo = steep ? top : 0;
+  int64 ahi = steep ? bottom - 1 : (int64) image.w - 1;
+  int64 blo = steep ? 0 : top;
+  int64 bhi = steep ? (int64) image.w - 1 : bottom - 1;
+
+  int64 first = sa > 0 ? alo - a0 : a0 - ahi;
+  int64 last = sa > 0 ? ahi - a0 : a0 - alo;
+  first = first > 0 ? first : 0;
+  last = last < major ? last : major;
+
+  // Minor offsets that stay inside, the line only covers 0..minor
+  int64 olo = sb > 0 ? blo - b0 : b0 - bhi;
+  int64 ohi = sb > 0 ? bhi - b0 : b0 - blo;
+  olo = olo > 0 ? olo : 0;
+  ohi = ohi < minor ? ohi : minor;
+
+  if (olo > ohi) {
+    return;
+  }
+
+  if (minor > 0) {
+    int64 from = raster_ceildiv(2 * major * olo - major, 2 * minor);
+    int64 to = raster_ceildiv(2 * major * (ohi + 1) - major, 2 * minor) - 1;
+
+    first = from > first ? from : first;
+    last = to < last ? to : last;
+  }
+
+  if (first > last) {
+    return;
+  }
+
+  int64 error = 2 * first * minor + major;
+  int64 offset = error / (2 * major);
+  error %= 2 * major;
+
+  int64 a = a0 + sa * first;
+  int64 b = b0 + sb * offset;
+  int64 stride = (int64) image.w * CHANNELS;
+  int64 stepa = steep ? sa * stride : sa * CHANNELS;
+  int64 stepb = steep ? sb * CHANNELS : sb * stride;
+
+  uint8* p = steep ? offsetBy(image, b, a) : offsetBy(image, a, b);
+
+  for (int64 i = first; i <= last; i++) {
+    p[0] = c.r;
+    p[1] = c.g;
+    p[2] = c.b;
+
+    p += stepa;
+    error += 2 * minor;
+
+    if (error >= 2 * major) {
+      error -= 2 * major;
+      p += stepb;
+    }
+  }
+}
+
+static inline void raster_blend(img image, int32 x, int32 y, int32 top, int32 bottom, color24 c, float coverage) {
+  if (x < 0 || x >= (int32) image.w || y < top || y >= bottom) {
+    return;
+  }
+
+  uint32 a = (uint32) (coverage * 255 + 0.5f);
+  uint8* p = offsetBy(image, x, y);
+
+  p[0] = (p[0] * (255 - a) + c.r * a + 127) / 255;
+  p[1] = (p[1] * (255 - a) + c.g * a + 127) / 255;
+  p[2] = (p[2] * (255 - a) + c.b * a + 127) / 255;
+}
+
+// Plots major, minor in image coordinates
+static inline void raster_plot(img image, uint8 steep, int32 major, int32 minor, int32 top, int32 bottom, color24 c, float coverage) {
+  if (steep) {
+    raster_blend(image, minor, major, top, bottom, c, coverage);
+  } else {
+    raster_blend(image, major, minor, top, bottom, c, coverage);
+  }
+}
+
+// Wu line, pixel centres at integer coordinates, drawing only rows
+// top..bottom - 1. The segment must already be clipped close to the image.
+// The minor position of each step is worked out from the start rather than
+// added up, so it's the same whichever band draws it.
+static void raster_smooth(img image, color24 c, float x0, float y0, float x1, float y1, int32 top, int32 bottom) {
+  uint8 steep = fabsf(y1 - y0) > fabsf(x1 - x0);
+
+  float a0 = steep ? y0 : x0;
+  float b0 = steep ? x0 : y0;
+  float a1 = steep ? y1 : x1;
+  float b1 = steep ? x1 : y1;
+
+  if (a0 > a1) {
+    float t = a0;
+    a0 = a1;
+    a1 = t;
+    t = b0;
+    b0 = b1;
+    b1 = t;
+  }
+
+  float gradient = a1 - a0 > 0 ? (b1 - b0) / (a1 - a0) : 1;
+
+  // Ends cover part of their pixel along the major axis
+  float aend0 = floorf(a0 + 0.5f);
+  float bend0 = b0 + gradient * (aend0 - a0);
+  float gap0 = 1 - (a0 + 0.5f - floorf(a0 + 0.5f));
+
+  float aend1 = floorf(a1 + 0.5f);
+  float bend1 = b1 + gradient * (aend1 - a1);
+  float gap1 = a1 + 0.5f - floorf(a1 + 0.5f);
+
+  int32 first = (int32) aend0;
+  int32 last = (int32) aend1;
+
+  float fb = floorf(bend0);
+  raster_plot(image, steep, first, (int32) fb, top, bottom, c, (1 - (bend0 - fb)) * gap0);
+  raster_plot(image, steep, first, (int32) fb + 1, top, bottom, c, (bend0 - fb) * gap0);
+
+  if (last != first) {
+    fb = floorf(bend1);
+    raster_plot(image, steep, last, (int32) fb, top, bottom, c, (1 - (bend1 - fb)) * gap1);
+    raster_plot(image, steep, last, (int32) fb + 1, top, bottom, c, (bend1 - fb) * gap1);
+  }
+
+  // Steps between the ends, narrowed to the ones that can reach the band.
+  // The pixels drawn are up to a row away from the line.
+  int32 from = first + 1;
+  int32 to = last - 1;
+
+  if (steep) {
+    from = top > from ? top : from;
+    to = bottom - 1 < to ? bottom - 1 : to;
+  } else if (gradient != 0) {
+    float ta = aend0 + (top - 1 - bend0) / gradient;
+    float tb = aend0 + (bottom - bend0) / gradient;
+    float lo = ta < tb ? ta : tb;
+    float hi = ta < tb ? tb : ta;
+
+    // Kept within the line before converting, a shallow line can put them
+    // anywhere
+    lo = lo > first ? (lo < last ? lo : last) : first;
+    hi = hi > first ? (hi < last ? hi : last) : first;
+
+    from = (int32) lo - 1 > from ? (int32) lo - 1 : from;
+    to = (int32) hi + 1 < to ? (int32) hi + 1 : to;
+  } else if (bend0 < top - 1 || bend0 >= bottom) {
+    return;
+  }
+
+  for (int32 a = from; a <= to; a++) {
+    float b = bend0 + gradient * (a - aend0);
+    float fb = floorf(b);
+    float frac = b - fb;
+
+    raster_plot(image, steep, a, (int32) fb, top, bottom, c, 1 - frac);
+    raster_plot(image, steep, a, (int32) fb + 1, top, bottom, c, frac);
+  }
+}
+
+// Draws line in rows top..bottom - 1 of image
+static void raster_draw(img image, const raster_line* line, int32 top, int32 bottom) {
+  if (line->smooth) {
+    float x0 = line->x0;
+    float y0 = line->y0;
+    float x1 = line->x1;
+    float y1 = line->y1;
+
+    // A couple of pixels of slack so the clipped ends, which are drawn
+    // faded, stay off the image
+    if (!raster_clip(&x0, &y0, &x1, &y1, -2, -2, image.w + 1, image.h + 1)) {
+      return;
+    }
+
+    raster_smooth(image, line->rgb, x0, y0, x1, y1, top, bottom);
+    return;
+  }
+
+  float lo = -RASTER_MAX_COORD;
+  float hi = RASTER_MAX_COORD;
+
+  if (!(line->x0 >= lo && line->x0 <= hi && line->y0 >= lo && line->y0 <= hi
+      && line->x1 >= lo && line->x1 <= hi && line->y1 >= lo && line->y1 <= hi)) {
+    return;
+  }
+
+  raster_hard(image, line->rgb, (int32) floorf(line->x0 + 0.5f), (int32) floorf(line->y0 + 0.5f),
+    (int32) floorf(line->x1 + 0.5f), (int32) floorf(line->y1 + 0.5f), top, bottom);
+}
+
+typedef struct {
+  img image;
+  const raster_line* lines;
+  uint32 count;
+} raster_job;
+
+static void raster_band(void* ctx, uint32 task, uint32 worker) {
+  raster_job* job = (raster_job*) ctx;
+  int32 top = task * RASTER_BAND_ROWS;
+  int32 bottom = top + RASTER_BAND_ROWS < (int32) job->image.h ? top + RASTER_BAND_ROWS : (int32) job->image.h;
+
+  for (uint32 i = 0; i < job->count; i++) {
+    const raster_line* line = &job->lines[i];
+
+    // Smooth lines reach a row past their ends
+    float ymin = line->y0 < line->y1 ? line->y0 : line->y1;
+    float ymax = line->y0 < line->y1 ? line->y1 : line->y0;
+
+    if (ymax < top - 2 || ymin > bottom + 1) {
+      continue;
+    }
+
+    raster_draw(job->image, line, top, bottom);
+  }
+}
+
+// Draws count lines in order, later ones over earlier ones
+void raster_lines(threadpool pool, img image, const raster_line* lines, uint32 count) {
+  if (!image.buf || !lines || count == 0) {
+    return;
+  }
+
+  raster_job job = {
+    .image = image,
+    .lines = lines,
+    .count = count
+  };
+
+  pool_run(pool, (image.h + RASTER_BAND_ROWS - 1) / RASTER_BAND_ROWS, raster_band, &job);
+}
+
+void drawline(img image, color24 c, int32 xfrom, int32 yfrom, int32 xto, int32 yto) {
+  if (!image.buf) {
+    return;
+  }
+
+  raster_hard(image, c, xfrom, yfrom, xto, yto, 0, image.h);
+}
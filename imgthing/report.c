@@ -0,0 +1,220 @@
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+// Per-stage timing for the generation pipeline. Each stage records wall and
+// CPU time (CPU time covers every thread, so cpu / wall is roughly how many
+// cores the stage kept busy), how many pixels and bytes it handled and the
+// peak RSS of the process when it finished. Stages that work on something
+// other than pixels can also count those with report_items. The report
+// prints as a text table or as JSON for tracking regressions.
+
+#define REPORT_MAX_STAGES 32
+
+typedef struct {
+  const char* name;
+  double wallStart;
+  double cpuStart;
+
+  double wall;
+  double cpu;
+  uint64 pixels;
+  uint64 bytes;
+  uint64 peakRss;
+
+  // Set by report_items, unit is NULL otherwise
+  const char* unit;
+  uint64 items;
+} report_stage;
+
+typedef struct {
+  report_stage stages[REPORT_MAX_STAGES];
+  uint32 count;
+  double wallStart;
+  double cpuStart;
+} report_t;
+
+typedef report_t* report;
+
+static double report_clock(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Peak resident set size so far, in bytes
+uint64 report_peak_rss() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+
+  // ru_maxrss is in kilobytes on Linux
+  return (uint64) usage.ru_maxrss * 1024;
+}
+
+report report_alloc() {
+  report r = (report) calloc(1, sizeof(report_t));
+  if (!r) {
+    return NULL;
+  }
+
+  r->wallStart = report_clock(CLOCK_MONOTONIC);
+  r->cpuStart = report_clock(CLOCK_PROCESS_CPUTIME_ID);
+
+  return r;
+}
+
+void report_free(report r) {
+  free(r);
+}
+
+// Starts timing a stage and returns its id for report_end. name must outlive
+// the report. Returns REPORT_MAX_STAGES once the report is full, which
+// report_end ignores.
+uint32 report_begin(report r, const char* name) {
+  if (!r || r->count >= REPORT_MAX_STAGES) {
+    return REPORT_MAX_STAGES;
+  }
+
+  report_stage* s = &r->stages[r->count];
+  memset(s, 0, sizeof(report_stage));
+
+  s->name = name;
+  s->wallStart = report_clock(CLOCK_MONOTONIC);
+  s->cpuStart = report_clock(CLOCK_PROCESS_CPUTIME_ID);
+
+  return r->count++;
+}
+
+// Stops timing a stage that processed pixels pixels and bytes bytes, either
+// may be 0 if it doesn't apply
+void report_end(report r, uint32 stage, uint64 pixels, uint64 bytes) {
+  if (!r || stage >= r->count) {
+    return;
+  }
+
+  report_stage* s = &r->stages[stage];
+
+  s->wall = report_clock(CLOCK_MONOTONIC) - s->wallStart;
+  s->cpu = report_clock(CLOCK_PROCESS_CPUTIME_ID) - s->cpuStart;
+  s->pixels = pixels;
+  s->bytes = bytes;
+  s->peakRss = report_peak_rss();
+}
+
+// Records that a stage handled items things of the given unit, like
+// droplets, on top of its pixels and bytes. unit must outlive the report.
+void report_items(report r, uint32 stage, const char* unit, uint64 items) {
+  if (!r || stage >= r->count) {
+    return;
+  }
+
+  r->stages[stage].unit = unit;
+  r->stages[stage].items = items;
+}
+
+static double report_rate(uint64 amount, double seconds) {
+  return seconds > 0 ? amount / seconds : 0;
+}
+
+void report_text(report r, FILE* f) {
+  if (!r || !f) {
+    return;
+  }
+
+  fprintf(f, "%-20s %10s %10s %10s %10s %10s\n", "stage", "wall ms", "cpu ms", "Mpx/s", "MB/s", "peak MB");
+
+  for (uint32 i = 0; i < r->count; i++) {
+    report_stage* s = &r->stages[i];
+
+    fprintf(f, "%-20s %10.2f %10.2f %10.2f %10.2f %10.1f",
+      s->name,
+      s->wall * 1e3,
+      s->cpu * 1e3,
+      report_rate(s->pixels, s->wall) / 1e6,
+      report_rate(s->bytes, s->wall) / 1e6,
+      s->peakRss / 1048576.0);
+
+    if (s->unit) {
+      fprintf(f, "   %.3f M %s/s", report_rate(s->items, s->wall) / 1e6, s->unit);
+    }
+
+    fputc('\n', f);
+  }
+
+  fprintf(f, "%-20s %10.2f %10.2f %10s %10s %10.1f\n",
+    "total",
+    (report_clock(CLOCK_MONOTONIC) - r->wallStart) * 1e3,
+    (report_clock(CLOCK_PROCESS_CPUTIME_ID) - r->cpuStart) * 1e3,
+    "", "",
+    report_peak_rss() / 1048576.0);
+}
+
+static void report_json_string(FILE* f, const char* str) {
+  fputc('"', f);
+
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\') {
+      fputc('\\', f);
+      fputc(*str, f);
+    } else if ((uint8) *str < 0x20) {
+      fprintf(f, "\\u%04x", (uint8) *str);
+    } else {
+      fputc(*str, f);
+    }
+  }
+
+  fputc('"', f);
+}
+
+// Times are in seconds, rates per second and sizes in bytes
+void report_json(report r, FILE* f) {
+  if (!r || !f) {
+    return;
+  }
+
+  fprintf(f, "{\n  \"stages\": [\n");
+
+  for (uint32 i = 0; i < r->count; i++) {
+    report_stage* s = &r->stages[i];
+
+    fprintf(f, "    {\"name\": ");
+    report_json_string(f, s->name);
+    fprintf(f, ", \"wall\": %.6f, \"cpu\": %.6f, \"pixels\": %llu, \"bytes\": %llu, \"pixelsPerSec\": %.1f, \"bytesPerSec\": %.1f, \"peakRss\": %llu",
+      s->wall,
+      s->cpu,
+      s->pixels,
+      s->bytes,
+      report_rate(s->pixels, s->wall),
+      report_rate(s->bytes, s->wall),
+      s->peakRss);
+
+    if (s->unit) {
+      fprintf(f, ", \"unit\": ");
+      report_json_string(f, s->unit);
+      fprintf(f, ", \"items\": %llu, \"itemsPerSec\": %.1f", s->items, report_rate(s->items, s->wall));
+    }
+
+    fprintf(f, "}%s\n", i + 1 < r->count ? "," : "");
+  }
+
+  fprintf(f, "  ],\n  \"wall\": %.6f,\n  \"cpu\": %.6f,\n  \"peakRss\": %llu\n}\n",
+    report_clock(CLOCK_MONOTONIC) - r->wallStart,
+    report_clock(CLOCK_PROCESS_CPUTIME_ID) - r->cpuStart,
+    report_peak_rss());
+}
+
+uint8 report_json_file(report r, const char* path) {
+  FILE* f = fopen(path, "w");
+  if (!f) {
+    return 0;
+  }
+
+  report_json(r, f);
+
+  return fclose(f) == 0;
+}
@@ -31,6 +31,10 @@ BUILDING:
    unsigned char * my_compress(unsigned char *data, int data_len, int *out_len, int quality);
    The returned data will be freed with STBIW_FREE() (free() by default),
    so it must be heap allocated with STBIW_MALLOC() (malloc() by default),
+   You can #define STBIW_CRC32 and STBIW_ADLER32 to replace the checksums with
+   faster ones, with the signatures
+   unsigned int my_crc32(unsigned char *buffer, int len);
+   unsigned int my_adler32(unsigned int adler, const unsigned char *data, int data_len);
 
 UNICODE:
 
@@ -68,6 +72,7 @@ USAGE:
       int stbi_write_tga_with_rle;             // defaults to true; set to 0 to disable RLE
       int stbi_write_png_compression_level;    // defaults to 8; set to higher for more compression
       int stbi_write_force_png_filter;         // defaults to -1; set to 0..5 to force a filter mode
+      int stbi_write_png_fast_filter;          // defaults to 0; set to 1 to pick filters from a sample of each row
 
 
    You can define STBI_WRITE_NO_STDIO to disable the file variant of these
@@ -97,7 +102,14 @@ USAGE:
    at the end of the line.)
 
    PNG allows you to set the deflate compression level by setting the global
-   variable 'stbi_write_png_compression_level' (it defaults to 8).
+   variable 'stbi_write_png_compression_level' (it defaults to 8). Levels 1-4
+   use a fast greedy match finder, 5-8 the original one and 9 up a slow lazy
+   one that searches much deeper for the smallest output.
+
+   Unless a filter is forced, PNG scores all five filters for every row in a
+   single pass (SSE2 when available) and keeps the cheapest. Setting
+   'stbi_write_png_fast_filter' only scores every eighth 16-byte run of the
+   row, which is much faster for a slightly worse filter choice.
 
    HDR expects linear float data. Since the format is always 32-bit rgb(e)
    data, alpha (if provided) is discarded, and for monochrome data it is
@@ -170,6 +182,7 @@ LICENSE
 STBIWDEF int stbi_write_tga_with_rle;
 STBIWDEF int stbi_write_png_compression_level;
 STBIWDEF int stbi_write_force_png_filter;
+STBIWDEF int stbi_write_png_fast_filter;
 #endif
 
 #ifndef STBI_WRITE_NO_STDIO
@@ -247,14 +260,21 @@ STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 
 #define STBIW_UCHAR(x) (unsigned char) ((x) & 0xff)
 
+#if !defined(STBIW_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define STBIW_SSE2
+#include <emmintrin.h>
+#endif
+
 #ifdef STB_IMAGE_WRITE_STATIC
 static int stbi_write_png_compression_level = 8;
 static int stbi_write_tga_with_rle = 1;
 static int stbi_write_force_png_filter = -1;
+static int stbi_write_png_fast_filter = 0;
 #else
 int stbi_write_png_compression_level = 8;
 int stbi_write_tga_with_rle = 1;
 int stbi_write_force_png_filter = -1;
+int stbi_write_png_fast_filter = 0;
 #endif
 
 static int stbi__flip_vertically_on_write = 0;
@@ -890,35 +910,207 @@ static unsigned int stbiw__zhash(unsigned char *data)
 
 #define stbiw__ZHASH   16384
 
+static const unsigned short stbiw__zlib_lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
+static const unsigned char  stbiw__zlib_lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
+static const unsigned short stbiw__zlib_distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
+static const unsigned char  stbiw__zlib_disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+#define stbiw__zlib_match(best,d) do {                                                       \
+      int stbiw__k;                                                                          \
+      for (stbiw__k=0; (best) > stbiw__zlib_lengthc[stbiw__k+1]-1; ++stbiw__k);              \
+      stbiw__zlib_huff(stbiw__k+257);                                                        \
+      if (stbiw__zlib_lengtheb[stbiw__k]) stbiw__zlib_add((best) - stbiw__zlib_lengthc[stbiw__k], stbiw__zlib_lengtheb[stbiw__k]); \
+      for (stbiw__k=0; (d) > stbiw__zlib_distc[stbiw__k+1]-1; ++stbiw__k);                   \
+      stbiw__zlib_add(stbiw__zlib_bitrev(stbiw__k,5),5);                                     \
+      if (stbiw__zlib_disteb[stbiw__k]) stbiw__zlib_add((d) - stbiw__zlib_distc[stbiw__k], stbiw__zlib_disteb[stbiw__k]); \
+   } while (0)
+
+// Length of the common prefix of a and b, up to limit and at most 258, eight
+// bytes at a time where unaligned little endian loads are cheap
+static int stbiw__zlib_countm_fast(const unsigned char *a, const unsigned char *b, int limit)
+{
+   int i = 0;
+   if (limit > 258) limit = 258;
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   for (; i + 8 <= limit; i += 8) {
+      unsigned long long x, y;
+      memcpy(&x, a + i, 8);
+      memcpy(&y, b + i, 8);
+      if (x != y)
+         return i + (__builtin_ctzll(x ^ y) >> 3);
+   }
+#endif
+   for (; i < limit && a[i] == b[i]; ++i);
+   return i;
+}
+
+static unsigned int stbiw__zhash4(const unsigned char *data)
+{
+   stbiw_uint32 v = data[0] | (data[1] << 8) | (data[2] << 16) | ((stbiw_uint32) data[3] << 24);
+   return (v * 2654435761u) >> (32 - 15);
+}
+
+// Match finder settings for the levels that don't use the bucketed hash:
+// how many chain links to follow, the length that ends the search early and
+// whether to look one byte ahead for a longer match
+typedef struct
+{
+   int chain, nice, lazy;
+} stbiw__zlib_preset;
+
+static stbiw__zlib_preset stbiw__zlib_get_preset(int quality)
+{
+   stbiw__zlib_preset p;
+   if (quality <= 1)      { p.chain = 1;  p.nice = 258; p.lazy = 0; }
+   else if (quality == 2) { p.chain = 4;  p.nice = 16;  p.lazy = 0; }
+   else if (quality == 3) { p.chain = 8;  p.nice = 32;  p.lazy = 0; }
+   else if (quality == 4) { p.chain = 16; p.nice = 64;  p.lazy = 0; }
+   else {
+      p.chain = quality >= 13 ? 4096 : 1 << (quality - 1);
+      p.nice = 258;
+      p.lazy = 1;
+   }
+   return p;
+}
+
 #endif // STBIW_ZLIB_COMPRESS
 
-STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+#ifndef STBIW_ZLIB_COMPRESS
+// Levels 1-4 and 9 up use a 4-byte hash with zlib style head/prev chains
+// instead of the bucketed hash. Levels 1-4 take the first match found
+// (greedy) and give up ratio for speed, level 1 only looks at the most recent
+// position with the same hash. Levels 9 up follow long chains and defer a
+// match by a byte whenever the next position has a longer one, for the
+// smallest output regardless of time.
+static int stbiw__zlib_find(const unsigned char *data, const int *head, const int *prev, int i, int data_len, const stbiw__zlib_preset *p, int *bestpos)
 {
-#ifdef STBIW_ZLIB_COMPRESS
-   // user provided a zlib compress implementation, use that
-   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
-#else // use builtin
-   static unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
-   static unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
-   static unsigned short distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
-   static unsigned char  disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
-   unsigned int bitbuf=0;
-   int i,j, bitcount=0;
-   unsigned char *out = NULL;
-   unsigned char ***hash_table = (unsigned char***) STBIW_MALLOC(stbiw__ZHASH * sizeof(unsigned char**));
-   if (hash_table == NULL)
-      return NULL;
-   if (quality < 5) quality = 5;
+   int best = 0, chain = p->chain, limit = data_len - i;
+   int cand = head[stbiw__zhash4(data+i)];
+   if (limit > 258) limit = 258;
+   while (cand >= 0 && i - cand <= 32767 && chain-- > 0) {
+      // a longer match has to agree at the byte just past the current best
+      if (data[cand+best] == data[i+best] || best == 0) {
+         int d = stbiw__zlib_countm_fast(data+cand, data+i, limit);
+         if (d > best) {
+            best = d;
+            *bestpos = cand;
+            if (best >= p->nice || best == limit) break;
+         }
+      }
+      cand = prev[cand & 32767];
+   }
+   return best;
+}
 
-   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
-   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
-   stbiw__zlib_add(1,1);  // BFINAL = 1
-   stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
+static int stbiw__zlib_deflate_chain(unsigned char **outp, unsigned int *bitbuffer, int *bitcounter, unsigned char *data, int dict_len, int data_len, int quality)
+{
+   unsigned int bitbuf=*bitbuffer;
+   int i, bitcount=*bitcounter;
+   unsigned char *out = *outp;
+   stbiw__zlib_preset p = stbiw__zlib_get_preset(quality);
+   int end = data_len - 3; // last position with 4 bytes to hash
+   int *head = (int *) STBIW_MALLOC(sizeof(int) * (1 << 15));
+   int *prev = (int *) STBIW_MALLOC(sizeof(int) * 32768);
+   if (head == NULL || prev == NULL) {
+      STBIW_FREE(head);
+      STBIW_FREE(prev);
+      return 0;
+   }
+   memset(head, 0xff, sizeof(int) * (1 << 15));
+
+#define stbiw__zlib_insert(pos) do {                     \
+      unsigned int stbiw__h = stbiw__zhash4(data+(pos)); \
+      prev[(pos) & 32767] = head[stbiw__h];              \
+      head[stbiw__h] = (pos);                            \
+   } while (0)
+
+   // prime the hash chains with the dictionary
+   for (i = dict_len > 32768 ? dict_len - 32768 : 0; i < dict_len && i < end; ++i)
+      stbiw__zlib_insert(i);
+
+   i = dict_len;
+   if (i < end) {
+      int pos = 0, len = stbiw__zlib_find(data, head, prev, i, data_len, &p, &pos);
+      stbiw__zlib_insert(i);
+
+      while (i < end) {
+         if (p.lazy && len >= 4 && len < p.nice && i+1 < end) {
+            int pos2 = 0, len2 = stbiw__zlib_find(data, head, prev, i+1, data_len, &p, &pos2);
+            if (len2 > len) { // better match one byte later, current byte goes out as a literal
+               stbiw__zlib_huffb(data[i]);
+               ++i;
+               stbiw__zlib_insert(i);
+               len = len2;
+               pos = pos2;
+               continue;
+            }
+         }
+
+         if (len >= 4) {
+            int d = i - pos, j;
+            STBIW_ASSERT(d <= 32767 && len <= 258);
+            stbiw__zlib_match(len, d);
+            for (j = i+1; j < i+len && j < end; ++j)
+               stbiw__zlib_insert(j);
+            i += len;
+         } else {
+            stbiw__zlib_huffb(data[i]);
+            ++i;
+         }
+
+         if (i < end) {
+            len = stbiw__zlib_find(data, head, prev, i, data_len, &p, &pos);
+            stbiw__zlib_insert(i);
+         }
+      }
+   }
+#undef stbiw__zlib_insert
+
+   // write out final bytes
+   for (;i < data_len; ++i)
+      stbiw__zlib_huffb(data[i]);
+
+   STBIW_FREE(head);
+   STBIW_FREE(prev);
+
+   *outp = out;
+   *bitbuffer = bitbuf;
+   *bitcounter = bitcount;
+   return 1;
+}
+#endif // STBIW_ZLIB_COMPRESS
+
+#ifndef STBIW_ZLIB_COMPRESS
+// Emits fixed-huffman codes for data[dict_len..data_len) into the bit stream.
+// Matches may reach back into data[0..dict_len), which is how a block gets
+// primed with the previous 32K of input when a stream is compressed in pieces.
+static int stbiw__zlib_deflate_range(unsigned char **outp, unsigned int *bitbuffer, int *bitcounter, unsigned char *data, int dict_len, int data_len, int quality)
+{
+   unsigned int bitbuf=*bitbuffer;
+   int i,j, bitcount=*bitcounter;
+   unsigned char *out = *outp;
+   unsigned char ***hash_table;
+   if (quality < 5 || quality > 8)
+      return stbiw__zlib_deflate_chain(outp, bitbuffer, bitcounter, data, dict_len, data_len, quality);
+
+   hash_table = (unsigned char***) STBIW_MALLOC(stbiw__ZHASH * sizeof(unsigned char**));
+   if (hash_table == NULL)
+      return 0;
 
    for (i=0; i < stbiw__ZHASH; ++i)
       hash_table[i] = NULL;
 
-   i=0;
+   // prime the hash chains with the dictionary
+   for (i = dict_len > 32768 ? dict_len - 32768 : 0; i < dict_len && i < data_len-3; ++i) {
+      int h = stbiw__zhash(data+i)&(stbiw__ZHASH-1);
+      if (hash_table[h] && stbiw__sbn(hash_table[h]) == 2*quality) {
+         STBIW_MEMMOVE(hash_table[h], hash_table[h]+quality, sizeof(hash_table[h][0])*quality);
+         stbiw__sbn(hash_table[h]) = quality;
+      }
+      stbiw__sbpush(hash_table[h],data+i);
+   }
+
+   i=dict_len;
    while (i < data_len-3) {
       // hash next 3 bytes of data to be compressed
       int h = stbiw__zhash(data+i)&(stbiw__ZHASH-1), best=3;
@@ -957,12 +1149,7 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
       if (bestloc) {
          int d = (int) (data+i - bestloc); // distance back
          STBIW_ASSERT(d <= 32767 && best <= 258);
-         for (j=0; best > lengthc[j+1]-1; ++j);
-         stbiw__zlib_huff(j+257);
-         if (lengtheb[j]) stbiw__zlib_add(best - lengthc[j], lengtheb[j]);
-         for (j=0; d > distc[j+1]-1; ++j);
-         stbiw__zlib_add(stbiw__zlib_bitrev(j,5),5);
-         if (disteb[j]) stbiw__zlib_add(d - distc[j], disteb[j]);
+         stbiw__zlib_match(best, d);
          i += best;
       } else {
          stbiw__zlib_huffb(data[i]);
@@ -972,15 +1159,78 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
    // write out final bytes
    for (;i < data_len; ++i)
       stbiw__zlib_huffb(data[i]);
-   stbiw__zlib_huff(256); // end of block
-   // pad with 0 bits to byte boundary
-   while (bitcount)
-      stbiw__zlib_add(0,1);
 
    for (i=0; i < stbiw__ZHASH; ++i)
       (void) stbiw__sbfree(hash_table[i]);
    STBIW_FREE(hash_table);
 
+   *outp = out;
+   *bitbuffer = bitbuf;
+   *bitcounter = bitcount;
+   return 1;
+}
+#endif // STBIW_ZLIB_COMPRESS
+
+// running adler32, start with adler = 1
+STBIWDEF unsigned int stbi_zlib_adler32(unsigned int adler, const unsigned char *data, int data_len)
+{
+#ifdef STBIW_ADLER32
+   return STBIW_ADLER32(adler, data, data_len);
+#else
+   unsigned int s1=adler & 0xffff, s2=adler >> 16;
+   int i, j=0;
+   int blocklen = (int) (data_len % 5552);
+   while (j < data_len) {
+      for (i=0; i < blocklen; ++i) { s1 += data[j+i]; s2 += s1; }
+      s1 %= 65521; s2 %= 65521;
+      j += blocklen;
+      blocklen = 5552;
+   }
+   return (s2 << 16) | s1;
+#endif
+}
+
+// adler32 of two concatenated buffers from the adler32 of each, len2 being
+// the length of the second one
+STBIWDEF unsigned int stbi_zlib_adler32_combine(unsigned int adler1, unsigned int adler2, unsigned int len2)
+{
+   unsigned int rem = len2 % 65521;
+   unsigned int sum1 = adler1 & 0xffff;
+   unsigned int sum2 = (rem * sum1) % 65521;
+   sum1 += (adler2 & 0xffff) + 65521 - 1;
+   sum2 += (adler1 >> 16) + (adler2 >> 16) + 65521 - rem;
+   if (sum1 >= 65521) sum1 -= 65521;
+   if (sum1 >= 65521) sum1 -= 65521;
+   if (sum2 >= 65521*2) sum2 -= 65521*2;
+   if (sum2 >= 65521) sum2 -= 65521;
+   return sum1 | (sum2 << 16);
+}
+
+STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+{
+#ifdef STBIW_ZLIB_COMPRESS
+   // user provided a zlib compress implementation, use that
+   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
+#else // use builtin
+   unsigned int bitbuf=0;
+   int j, bitcount=0;
+   unsigned char *out = NULL;
+
+   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
+   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
+   stbiw__zlib_add(1,1);  // BFINAL = 1
+   stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
+
+   if (!stbiw__zlib_deflate_range(&out, &bitbuf, &bitcount, data, 0, data_len, quality)) {
+      (void) stbiw__sbfree(out);
+      return NULL;
+   }
+
+   stbiw__zlib_huff(256); // end of block
+   // pad with 0 bits to byte boundary
+   while (bitcount)
+      stbiw__zlib_add(0,1);
+
    // store uncompressed instead if compression was worse
    if (stbiw__sbn(out) > data_len + 2 + ((data_len+32766)/32767)*5) {
       stbiw__sbn(out) = 2;  // truncate to DEFLATE 32K window and FLEVEL = 1
@@ -1000,19 +1250,11 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
 
    {
       // compute adler32 on input
-      unsigned int s1=1, s2=0;
-      int blocklen = (int) (data_len % 5552);
-      j=0;
-      while (j < data_len) {
-         for (i=0; i < blocklen; ++i) { s1 += data[j+i]; s2 += s1; }
-         s1 %= 65521; s2 %= 65521;
-         j += blocklen;
-         blocklen = 5552;
-      }
-      stbiw__sbpush(out, STBIW_UCHAR(s2 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s2));
-      stbiw__sbpush(out, STBIW_UCHAR(s1 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s1));
+      unsigned int adler = stbi_zlib_adler32(1, data, data_len);
+      stbiw__sbpush(out, STBIW_UCHAR(adler >> 24));
+      stbiw__sbpush(out, STBIW_UCHAR(adler >> 16));
+      stbiw__sbpush(out, STBIW_UCHAR(adler >> 8));
+      stbiw__sbpush(out, STBIW_UCHAR(adler));
    }
    *out_len = stbiw__sbn(out);
    // make returned pointer freeable
@@ -1021,6 +1263,47 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
 #endif // STBIW_ZLIB_COMPRESS
 }
 
+#ifndef STBIW_ZLIB_COMPRESS
+// Compresses data[dict_len..data_len) as one raw deflate block (no zlib header
+// or adler32), with data[0..dict_len) as preset history. Unless final is set
+// the block is closed with a sync flush, so the output always ends on a byte
+// boundary and blocks compressed separately can simply be concatenated.
+STBIWDEF unsigned char * stbi_zlib_deflate_block(unsigned char *data, int dict_len, int data_len, int *out_len, int quality, int final)
+{
+   unsigned int bitbuf=0;
+   int bitcount=0;
+   unsigned char *out = NULL;
+
+   stbiw__zlib_add(final ? 1 : 0,1);  // BFINAL
+   stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
+
+   if (!stbiw__zlib_deflate_range(&out, &bitbuf, &bitcount, data, dict_len, data_len, quality)) {
+      (void) stbiw__sbfree(out);
+      return NULL;
+   }
+
+   stbiw__zlib_huff(256); // end of block
+
+   if (!final) {
+      // sync flush: empty stored block, LEN = 0, NLEN = 0xffff
+      stbiw__zlib_add(0,3);
+      while (bitcount)
+         stbiw__zlib_add(0,1);
+      stbiw__sbpush(out, 0x00);
+      stbiw__sbpush(out, 0x00);
+      stbiw__sbpush(out, 0xff);
+      stbiw__sbpush(out, 0xff);
+   }
+
+   while (bitcount)
+      stbiw__zlib_add(0,1);
+
+   *out_len = stbiw__sbn(out);
+   STBIW_MEMMOVE(stbiw__sbraw(out), out, *out_len);
+   return (unsigned char *) stbiw__sbraw(out);
+}
+#endif // STBIW_ZLIB_COMPRESS
+
 static unsigned int stbiw__crc32(unsigned char *buffer, int len)
 {
 #ifdef STBIW_CRC32
@@ -1088,41 +1371,189 @@ static unsigned char stbiw__paeth(int a, int b, int c)
    return STBIW_UCHAR(c);
 }
 
-// @OPTIMIZE: provide an option that always forces left-predict or paeth predict
-static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int width, int height, int y, int n, int filter_type, signed char *line_buffer)
+// Filtered value of byte i of row z for filter_type 0..4. up is the row above,
+// or NULL on the first row where everything above the image counts as zero,
+// which turns Up into None and Paeth into Sub like the PNG spec says.
+static unsigned char stbiw__filter_byte(int filter_type, const unsigned char *z, const unsigned char *up, int i, int n)
+{
+   int a = i >= n ? z[i-n] : 0;
+   int b = up ? up[i] : 0;
+   int c = (up && i >= n) ? up[i-n] : 0;
+   switch (filter_type) {
+      case 1: return STBIW_UCHAR(z[i] - a);
+      case 2: return STBIW_UCHAR(z[i] - b);
+      case 3: return STBIW_UCHAR(z[i] - ((a + b) >> 1));
+      case 4: return STBIW_UCHAR(z[i] - stbiw__paeth(a, b, c));
+   }
+   return z[i];
+}
+
+// Adds the sum of absolute values of bytes from..to-1 of every filter to est
+static void stbiw__filter_estimate_scalar(const unsigned char *z, const unsigned char *up, int from, int to, int n, int *est)
 {
-   static int mapping[] = { 0,1,2,3,4 };
-   static int firstmap[] = { 0,1,0,5,6 };
-   int *mymap = (y != 0) ? mapping : firstmap;
    int i;
-   int type = mymap[filter_type];
+   for (i = from; i < to; ++i) {
+      int a = i >= n ? z[i-n] : 0;
+      int b = up ? up[i] : 0;
+      int c = (up && i >= n) ? up[i-n] : 0;
+      est[0] += abs((signed char) z[i]);
+      est[1] += abs((signed char) (z[i] - a));
+      est[2] += abs((signed char) (z[i] - b));
+      est[3] += abs((signed char) (z[i] - ((a + b) >> 1)));
+      est[4] += abs((signed char) (z[i] - stbiw__paeth(a, b, c)));
+   }
+}
+
+#ifdef STBIW_SSE2
+static __m128i stbiw__select_sse2(__m128i mask, __m128i yes, __m128i no)
+{
+   return _mm_or_si128(_mm_and_si128(mask, yes), _mm_andnot_si128(mask, no));
+}
+
+static __m128i stbiw__abs16_sse2(__m128i v)
+{
+   return _mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(), v));
+}
+
+// Paeth predictor of 8 16-bit lanes, same tie breaking as stbiw__paeth
+static __m128i stbiw__paeth8_sse2(__m128i a, __m128i b, __m128i c)
+{
+   __m128i da = _mm_sub_epi16(b, c);
+   __m128i db = _mm_sub_epi16(a, c);
+   __m128i pa = stbiw__abs16_sse2(da);
+   __m128i pb = stbiw__abs16_sse2(db);
+   __m128i pc = stbiw__abs16_sse2(_mm_add_epi16(da, db));
+   __m128i nota = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+   __m128i notb = _mm_cmpgt_epi16(pb, pc);
+   return stbiw__select_sse2(nota, stbiw__select_sse2(notb, c, b), a);
+}
+
+static __m128i stbiw__paeth_sse2(__m128i a, __m128i b, __m128i c)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i lo = stbiw__paeth8_sse2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+   __m128i hi = stbiw__paeth8_sse2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+   return _mm_packus_epi16(lo, hi);
+}
+
+// floor((a + b) / 2), _mm_avg_epu8 rounds up
+static __m128i stbiw__avg_sse2(__m128i a, __m128i b)
+{
+   __m128i odd = _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1));
+   return _mm_sub_epi8(_mm_avg_epu8(a, b), odd);
+}
+
+// 16 filtered bytes starting at i, which must be at least n
+static __m128i stbiw__filter_sse2(int filter_type, const unsigned char *z, const unsigned char *up, int i, int n)
+{
+   __m128i x = _mm_loadu_si128((const __m128i *) (z + i));
+   __m128i a = _mm_loadu_si128((const __m128i *) (z + i - n));
+   __m128i b = up ? _mm_loadu_si128((const __m128i *) (up + i)) : _mm_setzero_si128();
+   __m128i c = up ? _mm_loadu_si128((const __m128i *) (up + i - n)) : _mm_setzero_si128();
+   switch (filter_type) {
+      case 1: return _mm_sub_epi8(x, a);
+      case 2: return _mm_sub_epi8(x, b);
+      case 3: return _mm_sub_epi8(x, stbiw__avg_sse2(a, b));
+      case 4: return _mm_sub_epi8(x, stbiw__paeth_sse2(a, b, c));
+   }
+   return x;
+}
+
+// |v| of each signed byte summed into the two 64-bit lanes of acc
+static __m128i stbiw__abs_sum_sse2(__m128i acc, __m128i v)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i mag = _mm_min_epu8(v, _mm_sub_epi8(zero, v));
+   return _mm_add_epi64(acc, _mm_sad_epu8(mag, zero));
+}
+#endif
+
+// Scores every filter on row z in one pass. step is 16 to look at the whole
+// row, larger steps only look at the 16 bytes at the start of each step.
+static void stbiw__filter_estimate(const unsigned char *z, const unsigned char *up, int len, int n, int step, int *est)
+{
+   int i, f;
+   for (f = 0; f < 5; ++f)
+      est[f] = 0;
+
+   stbiw__filter_estimate_scalar(z, up, 0, n, n, est);
+   i = n;
+
+#ifdef STBIW_SSE2
+   {
+      __m128i acc[5];
+      for (f = 0; f < 5; ++f)
+         acc[f] = _mm_setzero_si128();
+
+      for (; i + 16 <= len; i += step) {
+         __m128i x = _mm_loadu_si128((const __m128i *) (z + i));
+         __m128i a = _mm_loadu_si128((const __m128i *) (z + i - n));
+         __m128i b = up ? _mm_loadu_si128((const __m128i *) (up + i)) : _mm_setzero_si128();
+         __m128i c = up ? _mm_loadu_si128((const __m128i *) (up + i - n)) : _mm_setzero_si128();
+
+         acc[0] = stbiw__abs_sum_sse2(acc[0], x);
+         acc[1] = stbiw__abs_sum_sse2(acc[1], _mm_sub_epi8(x, a));
+         acc[2] = stbiw__abs_sum_sse2(acc[2], _mm_sub_epi8(x, b));
+         acc[3] = stbiw__abs_sum_sse2(acc[3], _mm_sub_epi8(x, stbiw__avg_sse2(a, b)));
+         acc[4] = stbiw__abs_sum_sse2(acc[4], _mm_sub_epi8(x, stbiw__paeth_sse2(a, b, c)));
+      }
+
+      for (f = 0; f < 5; ++f)
+         est[f] += _mm_cvtsi128_si32(acc[f]) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc[f], acc[f]));
+   }
+#else
+   for (; i + 16 <= len; i += step)
+      stbiw__filter_estimate_scalar(z, up, i, i + 16, n, est);
+#endif
+
+   if (i < len)
+      stbiw__filter_estimate_scalar(z, up, i, len, n, est);
+}
+
+static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int width, int height, int y, int n, int filter_type, signed char *line_buffer)
+{
+   int i, len = width*n;
    unsigned char *z = pixels + stride_bytes * (stbi__flip_vertically_on_write ? height-1-y : y);
    int signed_stride = stbi__flip_vertically_on_write ? -stride_bytes : stride_bytes;
+   const unsigned char *up = y != 0 ? z - signed_stride : NULL;
 
-   if (type==0) {
-      memcpy(line_buffer, z, width*n);
+   if (filter_type==0) {
+      memcpy(line_buffer, z, len);
       return;
    }
 
-   // first loop isn't optimized since it's just one pixel
-   for (i = 0; i < n; ++i) {
-      switch (type) {
-         case 1: line_buffer[i] = z[i]; break;
-         case 2: line_buffer[i] = z[i] - z[i-signed_stride]; break;
-         case 3: line_buffer[i] = z[i] - (z[i-signed_stride]>>1); break;
-         case 4: line_buffer[i] = (signed char) (z[i] - stbiw__paeth(0,z[i-signed_stride],0)); break;
-         case 5: line_buffer[i] = z[i]; break;
-         case 6: line_buffer[i] = z[i]; break;
+   for (i = 0; i < n; ++i)
+      line_buffer[i] = (signed char) stbiw__filter_byte(filter_type, z, up, i, n);
+#ifdef STBIW_SSE2
+   for (; i + 16 <= len; i += 16)
+      _mm_storeu_si128((__m128i *) (line_buffer + i), stbiw__filter_sse2(filter_type, z, up, i, n));
+#endif
+   for (; i < len; ++i)
+      line_buffer[i] = (signed char) stbiw__filter_byte(filter_type, z, up, i, n);
+}
+
+// Filters scanline y into line_buffer and returns the filter type used, either
+// force_filter or, if that is -1, the one with the smallest estimated entropy
+static int stbiw__filter_png_line(unsigned char *pixels, int stride_bytes, int width, int height, int y, int n, int force_filter, signed char *line_buffer)
+{
+   int filter_type = force_filter;
+   if (force_filter < 0) {
+      int est[5], best_filter_val = 0x7fffffff, f;
+      unsigned char *z = pixels + stride_bytes * (stbi__flip_vertically_on_write ? height-1-y : y);
+      int signed_stride = stbi__flip_vertically_on_write ? -stride_bytes : stride_bytes;
+      const unsigned char *up = y != 0 ? z - signed_stride : NULL;
+
+      // Estimate the entropy of the line using each filter; the less, the better.
+      stbiw__filter_estimate(z, up, width*n, n, stbi_write_png_fast_filter ? 128 : 16, est);
+      for (f = 0; f < 5; ++f) {
+         if (est[f] < best_filter_val) {
+            best_filter_val = est[f];
+            filter_type = f;
+         }
       }
    }
-   switch (type) {
-      case 1: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - z[i-n]; break;
-      case 2: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - z[i-signed_stride]; break;
-      case 3: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - ((z[i-n] + z[i-signed_stride])>>1); break;
-      case 4: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - stbiw__paeth(z[i-n], z[i-signed_stride], z[i-signed_stride-n]); break;
-      case 5: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - (z[i-n]>>1); break;
-      case 6: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - stbiw__paeth(z[i-n], 0,0); break;
-   }
+   stbiw__encode_png_line(pixels, stride_bytes, width, height, y, n, filter_type, line_buffer);
+   return filter_type;
 }
 
 STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
@@ -1144,30 +1575,7 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int s
    filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
    line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
    for (j=0; j < y; ++j) {
-      int filter_type;
-      if (force_filter > -1) {
-         filter_type = force_filter;
-         stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, force_filter, line_buffer);
-      } else { // Estimate the best filter by running through all of them:
-         int best_filter = 0, best_filter_val = 0x7fffffff, est, i;
-         for (filter_type = 0; filter_type < 5; filter_type++) {
-            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, filter_type, line_buffer);
-
-            // Estimate the entropy of the line using this filter; the less, the better.
-            est = 0;
-            for (i = 0; i < x*n; ++i) {
-               est += abs((signed char) line_buffer[i]);
-            }
-            if (est < best_filter_val) {
-               best_filter_val = est;
-               best_filter = filter_type;
-            }
-         }
-         if (filter_type != best_filter) {  // If the last iteration already got us the best filter, don't redo it
-            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, best_filter, line_buffer);
-            filter_type = best_filter;
-         }
-      }
+      int filter_type = stbiw__filter_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, force_filter, line_buffer);
       // when we get here, filter_type contains the filter type, and line_buffer contains the data
       filt[j*(x*n+1)] = (unsigned char) filter_type;
       STBIW_MEMMOVE(filt+j*(x*n+1)+1, line_buffer, x*n);
@@ -0,0 +1,352 @@
+#include "common.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define THERMAL_X86
+#endif
+
+// Thermal weathering. Wherever the height difference between a sample and
+// one of its four neighbours is more than the talus, material slides from
+// the higher to the lower one, rate times the excess per iteration. Every
+// pair moves the same amount in opposite directions, so nothing is lost,
+// and the map relaxes towards slopes no steeper than the talus.
+//
+// Each iteration is a stencil over the previous one. The map is split into
+// row bands and every task runs several iterations of its band in one pass
+// over it: it keeps three rows per iteration level in a ring and feeds rows
+// in at the top, so a row goes through all levels while it's still in cache.
+// Bands overlap by a row per level so their edges don't need their
+// neighbours, and write into a second map, which is swapped with the first
+// after every pass.
+//
+// The stencil works on raw diamond-square heights, before they're rescaled,
+// where a slope of about 1 per sample is typical whatever the map size.
+
+#define THERMAL_BAND_ROWS 64
+#define THERMAL_MAX_BLOCK 16
+
+typedef struct {
+  // Most iterations to run, fewer if the map settles first
+  uint32 iterations;
+  // Iterations per pass over the map, 1..THERMAL_MAX_BLOCK
+  uint32 block;
+  // Steepest height difference between neighbours that doesn't slide
+  float talus;
+  // Fraction of the excess moved per iteration, at most 0.25 so four
+  // neighbours can't push a sample past them
+  float rate;
+  // A pass that moves no sample by more than this ends the run, negative to
+  // always run every iteration
+  float tolerance;
+} thermal_params;
+
+void thermal_default_params(thermal_params* params) {
+  params->iterations = 32;
+  params->block = 4;
+  params->talus = 1.5f;
+  params->rate = 0.2f;
+  params->tolerance = 0.01f;
+}
+
+// Writes one iteration of row to out, up and down being the rows above and
+// below (row itself at the map edge). Returns the largest change.
+typedef float (*thermal_kernel)(float* out, const float* up, const float* row, const float* down, uint32 w, float talus, float rate);
+
+// How far a difference d is past the talus either way, d - clamp(d, -t, t)
+static inline float thermal_excess(float d, float talus) {
+  float clamped = d < -talus ? -talus : (d > talus ? talus : d);
+  return d - clamped;
+}
+
+static inline float thermal_sample(const float* up, const float* row, const float* down, uint32 x, uint32 w, float talus, float rate) {
+  float h = row[x];
+  float left = x > 0 ? row[x - 1] : h;
+  float right = x + 1 < w ? row[x + 1] : h;
+
+  float moved = thermal_excess(h - up[x], talus) + thermal_excess(h - down[x], talus)
+    + thermal_excess(h - left, talus) + thermal_excess(h - right, talus);
+
+  return h - rate * moved;
+}
+
+static float thermal_row_scalar(float* out, const float* up, const float* row, const float* down, uint32 w, float talus, float rate) {
+  float changed = 0;
+
+  for (uint32 x = 0; x < w; x++) {
+    out[x] = thermal_sample(up, row, down, x, w, talus, rate);
+
+    float change = fabsf(out[x] - row[x]);
+    changed = change > changed ? change : changed;
+  }
+
+  return changed;
+}
+
+#ifdef THERMAL_X86
+
+__attribute__((target("sse2")))
+static inline __m128 thermal_excess_sse2(__m128 d, __m128 talus, __m128 negTalus) {
+  return _mm_sub_ps(d, _mm_min_ps(_mm_max_ps(d, negTalus), talus));
+}
+
+__attribute__((target("sse2")))
+static float thermal_row_sse2(float* out, const float* up, const float* row, const float* down, uint32 w, float talus, float rate) {
+  if (w < 6) {
+    return thermal_row_scalar(out, up, row, down, w, talus, rate);
+  }
+
+  __m128 vtalus = _mm_set1_ps(talus);
+  __m128 vnegTalus = _mm_set1_ps(-talus);
+  __m128 vrate = _mm_set1_ps(rate);
+  __m128 sign = _mm_set1_ps(-0.0f);
+  __m128 vchanged = _mm_setzero_ps();
+
+  // The first and last samples need the edge handling
+  out[0] = thermal_sample(up, row, down, 0, w, talus, rate);
+  float changed = fabsf(out[0] - row[0]);
+
+  uint32 x = 1;
+  for (; x + 4 < w; x += 4) {
+    __m128 h = _mm_loadu_ps(row + x);
+
+    __m128 moved = thermal_excess_sse2(_mm_sub_ps(h, _mm_loadu_ps(up + x)), vtalus, vnegTalus);
+    moved = _mm_add_ps(moved, thermal_excess_sse2(_mm_sub_ps(h, _mm_loadu_ps(down + x)), vtalus, vnegTalus));
+    moved = _mm_add_ps(moved, thermal_excess_sse2(_mm_sub_ps(h, _mm_loadu_ps(row + x - 1)), vtalus, vnegTalus));
+    moved = _mm_add_ps(moved, thermal_excess_sse2(_mm_sub_ps(h, _mm_loadu_ps(row + x + 1)), vtalus, vnegTalus));
+
+    __m128 result = _mm_sub_ps(h, _mm_mul_ps(vrate, moved));
+    _mm_storeu_ps(out + x, result);
+
+    vchanged = _mm_max_ps(vchanged, _mm_andnot_ps(sign, _mm_sub_ps(result, h)));
+  }
+
+  float lanes[4];
+  _mm_storeu_ps(lanes, vchanged);
+
+  for (uint32 i = 0; i < 4; i++) {
+    changed = lanes[i] > changed ? lanes[i] : changed;
+  }
+
+  for (; x < w; x++) {
+    out[x] = thermal_sample(up, row, down, x, w, talus, rate);
+
+    float change = fabsf(out[x] - row[x]);
+    changed = change > changed ? change : changed;
+  }
+
+  return changed;
+}
+
+__attribute__((target("avx2")))
+static inline __m256 thermal_excess_avx2(__m256 d, __m256 talus, __m256 negTalus) {
+  return _mm256_sub_ps(d, _mm256_min_ps(_mm256_max_ps(d, negTalus), talus));
+}
+
+__attribute__((target("avx2")))
+static float thermal_row_avx2(float* out, const float* up, const float* row, const float* down, uint32 w, float talus, float rate) {
+  if (w < 10) {
+    return thermal_row_scalar(out, up, row, down, w, talus, rate);
+  }
+
+  __m256 vtalus = _mm256_set1_ps(talus);
+  __m256 vnegTalus = _mm256_set1_ps(-talus);
+  __m256 vrate = _mm256_set1_ps(rate);
+  __m256 sign = _mm256_set1_ps(-0.0f);
+  __m256 vchanged = _mm256_setzero_ps();
+
+  out[0] = thermal_sample(up, row, down, 0, w, talus, rate);
+  float changed = fabsf(out[0] - row[0]);
+
+  uint32 x = 1;
+  for (; x + 8 < w; x += 8) {
+    __m256 h = _mm256_loadu_ps(row + x);
+
+    __m256 moved = thermal_excess_avx2(_mm256_sub_ps(h, _mm256_loadu_ps(up + x)), vtalus, vnegTalus);
+    moved = _mm256_add_ps(moved, thermal_excess_avx2(_mm256_sub_ps(h, _mm256_loadu_ps(down + x)), vtalus, vnegTalus));
+    moved = _mm256_add_ps(moved, thermal_excess_avx2(_mm256_sub_ps(h, _mm256_loadu_ps(row + x - 1)), vtalus, vnegTalus));
+    moved = _mm256_add_ps(moved, thermal_excess_avx2(_mm256_sub_ps(h, _mm256_loadu_ps(row + x + 1)), vtalus, vnegTalus));
+
+    __m256 result = _mm256_sub_ps(h, _mm256_mul_ps(vrate, moved));
+    _mm256_storeu_ps(out + x, result);
+
+    vchanged = _mm256_max_ps(vchanged, _mm256_andnot_ps(sign, _mm256_sub_ps(result, h)));
+  }
+
+  float lanes[8];
+  _mm256_storeu_ps(lanes, vchanged);
+
+  for (uint32 i = 0; i < 8; i++) {
+    changed = lanes[i] > changed ? lanes[i] : changed;
+  }
+
+  for (; x < w; x++) {
+    out[x] = thermal_sample(up, row, down, x, w, talus, rate);
+
+    float change = fabsf(out[x] - row[x]);
+    changed = change > changed ? change : changed;
+  }
+
+  return changed;
+}
+
+#endif // THERMAL_X86
+
+static thermal_kernel thermal_select() {
+#ifdef THERMAL_X86
+  uint32 features = cpu_features();
+
+  if (features & CPU_AVX2) {
+    return thermal_row_avx2;
+  }
+  if (features & CPU_SSE2) {
+    return thermal_row_sse2;
+  }
+#endif
+
+  return thermal_row_scalar;
+}
+
+typedef struct {
+  const float* src;
+  float* dst;
+  uint32 w;
+  uint32 h;
+  uint32 levels;
+  float talus;
+  float rate;
+  thermal_kernel kernel;
+  // 3 rows per level below the last for each worker
+  float* rings;
+  // Largest change in the last level of each band
+  float* changed;
+} thermal_job;
+
+// Row y of level level, level 0 being src. Rows outside the map are clamped
+// to the edge, which makes the edge rows their own neighbours.
+static inline const float* thermal_level_row(thermal_job* job, float* ring, uint32 level, int32 y) {
+  y = y < 0 ? 0 : (y >= (int32) job->h ? (int32) job->h - 1 : y);
+
+  if (level == 0) {
+    return job->src + (uint64) y * job->w;
+  }
+
+  return ring + ((uint64) (level - 1) * 3 + y % 3) * job->w;
+}
+
+static void thermal_band(void* ctx, uint32 task, uint32 worker) {
+  thermal_job* job = (thermal_job*) ctx;
+  int32 h = job->h;
+  int32 levels = job->levels;
+  float* ring = job->rings + (uint64) worker * (THERMAL_MAX_BLOCK - 1) * 3 * job->w;
+
+  int32 y0 = task * THERMAL_BAND_ROWS;
+  int32 y1 = y0 + THERMAL_BAND_ROWS < h ? y0 + THERMAL_BAND_ROWS : h;
+  float changed = 0;
+
+  // Feeding row r in lets level k work out row r - k, as it has the rows
+  // on both sides of it at level k - 1 by then. Level k only needs the rows
+  // within levels - k of the band.
+  for (int32 r = y0 - levels + 1; r < y1 + levels; r++) {
+    for (int32 level = 1; level <= levels; level++) {
+      int32 y = r - level;
+      int32 lo = y0 - levels + level;
+      int32 hi = y1 + levels - level;
+
+      if (y < lo || y >= hi || y < 0 || y >= h) {
+        continue;
+      }
+
+      const float* up = thermal_level_row(job, ring, level - 1, y - 1 < 0 ? y : y - 1);
+      const float* row = thermal_level_row(job, ring, level - 1, y);
+      const float* down = thermal_level_row(job, ring, level - 1, y + 1 >= h ? y : y + 1);
+
+      if (level < levels) {
+        job->kernel(ring + ((uint64) (level - 1) * 3 + y % 3) * job->w, up, row, down, job->w, job->talus, job->rate);
+      } else {
+        float c = job->kernel(job->dst + (uint64) y * job->w, up, row, down, job->w, job->talus, job->rate);
+        changed = c > changed ? c : changed;
+      }
+    }
+  }
+
+  job->changed[task] = changed;
+}
+
+// Relaxes heights (w * h, row-major) until no neighbours differ by more than
+// params->talus or params->iterations have run. Sets ran, if not NULL, to
+// how many iterations were run.
+uint8 thermal_run(threadpool pool, float* heights, uint32 w, uint32 h, const thermal_params* params, uint32* ran) {
+  if (ran) {
+    *ran = 0;
+  }
+
+  if (!heights || !params || params->block == 0 || params->block > THERMAL_MAX_BLOCK || params->rate <= 0 || params->rate > 0.25f) {
+    return 0;
+  }
+
+  if (params->iterations == 0 || w == 0 || h == 0) {
+    return 1;
+  }
+
+  uint32 bands = (h + THERMAL_BAND_ROWS - 1) / THERMAL_BAND_ROWS;
+  float* other = (float*) malloc((uint64) w * h * sizeof(float));
+  float* rings = (float*) malloc((uint64) pool_workers(pool) * (THERMAL_MAX_BLOCK - 1) * 3 * w * sizeof(float));
+  float* changed = (float*) malloc(bands * sizeof(float));
+
+  if (!other || !rings || !changed) {
+    free(other);
+    free(rings);
+    free(changed);
+    return 0;
+  }
+
+  thermal_job job = {
+    .src = heights,
+    .dst = other,
+    .w = w,
+    .h = h,
+    .talus = params->talus,
+    .rate = params->rate,
+    .kernel = thermal_select(),
+    .rings = rings,
+    .changed = changed
+  };
+
+  for (uint32 done = 0; done < params->iterations; done += job.levels) {
+    job.levels = params->iterations - done < params->block ? params->iterations - done : params->block;
+
+    pool_run(pool, bands, thermal_band, &job);
+
+    float* swap = (float*) job.src;
+    job.src = job.dst;
+    job.dst = swap;
+
+    if (ran) {
+      *ran = done + job.levels;
+    }
+
+    // Only the last iteration of the pass is measured, that's enough to see
+    // the map has settled
+    float most = 0;
+    for (uint32 b = 0; b < bands; b++) {
+      most = changed[b] > most ? changed[b] : most;
+    }
+
+    if (most <= params->tolerance) {
+      break;
+    }
+  }
+
+  if (job.src != heights) {
+    memcpy(heights, job.src, (uint64) w * h * sizeof(float));
+  }
+
+  free(other);
+  free(rings);
+  free(changed);
+
+  return 1;
+}
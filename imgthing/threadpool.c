@@ -0,0 +1,249 @@
+#include "common.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+// Task callback, called once per task index. worker is in 0..pool->workers-1
+// and can be used to index per-thread scratch memory.
+typedef void (*pool_task)(void* ctx, uint32 task, uint32 worker);
+
+// Each worker owns a range of task indices packed as (begin << 32) | end.
+// The owner pops from the front, thieves split off the back half, both
+// with a CAS on the same word, so no locks are taken while tasks run.
+typedef struct {
+  _Atomic uint64 range;
+  uint8 pad[56];
+} pool_queue;
+
+typedef struct {
+  uint32 workers;
+  pthread_t* threads;
+  pool_queue* queues;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+
+  uint64 generation;
+  uint32 pending;
+  uint8 quit;
+
+  pool_task task;
+  void* ctx;
+} threadpool_t;
+
+typedef threadpool_t* threadpool;
+
+typedef struct {
+  threadpool pool;
+  uint32 id;
+} pool_worker_arg;
+
+#define POOL_RANGE(b, e) (((uint64) (b) << 32) | (uint64) (e))
+#define POOL_BEGIN(r) ((uint32) ((r) >> 32))
+#define POOL_END(r) ((uint32) (r))
+
+static uint8 pool_pop(pool_queue* q, uint32* out) {
+  uint64 r = atomic_load(&q->range);
+
+  while (POOL_BEGIN(r) < POOL_END(r)) {
+    if (atomic_compare_exchange_weak(&q->range, &r, POOL_RANGE(POOL_BEGIN(r) + 1, POOL_END(r)))) {
+      *out = POOL_BEGIN(r);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static uint8 pool_steal(threadpool pool, uint32 id, uint32* out) {
+  for (uint32 i = 1; i < pool->workers; i++) {
+    pool_queue* victim = &pool->queues[(id + i) % pool->workers];
+    uint64 r = atomic_load(&victim->range);
+
+    while (POOL_BEGIN(r) < POOL_END(r)) {
+      uint32 b = POOL_BEGIN(r);
+      uint32 e = POOL_END(r);
+      uint32 mid = e - (e - b + 1) / 2;
+
+      if (atomic_compare_exchange_weak(&victim->range, &r, POOL_RANGE(b, mid))) {
+        // Our own queue is empty, so nobody else can be modifying it
+        atomic_store(&pool->queues[id].range, POOL_RANGE(mid + 1, e));
+        *out = mid;
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static void pool_work(threadpool pool, uint32 id) {
+  uint32 task = 0;
+
+  while (pool_pop(&pool->queues[id], &task) || pool_steal(pool, id, &task)) {
+    pool->task(pool->ctx, task, id);
+  }
+}
+
+static void* pool_thread(void* arg) {
+  pool_worker_arg* warg = (pool_worker_arg*) arg;
+  threadpool pool = warg->pool;
+  uint32 id = warg->id;
+  uint64 seen = 0;
+
+  free(warg);
+
+  pthread_mutex_lock(&pool->lock);
+
+  while (1) {
+    while (pool->generation == seen && !pool->quit) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+
+    if (pool->quit) {
+      break;
+    }
+
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    pool_work(pool, id);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->pending--;
+
+    if (pool->pending == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+uint32 pool_cpucount() {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1) {
+    return 1;
+  }
+
+  return (uint32) n;
+}
+
+// Creates a pool with the given number of workers, the calling thread counts
+// as one of them. Pass 0 to use one worker per online CPU.
+threadpool pool_alloc(uint32 workers) {
+  if (workers == 0) {
+    workers = pool_cpucount();
+  }
+
+  threadpool pool = (threadpool) calloc(1, sizeof(threadpool_t));
+  if (!pool) {
+    return NULL;
+  }
+
+  pool->workers = workers;
+  pool->queues = (pool_queue*) aligned_alloc(64, sizeof(pool_queue) * workers);
+  pool->threads = (pthread_t*) calloc(workers, sizeof(pthread_t));
+
+  if (!pool->queues || !pool->threads) {
+    free(pool->queues);
+    free(pool->threads);
+    free(pool);
+    return NULL;
+  }
+
+  for (uint32 i = 0; i < workers; i++) {
+    atomic_init(&pool->queues[i].range, 0);
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  for (uint32 i = 1; i < workers; i++) {
+    pool_worker_arg* arg = (pool_worker_arg*) malloc(sizeof(pool_worker_arg));
+    if (arg) {
+      arg->pool = pool;
+      arg->id = i;
+    }
+
+    if (!arg || pthread_create(&pool->threads[i], NULL, pool_thread, arg) != 0) {
+      // Run with however many threads we managed to start
+      free(arg);
+      pool->workers = i;
+      break;
+    }
+  }
+
+  return pool;
+}
+
+void pool_free(threadpool pool) {
+  if (!pool) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (uint32 i = 1; i < pool->workers; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->done);
+
+  free(pool->queues);
+  free(pool->threads);
+  free(pool);
+}
+
+uint32 pool_workers(threadpool pool) {
+  if (!pool) {
+    return 1;
+  }
+
+  return pool->workers;
+}
+
+// Runs task(ctx, i, worker) for every i in 0..count-1 and returns once all of
+// them are done. The calling thread works too. A NULL pool runs everything
+// inline. Not reentrant: tasks must not call pool_run on the same pool.
+void pool_run(threadpool pool, uint32 count, pool_task task, void* ctx) {
+  if (!pool || pool->workers < 2 || count < 2) {
+    for (uint32 i = 0; i < count; i++) {
+      task(ctx, i, 0);
+    }
+    return;
+  }
+
+  uint32 workers = pool->workers;
+
+  for (uint32 i = 0; i < workers; i++) {
+    uint32 b = (uint32) (((uint64) count * i) / workers);
+    uint32 e = (uint32) (((uint64) count * (i + 1)) / workers);
+    atomic_store(&pool->queues[i].range, POOL_RANGE(b, e));
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->task = task;
+  pool->ctx = ctx;
+  pool->pending = workers - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  pool_work(pool, 0);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending > 0) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
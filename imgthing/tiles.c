@@ -0,0 +1,345 @@
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Slippy map export. The image is cut into TILE_SIZE tiles at the deepest
+// zoom, then halved with a 2x2 box filter for every zoom above it until the
+// whole image fits in one tile, and each tile is written to dir/z/x/y.png.
+// Tiles of one zoom are encoded on the pool. A tile that is a single color,
+// like open ocean, is not encoded again: dir/shared/rrggbb.png is written
+// once and the tile is a hard link to it.
+
+#define TILE_SIZE 256
+#define TILE_BAND_ROWS 64
+
+#define TILE_WRITTEN 0
+#define TILE_UNIFORM 1
+#define TILE_FAILED 2
+
+typedef struct {
+  uint32 levels;
+  uint64 tiles;
+  uint64 shared;
+  uint64 bytes;
+} tile_stats;
+
+typedef struct {
+  const char* dir;
+  img level;
+  uint32 z;
+  uint32 tilesx;
+  color24 fill;
+
+  // TILE_SIZE * TILE_SIZE * CHANNELS bytes per worker
+  uint8* scratch;
+
+  // Per tile: a TILE_* state, the color of uniform tiles and the PNG size
+  uint8* state;
+  color24* colors;
+  uint64* sizes;
+} tile_job;
+
+typedef struct {
+  img src;
+  img dst;
+} tile_halve_job;
+
+static void tile_halve_band(void* ctx, uint32 task, uint32 worker) {
+  tile_halve_job* job = (tile_halve_job*) ctx;
+  img src = job->src;
+  img dst = job->dst;
+
+  uint32 y0 = task * TILE_BAND_ROWS;
+  uint32 y1 = y0 + TILE_BAND_ROWS < dst.h ? y0 + TILE_BAND_ROWS : dst.h;
+
+  for (uint32 y = y0; y < y1; y++) {
+    uint32 sy0 = y * 2;
+    uint32 sy1 = sy0 + 1 < src.h ? sy0 + 1 : sy0;
+    uint8* out = offsetBy(dst, 0, y);
+
+    for (uint32 x = 0; x < dst.w; x++) {
+      uint32 sx0 = x * 2;
+      uint32 sx1 = sx0 + 1 < src.w ? sx0 + 1 : sx0;
+
+      const uint8* a = offsetBy(src, sx0, sy0);
+      const uint8* b = offsetBy(src, sx1, sy0);
+      const uint8* c = offsetBy(src, sx0, sy1);
+      const uint8* d = offsetBy(src, sx1, sy1);
+
+      for (uint32 ch = 0; ch < CHANNELS; ch++) {
+        out[ch] = (uint8) ((a[ch] + b[ch] + c[ch] + d[ch] + 2) / 4);
+      }
+
+      out += CHANNELS;
+    }
+  }
+}
+
+// Half size copy of src, rounding odd sizes up
+static img tile_halve(threadpool pool, img src) {
+  img dst = allocImage((src.w + 1) / 2, (src.h + 1) / 2);
+  if (!dst.buf) {
+    return dst;
+  }
+
+  tile_halve_job job = {
+    .src = src,
+    .dst = dst
+  };
+
+  pool_run(pool, (dst.h + TILE_BAND_ROWS - 1) / TILE_BAND_ROWS, tile_halve_band, &job);
+
+  return dst;
+}
+
+static void tile_encode(void* ctx, uint32 task, uint32 worker) {
+  tile_job* job = (tile_job*) ctx;
+  img level = job->level;
+
+  uint32 tx = task % job->tilesx;
+  uint32 ty = task / job->tilesx;
+  uint32 x0 = tx * TILE_SIZE;
+  uint32 y0 = ty * TILE_SIZE;
+  uint32 w = x0 + TILE_SIZE < level.w ? TILE_SIZE : level.w - x0;
+  uint32 h = y0 + TILE_SIZE < level.h ? TILE_SIZE : level.h - y0;
+
+  // Copy out the tile, padding past the edge of the image with fill
+  uint8* tile = job->scratch + (uint64) worker * TILE_SIZE * TILE_SIZE * CHANNELS;
+
+  for (uint32 y = 0; y < TILE_SIZE; y++) {
+    uint8* row = tile + y * TILE_SIZE * CHANNELS;
+    uint32 copied = 0;
+
+    if (y < h) {
+      memcpy(row, offsetBy(level, x0, y0 + y), w * CHANNELS);
+      copied = w;
+    }
+
+    for (uint32 x = copied; x < TILE_SIZE; x++) {
+      row[x * CHANNELS + 0] = job->fill.r;
+      row[x * CHANNELS + 1] = job->fill.g;
+      row[x * CHANNELS + 2] = job->fill.b;
+    }
+  }
+
+  uint8 uniform = 1;
+  for (uint32 i = CHANNELS; i < TILE_SIZE * TILE_SIZE * CHANNELS && uniform; i += CHANNELS) {
+    uniform = memcmp(tile, tile + i, CHANNELS) == 0;
+  }
+
+  if (uniform) {
+    job->state[task] = TILE_UNIFORM;
+    job->colors[task] = color(tile[0], tile[1], tile[2]);
+    return;
+  }
+
+  int len = 0;
+  uint8* png = stbi_write_png_to_mem(tile, TILE_SIZE * CHANNELS, TILE_SIZE, TILE_SIZE, CHANNELS, &len);
+  if (!png) {
+    job->state[task] = TILE_FAILED;
+    return;
+  }
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%u/%u/%u.png", job->dir, job->z, tx, ty);
+
+  // Drop any link left by an earlier export so the shared file is untouched
+  unlink(path);
+
+  FILE* f = fopen(path, "wb");
+  uint8 ok = f && fwrite(png, 1, len, f) == (size_t) len;
+  if (f && fclose(f) != 0) {
+    ok = 0;
+  }
+
+  job->state[task] = ok ? TILE_WRITTEN : TILE_FAILED;
+  job->sizes[task] = len;
+  STBIW_FREE(png);
+}
+
+static uint8 tile_mkdir(const char* path) {
+  return mkdir(path, 0755) == 0 || access(path, F_OK) == 0;
+}
+
+// Writes dir/shared/rrggbb.png for c unless it exists already and returns its
+// size, or -1 on failure
+static int64 tile_shared(const char* dir, color24 c, char* path, uint64 pathSize) {
+  snprintf(path, pathSize, "%s/shared/%02x%02x%02x.png", dir, c.r, c.g, c.b);
+
+  struct stat st;
+  if (stat(path, &st) == 0) {
+    return 0;
+  }
+
+  uint8* tile = (uint8*) malloc(TILE_SIZE * TILE_SIZE * CHANNELS);
+  if (!tile) {
+    return -1;
+  }
+
+  for (uint32 i = 0; i < TILE_SIZE * TILE_SIZE; i++) {
+    tile[i * CHANNELS + 0] = c.r;
+    tile[i * CHANNELS + 1] = c.g;
+    tile[i * CHANNELS + 2] = c.b;
+  }
+
+  int len = 0;
+  uint8* png = stbi_write_png_to_mem(tile, TILE_SIZE * CHANNELS, TILE_SIZE, TILE_SIZE, CHANNELS, &len);
+  free(tile);
+
+  if (!png) {
+    return -1;
+  }
+
+  FILE* f = fopen(path, "wb");
+  uint8 ok = f && fwrite(png, 1, len, f) == (size_t) len;
+  if (f && fclose(f) != 0) {
+    ok = 0;
+  }
+
+  STBIW_FREE(png);
+  return ok ? len : -1;
+}
+
+static uint8 tile_level(threadpool pool, const char* dir, img level, uint32 z, color24 fill, uint8* scratch, tile_stats* stats) {
+  uint32 tilesx = (level.w + TILE_SIZE - 1) / TILE_SIZE;
+  uint32 tilesy = (level.h + TILE_SIZE - 1) / TILE_SIZE;
+  uint32 count = tilesx * tilesy;
+  char path[4096];
+
+  snprintf(path, sizeof(path), "%s/%u", dir, z);
+  if (!tile_mkdir(path)) {
+    return 0;
+  }
+
+  for (uint32 tx = 0; tx < tilesx; tx++) {
+    snprintf(path, sizeof(path), "%s/%u/%u", dir, z, tx);
+    if (!tile_mkdir(path)) {
+      return 0;
+    }
+  }
+
+  tile_job job = {
+    .dir = dir,
+    .level = level,
+    .z = z,
+    .tilesx = tilesx,
+    .fill = fill,
+    .scratch = scratch,
+    .state = (uint8*) calloc(count, sizeof(uint8)),
+    .colors = (color24*) calloc(count, sizeof(color24)),
+    .sizes = (uint64*) calloc(count, sizeof(uint64))
+  };
+
+  uint8 ok = job.state && job.colors && job.sizes;
+
+  if (ok) {
+    pool_run(pool, count, tile_encode, &job);
+  }
+
+  // Uniform tiles are linked serially, the shared file is created by the
+  // first tile that needs it
+  for (uint32 t = 0; t < count && ok; t++) {
+    stats->tiles++;
+
+    if (job.state[t] == TILE_FAILED) {
+      ok = 0;
+      break;
+    }
+    if (job.state[t] == TILE_WRITTEN) {
+      stats->bytes += job.sizes[t];
+      continue;
+    }
+
+    char shared[4096];
+    int64 written = tile_shared(dir, job.colors[t], shared, sizeof(shared));
+    if (written < 0) {
+      ok = 0;
+      break;
+    }
+
+    stats->bytes += written;
+    stats->shared++;
+
+    snprintf(path, sizeof(path), "%s/%u/%u/%u.png", dir, z, t % tilesx, t / tilesx);
+    unlink(path);
+
+    if (link(shared, path) != 0) {
+      ok = 0;
+    }
+  }
+
+  free(job.state);
+  free(job.colors);
+  free(job.sizes);
+
+  return ok;
+}
+
+// Exports image as a tile pyramid under dir, which is created if its parent
+// exists. Zoom levels run from 0, where the whole image fits in one tile,
+// down to full size. Tiles past the edge of the image are padded with fill.
+// stats may be NULL.
+//
+// Zoom z only has the tiles that cover the image at that scale, ceil(w /
+// 2^(zmax - z) / TILE_SIZE) across and the same for the height, not a full
+// 2^z x 2^z grid. A slippy map viewer has to be given those bounds, or it
+// will ask for tiles that don't exist.
+uint8 tiles_export(threadpool pool, img image, const char* dir, color24 fill, tile_stats* stats) {
+  if (!image.buf || !dir || stbi__flip_vertically_on_write) {
+    return 0;
+  }
+
+  tile_stats local = { 0 };
+  if (!stats) {
+    stats = &local;
+  }
+  memset(stats, 0, sizeof(tile_stats));
+
+  uint32 zmax = 0;
+  while (((uint64) TILE_SIZE << zmax) < image.w || ((uint64) TILE_SIZE << zmax) < image.h) {
+    zmax++;
+  }
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/shared", dir);
+  if (!tile_mkdir(dir) || !tile_mkdir(path)) {
+    return 0;
+  }
+
+  uint8* scratch = (uint8*) malloc((uint64) pool_workers(pool) * TILE_SIZE * TILE_SIZE * CHANNELS);
+  if (!scratch) {
+    return 0;
+  }
+
+  // PNG chunk CRCs are computed on the pool
+  checksum_select();
+
+  uint8 ok = 1;
+  img level = image;
+
+  for (int32 z = zmax; z >= 0 && ok; z--) {
+    ok = tile_level(pool, dir, level, z, fill, scratch, stats);
+    stats->levels++;
+
+    if (ok && z > 0) {
+      img next = tile_halve(pool, level);
+      ok = next.buf != NULL;
+
+      if (level.buf != image.buf) {
+        freeimg(level);
+      }
+
+      level = next;
+    }
+  }
+
+  if (level.buf != image.buf) {
+    freeimg(level);
+  }
+
+  free(scratch);
+  return ok;
+}
@@ -0,0 +1,354 @@
+#include "common.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Worlds are made of WORLD_TILE x WORLD_TILE chunks of perlin noise that are
+// generated the first time they are touched and kept in a bounded LRU cache.
+// Every sample only depends on its global coordinates and the world seed, so
+// a chunk regenerated after eviction is identical and neighbouring chunks
+// always line up.
+
+#define WORLD_TILE 256
+
+typedef struct world_tile_struct {
+  int64 tx;
+  int64 ty;
+  float* data;
+
+  // LRU list, most recently used first
+  struct world_tile_struct* prev;
+  struct world_tile_struct* next;
+
+  // Hash bucket chain
+  struct world_tile_struct* chain;
+} world_tile;
+
+typedef struct {
+  uint64 seed;
+  double freq;
+  int depth;
+
+  // Noise space offset derived from the seed
+  double offsetx;
+  double offsety;
+
+  uint32 capacity;
+  uint32 count;
+
+  uint32 bucketCount;
+  world_tile** buckets;
+
+  world_tile* head;
+  world_tile* tail;
+
+  uint64 hits;
+  uint64 misses;
+} world_t;
+
+typedef world_t* world;
+
+static uint64 world_hash(int64 tx, int64 ty) {
+  return splitmix64(splitmix64((uint64) tx) ^ (uint64) ty);
+}
+
+// capacity is the most tiles kept in memory at once, each takes
+// WORLD_TILE * WORLD_TILE floats
+world world_alloc(uint64 seed, double freq, int depth, uint32 capacity) {
+  if (capacity == 0) {
+    capacity = 1;
+  }
+
+  world w = (world) calloc(1, sizeof(world_t));
+  if (!w) {
+    return NULL;
+  }
+
+  uint32 buckets = 16;
+  while (buckets < capacity * 2) {
+    buckets *= 2;
+  }
+
+  w->buckets = (world_tile**) calloc(buckets, sizeof(world_tile*));
+  if (!w->buckets) {
+    free(w);
+    return NULL;
+  }
+
+  uint64 key = splitmix64(seed);
+
+  w->seed = seed;
+  w->freq = freq;
+  w->depth = depth;
+  // The noise repeats every 256 units, so a whole multiple of that would
+  // give many seeds the same world. Fractional offsets don't line up with
+  // the period at any power of two frequency.
+  w->offsetx = (double) (key & 0xFFFFFFFF) / 65536.0;
+  w->offsety = (double) (key >> 32) / 65536.0;
+  w->capacity = capacity;
+  w->bucketCount = buckets;
+
+  // Sets up the batch noise tables before tiles get generated on the pool
+  perlin_batch_select();
+
+  return w;
+}
+
+static void world_tile_free(world_tile* tile) {
+  if (!tile) {
+    return;
+  }
+
+  free(tile->data);
+  free(tile);
+}
+
+void world_free(world w) {
+  if (!w) {
+    return;
+  }
+
+  world_tile* tile = w->head;
+  while (tile) {
+    world_tile* next = tile->next;
+    world_tile_free(tile);
+    tile = next;
+  }
+
+  free(w->buckets);
+  free(w);
+}
+
+static void world_unlink(world w, world_tile* tile) {
+  if (tile->prev) {
+    tile->prev->next = tile->next;
+  } else {
+    w->head = tile->next;
+  }
+
+  if (tile->next) {
+    tile->next->prev = tile->prev;
+  } else {
+    w->tail = tile->prev;
+  }
+
+  tile->prev = NULL;
+  tile->next = NULL;
+}
+
+static void world_push_front(world w, world_tile* tile) {
+  tile->prev = NULL;
+  tile->next = w->head;
+
+  if (w->head) {
+    w->head->prev = tile;
+  }
+
+  w->head = tile;
+
+  if (!w->tail) {
+    w->tail = tile;
+  }
+}
+
+static world_tile* world_find(world w, int64 tx, int64 ty) {
+  world_tile* tile = w->buckets[world_hash(tx, ty) & (w->bucketCount - 1)];
+
+  while (tile) {
+    if (tile->tx == tx && tile->ty == ty) {
+      return tile;
+    }
+
+    tile = tile->chain;
+  }
+
+  return NULL;
+}
+
+static void world_evict(world w) {
+  world_tile* tile = w->tail;
+  if (!tile) {
+    return;
+  }
+
+  world_tile** slot = &w->buckets[world_hash(tile->tx, tile->ty) & (w->bucketCount - 1)];
+  while (*slot != tile) {
+    slot = &(*slot)->chain;
+  }
+
+  *slot = tile->chain;
+
+  world_unlink(w, tile);
+  world_tile_free(tile);
+  w->count--;
+}
+
+static void world_insert(world w, world_tile* tile) {
+  while (w->count >= w->capacity) {
+    world_evict(w);
+  }
+
+  world_tile** slot = &w->buckets[world_hash(tile->tx, tile->ty) & (w->bucketCount - 1)];
+  tile->chain = *slot;
+  *slot = tile;
+
+  world_push_front(w, tile);
+  w->count++;
+}
+
+static void world_generate_tile(world w, world_tile* tile, double* xs, double* ys) {
+  int64 x0 = tile->tx * WORLD_TILE;
+  int64 y0 = tile->ty * WORLD_TILE;
+  double out[WORLD_TILE];
+
+  for (uint32 x = 0; x < WORLD_TILE; x++) {
+    xs[x] = (double) (x0 + x) + w->offsetx;
+  }
+
+  for (uint32 y = 0; y < WORLD_TILE; y++) {
+    double wy = (double) (y0 + y) + w->offsety;
+
+    for (uint32 x = 0; x < WORLD_TILE; x++) {
+      ys[x] = wy;
+    }
+
+    perlin2d_batch(xs, ys, w->freq, w->depth, out, WORLD_TILE);
+
+    float* row = tile->data + y * WORLD_TILE;
+    for (uint32 x = 0; x < WORLD_TILE; x++) {
+      row[x] = (float) out[x];
+    }
+  }
+}
+
+typedef struct {
+  world w;
+  world_tile** tiles;
+} world_gen_job;
+
+static void world_generate_task(void* ctx, uint32 task, uint32 worker) {
+  world_gen_job* job = (world_gen_job*) ctx;
+  double xs[WORLD_TILE];
+  double ys[WORLD_TILE];
+
+  world_generate_tile(job->w, job->tiles[task], xs, ys);
+}
+
+static int64 world_floordiv(int64 v, int64 d) {
+  int64 q = v / d;
+  if (v % d != 0 && (v < 0) != (d < 0)) {
+    q--;
+  }
+
+  return q;
+}
+
+// Copies the world rectangle at (x, y) of size width x height into out, with
+// rows stride floats apart. Missing tiles are generated on the pool, one row
+// of tiles at a time, and then added to the cache.
+uint8 world_region(threadpool pool, world w, int64 x, int64 y, uint32 width, uint32 height, float* out, uint64 stride) {
+  if (!w || !out) {
+    return 0;
+  }
+  if (width == 0 || height == 0) {
+    return 1;
+  }
+
+  int64 tx0 = world_floordiv(x, WORLD_TILE);
+  int64 ty0 = world_floordiv(y, WORLD_TILE);
+  int64 tx1 = world_floordiv(x + width - 1, WORLD_TILE);
+  int64 ty1 = world_floordiv(y + height - 1, WORLD_TILE);
+  uint32 across = (uint32) (tx1 - tx0 + 1);
+
+  world_tile** row = (world_tile**) calloc(across, sizeof(world_tile*));
+  world_tile** missing = (world_tile**) calloc(across, sizeof(world_tile*));
+  if (!row || !missing) {
+    free(row);
+    free(missing);
+    return 0;
+  }
+
+  uint8 ok = 1;
+
+  for (int64 ty = ty0; ty <= ty1 && ok; ty++) {
+    uint32 nmissing = 0;
+
+    for (int64 tx = tx0; tx <= tx1; tx++) {
+      world_tile* tile = world_find(w, tx, ty);
+
+      if (tile) {
+        w->hits++;
+        world_unlink(w, tile);
+        world_push_front(w, tile);
+      } else {
+        w->misses++;
+        tile = (world_tile*) calloc(1, sizeof(world_tile));
+        float* data = (float*) malloc(sizeof(float) * WORLD_TILE * WORLD_TILE);
+
+        if (!tile || !data) {
+          free(tile);
+          free(data);
+          ok = 0;
+          break;
+        }
+
+        tile->tx = tx;
+        tile->ty = ty;
+        tile->data = data;
+        missing[nmissing++] = tile;
+      }
+
+      row[tx - tx0] = tile;
+    }
+
+    if (ok) {
+      world_gen_job job = {
+        .w = w,
+        .tiles = missing
+      };
+
+      pool_run(pool, nmissing, world_generate_task, &job);
+
+      for (int64 tx = tx0; tx <= tx1; tx++) {
+        world_tile* tile = row[tx - tx0];
+
+        int64 sx0 = tx * WORLD_TILE > x ? tx * WORLD_TILE : x;
+        int64 sy0 = ty * WORLD_TILE > y ? ty * WORLD_TILE : y;
+        int64 sx1 = (tx + 1) * WORLD_TILE < x + width ? (tx + 1) * WORLD_TILE : x + width;
+        int64 sy1 = (ty + 1) * WORLD_TILE < y + height ? (ty + 1) * WORLD_TILE : y + height;
+
+        for (int64 sy = sy0; sy < sy1; sy++) {
+          const float* src = tile->data + (sy - ty * WORLD_TILE) * WORLD_TILE + (sx0 - tx * WORLD_TILE);
+          float* dst = out + (uint64) (sy - y) * stride + (uint64) (sx0 - x);
+          memcpy(dst, src, sizeof(float) * (sx1 - sx0));
+        }
+      }
+    }
+
+    // New tiles are only added once copied, so evicting can't pull a tile
+    // out from under this row
+    for (uint32 i = 0; i < nmissing; i++) {
+      if (ok) {
+        world_insert(w, missing[i]);
+      } else {
+        world_tile_free(missing[i]);
+      }
+    }
+  }
+
+  free(row);
+  free(missing);
+  return ok;
+}
+
+// Fills hmap with the part of the world whose top left corner is (x, y), so
+// the regular shaders can render any visible window of the world
+uint8 world_region_hmap(threadpool pool, world w, int64 x, int64 y, heightmap hmap) {
+  if (!hmap) {
+    return 0;
+  }
+
+  hmap->smallestValue = 0.0f;
+  hmap->greatestValue = 1.0f;
+
+  return world_region(pool, w, x, y, hmap->width, hmap->height, hmap->heightData, hmap->width);
+}